@@ -0,0 +1,436 @@
+// Copyright © 2015, The Network Protocol Company, Inc. All Rights Reserved.
+
+#include "platform.h"
+#include "snapshot.h"
+#include "shadow.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+static const int BenchCubes = 1024;
+static const int BenchIterations = 10000;
+
+inline float random_float( float min, float max )
+{
+    return min + ( max - min ) * ( rand() / float( RAND_MAX ) );
+}
+
+void bench_quantize()
+{
+    printf( "quantize %d cubes x %d iterations (%s)\n", BenchCubes, BenchIterations, VECTORIAL_SIMD_TYPE );
+
+    static CubeState cubes[BenchCubes];
+    static CubeStateBatch batch;
+    static QuantizedCubeState scalar_quantized[BenchCubes];
+    static QuantizedCubeState batch_quantized[BenchCubes];
+
+    batch.num_cubes = 0;
+
+    for ( int i = 0; i < BenchCubes; ++i )
+    {
+        CubeState & cube = cubes[i];
+        cube.position = vec3f( random_float( -PositionBoundXY, PositionBoundXY ), random_float( -PositionBoundXY, PositionBoundXY ), random_float( 0, PositionBoundZ ) );
+        cube.orientation = normalize( quat4f( random_float( -1, 1 ), random_float( -1, 1 ), random_float( -1, 1 ), random_float( -1, 1 ) ) );
+        cube.linear_velocity = vec3f(0,0,0);
+        cube.angular_velocity = vec3f(0,0,0);
+        cube_state_batch_add( batch, cube, i & 1 );
+    }
+
+    const double scalar_start_time = platform_time();
+
+    for ( int j = 0; j < BenchIterations; ++j )
+    {
+        for ( int i = 0; i < BenchCubes; ++i )
+            quantize_cube_state( cubes[i], i & 1, scalar_quantized[i] );
+    }
+
+    const double scalar_time = platform_time() - scalar_start_time;
+
+    const double batch_start_time = platform_time();
+
+    for ( int j = 0; j < BenchIterations; ++j )
+        quantize_cube_batch( batch, batch_quantized );
+
+    const double batch_time = platform_time() - batch_start_time;
+
+    int num_mismatches = 0;
+    for ( int i = 0; i < BenchCubes; ++i )
+    {
+        if ( scalar_quantized[i] != batch_quantized[i] )
+            num_mismatches++;
+    }
+
+    printf( "    scalar: %.3f ms (%.1f ns per-cube)\n", scalar_time * 1000.0 / BenchIterations, scalar_time * 1000000000.0 / ( BenchIterations * double( BenchCubes ) ) );
+    printf( "    batch:  %.3f ms (%.1f ns per-cube)\n", batch_time * 1000.0 / BenchIterations, batch_time * 1000000000.0 / ( BenchIterations * double( BenchCubes ) ) );
+    printf( "    speedup: %.2fx, %d mismatches\n", scalar_time / batch_time, num_mismatches );
+}
+
+void reference_snapshot_changes( const QuantizedSnapshot & current_snapshot, 
+                                 const QuantizedSnapshot & baseline_snapshot, 
+                                 const CompressionState & compression_state, 
+                                 bool * changed, 
+                                 SnapshotPrediction & prediction )
+{
+    // the per-cube scalar version of calculate_snapshot_changes
+
+    for ( int i = 0; i < MaxCubes; ++i )
+    {
+        QuantizedCubeState cube, base;
+        current_snapshot.GetCube( i, cube );
+        baseline_snapshot.GetCube( i, base );
+
+        changed[i] = cube != base;
+
+        const int drag_x = - ceil( compression_state.delta_x[i] * 0.062f );
+        const int drag_y = - ceil( compression_state.delta_y[i] * 0.062f );
+        const int drag_z = - ceil( compression_state.delta_z[i] * 0.062f );
+
+        prediction.position_x[i] = base.position_x + compression_state.delta_x[i] + drag_x;
+        prediction.position_y[i] = base.position_y + compression_state.delta_y[i] + drag_y;
+        prediction.position_z[i] = max( base.position_z + compression_state.delta_z[i] - 3 + drag_z, 105 );
+    }
+}
+
+void bench_snapshot_delta()
+{
+    printf( "snapshot delta %d cubes x %d iterations (%s)\n", MaxCubes, BenchIterations, VECTORIAL_SIMD_TYPE );
+
+    static QuantizedSnapshot previous_snapshot;
+    static QuantizedSnapshot baseline_snapshot;
+    static QuantizedSnapshot current_snapshot;
+    static QuantizedSnapshot read_snapshot;
+    static CompressionState compression_state;
+
+    for ( int i = 0; i < MaxCubes; ++i )
+    {
+        CubeState cube;
+        cube.position = vec3f( random_float( -PositionBoundXY, PositionBoundXY ), random_float( -PositionBoundXY, PositionBoundXY ), random_float( 0, PositionBoundZ ) );
+        cube.orientation = normalize( quat4f( random_float( -1, 1 ), random_float( -1, 1 ), random_float( -1, 1 ), random_float( -1, 1 ) ) );
+
+        QuantizedCubeState quantized;
+        quantize_cube_state( cube, false, quantized );
+        previous_snapshot.SetCube( i, quantized );
+
+        // one in ten cubes are moving
+
+        const bool moving = ( rand() % 10 ) == 0;
+        if ( moving )
+        {
+            quantized.position_x += rand() % 64 - 32;
+            quantized.position_y += rand() % 64 - 32;
+            quantized.position_z = max( 0, quantized.position_z - rand() % 32 );
+        }
+        baseline_snapshot.SetCube( i, quantized );
+
+        if ( moving )
+        {
+            quantized.position_x += rand() % 64 - 32;
+            quantized.position_y += rand() % 64 - 32;
+            quantized.interacting = rand() % 2;
+            quantized.orientation.integer_a = rand() % ( 1 << OrientationBits );
+        }
+        current_snapshot.SetCube( i, quantized );
+    }
+
+    calculate_compression_state( compression_state, baseline_snapshot, previous_snapshot );
+
+    static bool reference_changed[MaxCubes];
+    static SnapshotPrediction reference_prediction;
+    static SnapshotChanges changes;
+    static SnapshotPrediction prediction;
+
+    const double scalar_start_time = platform_time();
+
+    for ( int j = 0; j < BenchIterations; ++j )
+        reference_snapshot_changes( current_snapshot, baseline_snapshot, compression_state, reference_changed, reference_prediction );
+
+    const double scalar_time = platform_time() - scalar_start_time;
+
+    const double simd_start_time = platform_time();
+
+    for ( int j = 0; j < BenchIterations; ++j )
+        calculate_snapshot_changes( current_snapshot, baseline_snapshot, compression_state, changes, prediction );
+
+    const double simd_time = platform_time() - simd_start_time;
+
+    int num_mismatches = 0;
+    for ( int i = 0; i < MaxCubes; ++i )
+    {
+        if ( reference_changed[i] != snapshot_cube_changed( changes, i ) ||
+             reference_prediction.position_x[i] != prediction.position_x[i] ||
+             reference_prediction.position_y[i] != prediction.position_y[i] ||
+             reference_prediction.position_z[i] != prediction.position_z[i] )
+        {
+            num_mismatches++;
+        }
+    }
+
+    printf( "    scalar changes: %.3f ms\n", scalar_time * 1000.0 / BenchIterations );
+    printf( "    simd changes:   %.3f ms\n", simd_time * 1000.0 / BenchIterations );
+    printf( "    speedup: %.2fx, %d changed, %d mismatches\n", scalar_time / simd_time, changes.num_changed, num_mismatches );
+
+    static uint8_t buffer[MaxPacketSize*4];
+
+    const double write_start_time = platform_time();
+
+    int bytes = 0;
+    for ( int j = 0; j < BenchIterations; ++j )
+    {
+        WriteStream stream( buffer, sizeof( buffer ) );
+        serialize_snapshot_relative_to_baseline( stream, compression_state, current_snapshot, baseline_snapshot );
+        stream.Flush();
+        bytes = stream.GetBytesProcessed();
+    }
+
+    const double write_time = platform_time() - write_start_time;
+
+    ReadStream read_stream( buffer, bytes );
+    serialize_snapshot_relative_to_baseline( read_stream, compression_state, read_snapshot, baseline_snapshot );
+
+    printf( "    write: %.3f ms, %d bytes, read back %s\n", write_time * 1000.0 / BenchIterations, bytes, read_snapshot == current_snapshot ? "ok" : "MISMATCH" );
+}
+
+static const int RecordedFrames = 600;
+static const int RecordedBaselineFrames = 6;
+
+void record_snapshots( QuantizedSnapshot * snapshots, int num_frames )
+{
+    // there is no recorded traffic in the repository, so record a stand-in: cubes at rest on the ground, with a
+    // player wandering through them kicking cubes into the air. this gives the same mix of mostly unchanged cubes
+    // and a cluster of moving cubes as real play.
+
+    static CubeState cubes[MaxCubes];
+
+    const int grid_size = 32;
+
+    for ( int i = 0; i < MaxCubes; ++i )
+    {
+        cubes[i].position = vec3f( ( i % grid_size - grid_size / 2 ) * 1.5f, ( i / grid_size - grid_size / 2 ) * 1.5f, 0.5f );
+        cubes[i].orientation = quat4f::identity();
+        cubes[i].linear_velocity = vec3f(0,0,0);
+        cubes[i].angular_velocity = vec3f(0,0,0);
+    }
+
+    const float dt = 1.0f / 60.0f;
+
+    vec3f player( 0, 0, 0 );
+
+    for ( int frame = 0; frame < num_frames; ++frame )
+    {
+        const float t = frame * dt;
+
+        player = vec3f( 12.0f * sinf( t * 0.7f ), 12.0f * sinf( t * 0.45f + 1.0f ), 0.0f );
+
+        for ( int i = 0; i < MaxCubes; ++i )
+        {
+            CubeState & cube = cubes[i];
+
+            const vec3f difference = cube.position - player;
+
+            if ( length_squared( vec3f( difference.x(), difference.y(), 0 ) ) < 4.0f && cube.position.z() <= 0.5f )
+            {
+                cube.linear_velocity = vec3f( difference.x() * 2.0f, difference.y() * 2.0f, random_float( 2.0f, 6.0f ) );
+                cube.angular_velocity = vec3f( random_float( -5, 5 ), random_float( -5, 5 ), random_float( -5, 5 ) );
+            }
+
+            if ( length_squared( cube.linear_velocity ) == 0.0f && cube.position.z() <= 0.5f )
+                continue;
+
+            cube.linear_velocity += vec3f( 0, 0, -9.8f * dt );
+            cube.linear_velocity *= 0.99f;
+            cube.position += cube.linear_velocity * dt;
+
+            const vec3f axis = cube.angular_velocity * dt * 0.5f;
+            cube.orientation = normalize( cube.orientation * quat4f( axis.x(), axis.y(), axis.z(), 1.0f ) );
+
+            if ( cube.position.z() < 0.5f )
+            {
+                cube.position = vec3f( cube.position.x(), cube.position.y(), 0.5f );
+                cube.linear_velocity = vec3f( cube.linear_velocity.x() * 0.5f, cube.linear_velocity.y() * 0.5f, -cube.linear_velocity.z() * 0.3f );
+                cube.angular_velocity *= 0.5f;
+                if ( length_squared( cube.linear_velocity ) < 0.1f )
+                {
+                    cube.linear_velocity = vec3f(0,0,0);
+                    cube.angular_velocity = vec3f(0,0,0);
+                }
+            }
+        }
+
+        for ( int i = 0; i < MaxCubes; ++i )
+        {
+            QuantizedCubeState quantized;
+            quantize_cube_state( cubes[i], length_squared( cubes[i].linear_velocity ) > 0.0f, quantized );
+            snapshots[frame].SetCube( i, quantized );
+        }
+    }
+}
+
+void bench_entropy_coding()
+{
+    printf( "entropy coding %d recorded snapshots\n", RecordedFrames );
+
+    static QuantizedSnapshot snapshots[RecordedFrames];
+
+    record_snapshots( snapshots, RecordedFrames );
+
+    // train the model on the first half of the recording and measure on the second half
+
+    static EntropyModel untrained_model;
+    static EntropyModel trained_model;
+    static EntropyTrainer trainer;
+
+    entropy_model_reset( untrained_model );
+    entropy_model_reset( trained_model );
+    entropy_trainer_reset( trainer );
+
+    static CompressionState compression_state;
+    static QuantizedSnapshot read_snapshot;
+    static uint8_t buffer[MaxPacketSize*4];
+
+    const int first_frame = RecordedBaselineFrames * 2;
+    const int training_frames = RecordedFrames / 2;
+
+    for ( int frame = first_frame; frame < training_frames; ++frame )
+    {
+        const QuantizedSnapshot & baseline = snapshots[frame-RecordedBaselineFrames];
+        calculate_compression_state( compression_state, baseline, snapshots[frame-RecordedBaselineFrames*2] );
+        EntropyWriteStream stream( buffer, sizeof( buffer ), untrained_model );
+        stream.SetTrainer( &trainer );
+        serialize_snapshot_relative_to_baseline( stream, compression_state, snapshots[frame], baseline );
+    }
+
+    entropy_model_train( trained_model, trainer );
+
+    uint64_t num_changed = 0;
+    uint64_t bits[3] = { 0, 0, 0 };
+    int num_mismatches = 0;
+    double time[3] = { 0, 0, 0 };
+
+    for ( int frame = training_frames; frame < RecordedFrames; ++frame )
+    {
+        const QuantizedSnapshot & baseline = snapshots[frame-RecordedBaselineFrames];
+        calculate_compression_state( compression_state, baseline, snapshots[frame-RecordedBaselineFrames*2] );
+
+        SnapshotChanges changes;
+        SnapshotPrediction prediction;
+        calculate_snapshot_changes( snapshots[frame], baseline, compression_state, changes, prediction );
+        num_changed += changes.num_changed;
+
+        double start_time = platform_time();
+        {
+            WriteStream stream( buffer, sizeof( buffer ) );
+            serialize_snapshot_relative_to_baseline( stream, compression_state, snapshots[frame], baseline );
+            stream.Flush();
+            bits[0] += stream.GetBitsProcessed();
+        }
+        time[0] += platform_time() - start_time;
+
+        for ( int i = 0; i < 2; ++i )
+        {
+            const EntropyModel & model = i == 0 ? untrained_model : trained_model;
+
+            start_time = platform_time();
+
+            EntropyWriteStream write_stream( buffer, sizeof( buffer ), model );
+            serialize_snapshot_relative_to_baseline( write_stream, compression_state, snapshots[frame], baseline );
+            write_stream.Flush();
+            bits[1+i] += write_stream.GetBytesProcessed() * 8;
+
+            time[1+i] += platform_time() - start_time;
+
+            EntropyReadStream read_stream( buffer, write_stream.GetBytesProcessed(), model );
+            serialize_snapshot_relative_to_baseline( read_stream, compression_state, read_snapshot, baseline );
+            if ( read_stream.IsOverflow() || read_snapshot != snapshots[frame] )
+                num_mismatches++;
+        }
+    }
+
+    const int num_frames = RecordedFrames - training_frames;
+
+    const char * names[] = { "prefix codes", "entropy (untrained)", "entropy (trained)" };
+
+    for ( int i = 0; i < 3; ++i )
+    {
+        printf( "    %-20s %7.1f bytes per-snapshot, %5.2f bits per changed cube, %.3f ms\n", 
+            names[i], bits[i] / 8.0 / num_frames, bits[i] / double( num_changed ), time[i] * 1000.0 / num_frames );
+    }
+
+    printf( "    %.1f changed cubes per-snapshot, %d mismatches\n", num_changed / double( num_frames ), num_mismatches );
+}
+
+void bench_shadows()
+{
+    const int iterations = BenchIterations / 10;
+
+    printf( "shadow silhouettes %d cubes x %d iterations (%s)\n", BenchCubes, iterations, VECTORIAL_SIMD_TYPE );
+
+    static RenderState render_state;
+    static vec3f scalar_vertices[MaxCubeShadowVertices];
+    static vec3f batch_vertices[MaxCubeShadowVertices];
+    static int cube_index[BenchCubes];
+
+    render_state.num_cubes = BenchCubes;
+
+    for ( int i = 0; i < BenchCubes; ++i )
+    {
+        RenderCube & cube = render_state.cube[i];
+        cube.r = cube.g = cube.b = 1.0f;
+        cube.a = ( i % 8 ) ? 1.0f : 0.0f;
+        cube.position = vec3f( random_float( -PositionBoundXY, PositionBoundXY ), random_float( -PositionBoundXY, PositionBoundXY ), random_float( 1, 10 ) );
+        cube.orientation = normalize( quat4f( random_float( -1, 1 ), random_float( -1, 1 ), random_float( -1, 1 ), random_float( -1, 1 ) ) );
+        cube.scale = random_float( 0.2f, 1.0f );
+        cube_index[i] = i;
+    }
+
+    const vec3f light_position( 25.0f, 50.0f, 100.0f );
+
+    int num_scalar_vertices = 0;
+    int num_batch_vertices = 0;
+
+    const double scalar_start_time = platform_time();
+
+    for ( int j = 0; j < iterations; ++j )
+        num_scalar_vertices = generate_shadow_vertices_scalar( render_state.cube, cube_index, render_state.num_cubes, light_position, scalar_vertices, MaxCubeShadowVertices );
+
+    const double scalar_time = platform_time() - scalar_start_time;
+
+    const double batch_start_time = platform_time();
+
+    for ( int j = 0; j < iterations; ++j )
+        num_batch_vertices = generate_shadow_vertices( render_state.cube, cube_index, render_state.num_cubes, light_position, batch_vertices, MaxCubeShadowVertices );
+
+    const double batch_time = platform_time() - batch_start_time;
+
+    // edges come out in a different order, so compare vertex counts and the sum over all vertices
+
+    vec3f scalar_sum(0,0,0);
+    vec3f batch_sum(0,0,0);
+
+    for ( int i = 0; i < num_scalar_vertices; ++i )
+        scalar_sum += scalar_vertices[i];
+
+    for ( int i = 0; i < num_batch_vertices; ++i )
+        batch_sum += batch_vertices[i];
+
+    const float error = length( scalar_sum - batch_sum ) / length( scalar_sum );
+
+    printf( "    scalar: %.3f ms (%.1f ns per-cube)\n", scalar_time * 1000.0 / iterations, scalar_time * 1000000000.0 / ( iterations * double( BenchCubes ) ) );
+    printf( "    batch:  %.3f ms (%.1f ns per-cube)\n", batch_time * 1000.0 / iterations, batch_time * 1000000000.0 / ( iterations * double( BenchCubes ) ) );
+    printf( "    speedup: %.2fx, %d vs. %d vertices, relative error %g\n", scalar_time / batch_time, num_scalar_vertices, num_batch_vertices, error );
+}
+
+int main( int argc, char ** argv )
+{
+    srand( 0 );
+
+    platform_time();
+
+    bench_quantize();
+
+    bench_snapshot_delta();
+
+    bench_entropy_coding();
+
+    bench_shadows();
+
+    return 0;
+}
@@ -0,0 +1,168 @@
+// Copyright © 2015, The Network Protocol Company, Inc. All Rights Reserved.
+
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include "const.h"
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+// reliable transfer of a large block of data split into fragments. the receiver acks with a bitfield
+// of fragments received, and the sender resends any fragment not acked within the resend time.
+
+struct BlockSender
+{
+    bool sending = false;
+    bool complete = false;
+    uint16_t block_id = 0;
+    int block_size = 0;
+    int num_fragments = 0;
+    uint32_t acked = 0;                                     // bit n set when fragment n has been acked
+    const uint8_t * data = nullptr;
+    double fragment_send_time[MaxBlockFragments];
+};
+
+inline void block_sender_reset( BlockSender & sender )
+{
+    sender.sending = false;
+    sender.complete = false;
+    sender.block_id = 0;
+    sender.block_size = 0;
+    sender.num_fragments = 0;
+    sender.acked = 0;
+    sender.data = nullptr;
+}
+
+inline void block_sender_start( BlockSender & sender, uint16_t block_id, const uint8_t * data, int block_size )
+{
+    assert( data );
+    assert( block_size > 0 );
+    assert( block_size <= MaxBlockSize );
+
+    sender.sending = true;
+    sender.complete = false;
+    sender.block_id = block_id;
+    sender.block_size = block_size;
+    sender.num_fragments = ( block_size + BlockFragmentSize - 1 ) / BlockFragmentSize;
+    sender.acked = 0;
+    sender.data = data;
+
+    for ( int i = 0; i < sender.num_fragments; ++i )
+        sender.fragment_send_time[i] = -BlockFragmentResendTime;
+}
+
+inline int block_sender_fragment_bytes( const BlockSender & sender, int fragment_index )
+{
+    assert( fragment_index >= 0 );
+    assert( fragment_index < sender.num_fragments );
+    return ( fragment_index == sender.num_fragments - 1 ) ? sender.block_size - fragment_index * BlockFragmentSize : BlockFragmentSize;
+}
+
+inline int block_sender_next_fragment( BlockSender & sender, double time )
+{
+    // the next fragment that hasn't been acked and is due to be sent, or -1 if nothing needs sending yet
+
+    if ( !sender.sending )
+        return -1;
+
+    for ( int i = 0; i < sender.num_fragments; ++i )
+    {
+        if ( sender.acked & ( 1u << i ) )
+            continue;
+
+        if ( time - sender.fragment_send_time[i] >= BlockFragmentResendTime )
+        {
+            sender.fragment_send_time[i] = time;
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+inline void block_sender_process_ack( BlockSender & sender, uint16_t block_id, uint32_t acks )
+{
+    if ( !sender.sending || block_id != sender.block_id )
+        return;
+
+    const uint32_t all_fragments = ( sender.num_fragments == 32 ) ? 0xFFFFFFFF : ( 1u << sender.num_fragments ) - 1;
+
+    sender.acked |= acks & all_fragments;
+
+    if ( sender.acked == all_fragments )
+    {
+        sender.sending = false;
+        sender.complete = true;
+    }
+}
+
+struct BlockReceiver
+{
+    bool receiving = false;
+    bool complete = false;
+    uint16_t block_id = 0;
+    int block_size = 0;
+    int num_fragments = 0;
+    uint32_t received = 0;                                  // bit n set when fragment n has been received. sent back as acks
+    uint8_t * data = nullptr;                               // MaxBlockSize bytes, owned by the caller
+};
+
+inline void block_receiver_reset( BlockReceiver & receiver )
+{
+    receiver.receiving = false;
+    receiver.complete = false;
+    receiver.block_id = 0;
+    receiver.block_size = 0;
+    receiver.num_fragments = 0;
+    receiver.received = 0;
+}
+
+inline bool block_receiver_process_fragment( BlockReceiver & receiver, uint16_t block_id, int block_size, int fragment_index, const uint8_t * fragment_data, int fragment_bytes )
+{
+    // returns true when this fragment completes the block
+
+    assert( receiver.data );
+
+    if ( block_size <= 0 || block_size > MaxBlockSize )
+        return false;
+
+    if ( !receiver.receiving )
+    {
+        receiver.receiving = true;
+        receiver.complete = false;
+        receiver.block_id = block_id;
+        receiver.block_size = block_size;
+        receiver.num_fragments = ( block_size + BlockFragmentSize - 1 ) / BlockFragmentSize;
+        receiver.received = 0;
+    }
+
+    if ( block_id != receiver.block_id || block_size != receiver.block_size )
+        return false;
+
+    if ( receiver.complete || fragment_index < 0 || fragment_index >= receiver.num_fragments )
+        return false;
+
+    const int expected_bytes = ( fragment_index == receiver.num_fragments - 1 ) ? block_size - fragment_index * BlockFragmentSize : BlockFragmentSize;
+    if ( fragment_bytes != expected_bytes )
+        return false;
+
+    if ( receiver.received & ( 1u << fragment_index ) )
+        return false;
+
+    memcpy( receiver.data + fragment_index * BlockFragmentSize, fragment_data, fragment_bytes );
+
+    receiver.received |= 1u << fragment_index;
+
+    const uint32_t all_fragments = ( receiver.num_fragments == 32 ) ? 0xFFFFFFFF : ( 1u << receiver.num_fragments ) - 1;
+
+    if ( receiver.received == all_fragments )
+    {
+        receiver.complete = true;
+        return true;
+    }
+
+    return false;
+}
+
+#endif // #ifndef BLOCK_H
@@ -0,0 +1,117 @@
+// Copyright © 2015, The Network Protocol Company, Inc. All Rights Reserved.
+
+#ifndef CHALLENGE_H
+#define CHALLENGE_H
+
+#include "const.h"
+#include "network.h"
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+// stateless connection challenge. the server answers a connection request with a token that is a keyed hash of
+// the client address, guid, connect sequence and the time the challenge was issued. the client must echo the token
+// back before the server reserves a slot, so spoofed request floods cost the server one hash and one small reply.
+
+inline uint64_t siphash_rotate( uint64_t x, int b )
+{
+    return ( x << b ) | ( x >> ( 64 - b ) );
+}
+
+inline void siphash_round( uint64_t & v0, uint64_t & v1, uint64_t & v2, uint64_t & v3 )
+{
+    v0 += v1; v1 = siphash_rotate( v1, 13 ); v1 ^= v0; v0 = siphash_rotate( v0, 32 );
+    v2 += v3; v3 = siphash_rotate( v3, 16 ); v3 ^= v2;
+    v0 += v3; v3 = siphash_rotate( v3, 21 ); v3 ^= v0;
+    v2 += v1; v1 = siphash_rotate( v1, 17 ); v1 ^= v2; v2 = siphash_rotate( v2, 32 );
+}
+
+inline uint64_t siphash_load64( const uint8_t * p )
+{
+    return uint64_t( p[0] )       | uint64_t( p[1] ) << 8  | uint64_t( p[2] ) << 16 | uint64_t( p[3] ) << 24 |
+           uint64_t( p[4] ) << 32 | uint64_t( p[5] ) << 40 | uint64_t( p[6] ) << 48 | uint64_t( p[7] ) << 56;
+}
+
+inline uint64_t siphash24( const uint8_t key[ChallengeKeyBytes], const uint8_t * data, int bytes )
+{
+    static_assert( ChallengeKeyBytes == 16, "siphash takes a 128 bit key" );
+
+    const uint64_t k0 = siphash_load64( key );
+    const uint64_t k1 = siphash_load64( key + 8 );
+
+    uint64_t v0 = k0 ^ 0x736f6d6570736575ULL;
+    uint64_t v1 = k1 ^ 0x646f72616e646f6dULL;
+    uint64_t v2 = k0 ^ 0x6c7967656e657261ULL;
+    uint64_t v3 = k1 ^ 0x7465646279746573ULL;
+
+    const int num_blocks = bytes / 8;
+
+    for ( int i = 0; i < num_blocks; ++i )
+    {
+        const uint64_t m = siphash_load64( data + i * 8 );
+        v3 ^= m;
+        siphash_round( v0, v1, v2, v3 );
+        siphash_round( v0, v1, v2, v3 );
+        v0 ^= m;
+    }
+
+    uint64_t last = uint64_t( bytes ) << 56;
+    const uint8_t * tail = data + num_blocks * 8;
+    for ( int i = 0; i < ( bytes & 7 ); ++i )
+        last |= uint64_t( tail[i] ) << ( i * 8 );
+
+    v3 ^= last;
+    siphash_round( v0, v1, v2, v3 );
+    siphash_round( v0, v1, v2, v3 );
+    v0 ^= last;
+
+    v2 ^= 0xFF;
+    for ( int i = 0; i < 4; ++i )
+        siphash_round( v0, v1, v2, v3 );
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+inline uint64_t challenge_token( const uint8_t key[ChallengeKeyBytes], const Address & address, uint64_t client_guid, uint16_t connect_sequence, uint64_t timestamp )
+{
+    uint8_t data[64];
+    int bytes = 0;
+
+    const uint8_t type = (uint8_t) address.GetType();
+    memcpy( data + bytes, &type, 1 );                                               bytes += 1;
+
+    if ( address.GetType() == ADDRESS_IPV6 )
+    {
+        memcpy( data + bytes, address.GetAddress6(), 16 );                          bytes += 16;
+    }
+    else
+    {
+        const uint32_t address4 = address.GetAddress4();
+        memcpy( data + bytes, &address4, 4 );                                       bytes += 4;
+    }
+
+    const uint16_t port = address.GetPort();
+    memcpy( data + bytes, &port, 2 );                                               bytes += 2;
+    memcpy( data + bytes, &client_guid, 8 );                                        bytes += 8;
+    memcpy( data + bytes, &connect_sequence, 2 );                                   bytes += 2;
+    memcpy( data + bytes, &timestamp, 8 );                                          bytes += 8;
+
+    assert( bytes <= (int) sizeof( data ) );
+
+    return siphash24( key, data, bytes );
+}
+
+inline uint64_t challenge_timestamp( double real_time )
+{
+    return uint64_t( real_time * 1000.0 );
+}
+
+inline bool challenge_timestamp_valid( uint64_t timestamp, double real_time )
+{
+    // tokens are only good for a short time after they are issued, so a captured token can't be replayed later
+
+    const uint64_t now = challenge_timestamp( real_time );
+    return timestamp <= now && now - timestamp <= uint64_t( ChallengeTimeout * 1000.0 );
+}
+
+#endif // #ifndef CHALLENGE_H
@@ -7,17 +7,26 @@
 #include "game.h"
 #include "world.h"
 #include "render.h"
+#include "interpolation.h"
+#include "block.h"
 #include <stdio.h>
+#include <atomic>
 
 auto server_address = Address( "127.0.0.1", ServerPort );
 //auto server_address = Address( "173.255.195.190", ServerPort );
 
 #define HEADLESS 0
 #define RUN_TESTS 0
+#define PROFILE_PACKETS 0
+#define PROFILE_OVERLAY 0
 
 #if !HEADLESS
+#include "triple_buffer.h"
+#include "profiler.h"
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#include <thread>
+#include <mutex>
 #endif // #if !HEADLESS
 
 Render render;
@@ -28,6 +37,7 @@ enum ClientState
 {
     CLIENT_DISCONNECTED,
     CLIENT_SENDING_CONNECT_REQUEST,
+    CLIENT_SENDING_CHALLENGE_RESPONSE,
     CLIENT_CONNECTION_DENIED,
     CLIENT_TIMED_OUT,
     CLIENT_CONNECTED
@@ -46,6 +56,10 @@ struct Client
     ClientState state;
     Address server_address;
     uint16_t connect_sequence;
+
+    uint64_t server_guid;                   // from the connection challenge. the server only accepts responses that echo it back
+    uint64_t challenge_timestamp;
+    uint64_t challenge_token;
     
     double current_real_time;
     double time_last_packet_received;
@@ -74,13 +88,34 @@ struct Client
 
     bool suppress_send_packets;
 
-    // hack: we just need this position of one cube for now -- eventually this will be a ring buffer of snapshots containing all world state
-    vec3f cube_position;
-    quat4f cube_orientation;
-    vec3f cube_linear_velocity;
-    vec3f cube_angular_velocity;
+    InterpolationBuffer * interpolation_buffer;
+
+    ConnectionData connection;
+
+    uint64_t snapshot_ack;
+    bool received_delta;
+    SnapshotHistory * snapshot_history;
+
+    BlockReceiver block_receiver;
+    WorldBlock * world_block;
+    bool world_block_ready;                 // world block received and waiting to be applied to the world
+    bool world_received;                    // world block has been applied. the world stays inactive until then
+
+    PacketBufferPool packet_buffer_pool;
+
+    PacketFactory packet_factory;
+
+#if PROFILE_PACKETS
+    PacketProfile packet_profile;
+#endif // #if PROFILE_PACKETS
 };
 
+bool client_process_connection_challenge( const Address & from, Packet & base_packet, void * context );
+bool client_process_connection_accepted( const Address & from, Packet & base_packet, void * context );
+bool client_process_connection_denied( const Address & from, Packet & base_packet, void * context );
+bool client_process_snapshot( const Address & from, Packet & base_packet, void * context );
+bool client_process_block_fragment( const Address & from, Packet & base_packet, void * context );
+
 void client_init( Client & client )
 {
     memset( &client, 0, sizeof( Client ) );
@@ -88,12 +123,19 @@ void client_init( Client & client )
     client.guid = rand();
     client.state = CLIENT_DISCONNECTED;
     client.suppress_send_packets = false;
-
-    // hack
-    client.cube_position = vec3f(0,0,0);
-    client.cube_orientation = quat4f::identity();
-    client.cube_linear_velocity = vec3f(0,0,0);
-    client.cube_angular_velocity = vec3f(0,0,0);
+    client.interpolation_buffer = new InterpolationBuffer();
+    interpolation_buffer_reset( *client.interpolation_buffer );
+    client.snapshot_history = new SnapshotHistory();
+    snapshot_history_reset( *client.snapshot_history );
+    packet_buffer_pool_init( client.packet_buffer_pool );
+    packet_factory_init( client.packet_factory );
+    packet_factory_register( client.packet_factory, PACKET_TYPE_CONNECTION_CHALLENGE, client_process_connection_challenge );
+    packet_factory_register( client.packet_factory, PACKET_TYPE_CONNECTION_ACCEPTED, client_process_connection_accepted );
+    packet_factory_register( client.packet_factory, PACKET_TYPE_CONNECTION_DENIED, client_process_connection_denied );
+    packet_factory_register( client.packet_factory, PACKET_TYPE_SNAPSHOT, client_process_snapshot );
+    packet_factory_register( client.packet_factory, PACKET_TYPE_BLOCK_FRAGMENT, client_process_block_fragment );
+    client.block_receiver.data = new uint8_t[MaxBlockSize];
+    client.world_block = new WorldBlock();
 }
 
 void client_connect( Client & client, const Address & address, double current_real_time )
@@ -118,11 +160,22 @@ void client_connect( Client & client, const Address & address, double current_re
     client.active = false;
     client.input_ack = 0;
     client.connect_sequence++;
+    client.server_guid = 0;
+    client.challenge_timestamp = 0;
+    client.challenge_token = 0;
     client.reconnect = false;
     client.adjustment_offset = 0;
     client.adjustment_sequence = 0;
     client.ready_to_apply_adjustment_offset = false;
     memset( client.inputs, 0, sizeof( client.inputs ) );
+    interpolation_buffer_reset( *client.interpolation_buffer );
+    connection_reset( client.connection );
+    client.snapshot_ack = 0;
+    client.received_delta = false;
+    snapshot_history_reset( *client.snapshot_history );
+    block_receiver_reset( client.block_receiver );
+    client.world_block_ready = false;
+    client.world_received = false;
 }
 
 void client_reconnect( Client & client, double current_real_time )
@@ -155,14 +208,23 @@ void client_apply_snapshot( Client & client, World & world )
     if ( !client.active )
         return;
 
-    /*
-    printf( "cube_position = (%f,%f,%f)\n", client.cube_position.x(), client.cube_position.y(), client.cube_position.z() );
-    printf( "cube_orientation = (%f,%f,%f,%f)\n", client.cube_orientation.x(), client.cube_orientation.y(), client.cube_orientation.z(), client.cube_orientation.w() );
-    printf( "cube_linear_velocity = (%f,%f,%f)\n", client.cube_linear_velocity.x(), client.cube_linear_velocity.y(), client.cube_linear_velocity.z() );
-    printf( "cube_angular_velocity = (%f,%f,%f)\n", client.cube_angular_velocity.x(), client.cube_angular_velocity.y(), client.cube_angular_velocity.z() );
-    */
+    InterpolationBuffer & interpolation_buffer = *client.interpolation_buffer;
+
+    interpolation_buffer_update( interpolation_buffer, client.current_real_time );
 
-    world.cube_manager->SetCubeState( 0, client.cube_position, client.cube_orientation, client.cube_linear_velocity, client.cube_angular_velocity );
+    CubeManager & cube_manager = *world.cube_manager;
+
+    for ( int i = 0; i < MaxCubes; ++i )
+    {
+        if ( !cube_manager.allocated[i] )
+            continue;
+
+        CubeState state;
+        if ( !interpolation_buffer_sample( interpolation_buffer, cube_manager.cubes[i].entity_index, state ) )
+            continue;
+
+        cube_manager.SetCubeState( i, state.position, state.orientation, state.linear_velocity, state.angular_velocity );
+    }
 }
 
 void client_add_input( Client & client, const Input & input, uint64_t tick, int num_inputs )
@@ -178,19 +240,28 @@ void client_add_input( Client & client, const Input & input, uint64_t tick, int
 
 void client_send_packet( Client & client, Packet & packet )
 {
-    uint8_t buffer[MaxPacketSize];
+    uint8_t * buffer = packet_buffer_alloc( client.packet_buffer_pool );
+    if ( !buffer )
+        return;
+
     int packet_bytes = 0;
     WriteStream stream( buffer, MaxPacketSize );
     if ( write_packet( stream, packet, packet_bytes ) )
     {
         if ( client.socket->SendPacket( client.server_address, buffer, packet_bytes ) )
         {
+#if PROFILE_PACKETS
+            packet_profile_add( client.packet_profile, packet, packet_bytes );
+#endif // #if PROFILE_PACKETS
+
             /*
             char address_buffer[1024];
             printf( "sent %s packet to server %s\n", packet_type_string( packet.type ), client.server_address.ToString( address_buffer, sizeof( address_buffer ) ) );
             */
         }
     }
+
+    packet_buffer_free( client.packet_buffer_pool, buffer );
 }
 
 void client_send_packets( Client & client )
@@ -213,11 +284,31 @@ void client_send_packets( Client & client )
         }
         break;
 
+        case CLIENT_SENDING_CHALLENGE_RESPONSE:
+        {
+            ConnectionResponsePacket packet;
+            packet.type = PACKET_TYPE_CONNECTION_RESPONSE;
+            packet.client_guid = client.guid;
+            packet.connect_sequence = client.connect_sequence;
+            packet.server_guid = client.server_guid;
+            packet.challenge_timestamp = client.challenge_timestamp;
+            packet.challenge_token = client.challenge_token;
+            client_send_packet( client, packet );
+        }
+        break;
+
         case CLIENT_CONNECTED:
         {
             InputPacket packet;
             packet.type = PACKET_TYPE_INPUT;
+            connection_write_header( client.connection, packet.header, client.current_real_time );
             packet.synchronizing = client.synchronizing;
+
+            // keep acking world block fragments until the server starts sending deltas, which means it got them all
+
+            packet.block_ack = client.block_receiver.receiving && !client.received_delta;
+            packet.block_id = client.block_receiver.block_id;
+            packet.block_acks = client.block_receiver.received;
             if ( client.synchronizing )
             {
                 packet.sync_offset = client.sync_offset;
@@ -229,6 +320,7 @@ void client_send_packets( Client & client )
                 packet.tick = client.client_tick + TicksPerClientFrame - 1;
                 packet.adjustment_sequence = client.adjustment_sequence;
                 packet.bracketed = client.bracketed;
+                packet.snapshot_ack = client.snapshot_ack;
                 packet.num_inputs = 0;
                 for ( int i = 0; i < MaxInputsPerPacket; ++i )
                 {
@@ -253,96 +345,268 @@ void client_send_packets( Client & client )
     }
 }
 
-bool process_packet( const Address & from, Packet & base_packet, void * context )
+void client_process_snapshot_delta( Client & client, SnapshotPacket & packet )
 {
-    Client & client = *(Client*)context;
+    const QuantizedSnapshot * baseline_snapshot = snapshot_history_find( *client.snapshot_history, packet.baseline_tick );
+    if ( !baseline_snapshot )
+        return;
+
+    if ( packet.delta_bytes % 4 )
+        return;
+
+    static const CompressionState compression_state = {};
+
+    QuantizedSnapshot current_snapshot;
+
+    ReadStream stream( packet.delta_data, packet.delta_bytes );
+    serialize_snapshot_relative_to_baseline( stream, compression_state, current_snapshot, *baseline_snapshot );
+    if ( stream.IsOverflow() )
+        return;
+
+    // only cubes that changed since the last full snapshot need new interpolation samples. the others hold
+    // at their most recent sample. velocity is not in the delta, so estimate it from the change in position
+    // and orientation since the previous snapshot.
 
-    switch ( base_packet.type )
+    const QuantizedSnapshot * previous_snapshot = snapshot_history_find( *client.snapshot_history, client.snapshot_ack );
+    if ( !previous_snapshot )
+        previous_snapshot = baseline_snapshot;
+
+    const uint64_t previous_tick = ( previous_snapshot == baseline_snapshot ) ? packet.baseline_tick : client.snapshot_ack;
+
+    const float inverse_delta_time = previous_tick > 0 ? float( 1.0 / ( ( packet.tick - previous_tick ) * TickDeltaTime ) ) : 0.0f;
+
+    for ( int i = 0; i < MaxCubes; ++i )
     {
-        case PACKET_TYPE_CONNECTION_ACCEPTED:
+        if ( current_snapshot.position_x[i] == previous_snapshot->position_x[i] &&
+             current_snapshot.position_y[i] == previous_snapshot->position_y[i] &&
+             current_snapshot.position_z[i] == previous_snapshot->position_z[i] &&
+             current_snapshot.orientation[i] == previous_snapshot->orientation[i] &&
+             current_snapshot.interacting[i] == previous_snapshot->interacting[i] )
+            continue;
+
+        QuantizedCubeState quantized_cube, previous_quantized_cube;
+        current_snapshot.GetCube( i, quantized_cube );
+        previous_snapshot->GetCube( i, previous_quantized_cube );
+
+        CubeState cube_state, previous_cube_state;
+        dequantize_cube_state( quantized_cube, cube_state );
+        dequantize_cube_state( previous_quantized_cube, previous_cube_state );
+        cube_state.linear_velocity = ( cube_state.position - previous_cube_state.position ) * inverse_delta_time;
+        cube_state.angular_velocity = estimate_angular_velocity( previous_cube_state.orientation, cube_state.orientation, inverse_delta_time );
+
+        // a cube that was at rest has no samples since it stopped, possibly seconds ago. hold it at rest up to the
+        // previous snapshot, otherwise the curve to this sample would span the whole rest and overshoot
+
+        if ( previous_tick > 0 && interpolation_buffer_most_recent_tick( *client.interpolation_buffer, i ) < previous_tick )
         {
-            ConnectionAcceptedPacket & packet = (ConnectionAcceptedPacket&) base_packet;
-            if ( client.state == CLIENT_SENDING_CONNECT_REQUEST &&
-                 packet.client_guid == client.guid && packet.connect_sequence == client.connect_sequence )
-            {
-                printf( "client connected (%d)\n", client.connect_sequence );
-                client.state = CLIENT_CONNECTED;
-                return true;
-            }
+            previous_cube_state.linear_velocity = vec3f(0,0,0);
+            previous_cube_state.angular_velocity = vec3f(0,0,0);
+            interpolation_buffer_add_cube( *client.interpolation_buffer, i, previous_tick, previous_cube_state );
         }
-        break;
 
-        case PACKET_TYPE_CONNECTION_DENIED:
+        interpolation_buffer_add_cube( *client.interpolation_buffer, i, packet.tick, cube_state );
+    }
+
+    snapshot_history_insert( *client.snapshot_history, packet.tick ) = current_snapshot;
+
+    client.snapshot_ack = packet.tick;
+    client.received_delta = true;
+}
+
+void client_process_world_block( Client & client )
+{
+    BlockReceiver & receiver = client.block_receiver;
+
+    if ( receiver.block_size % 4 )
+        return;
+
+    WorldBlock & block = *client.world_block;
+
+    ReadStream stream( receiver.data, receiver.block_size );
+    serialize_world_block( stream, block );
+    if ( stream.IsOverflow() || block.tick == 0 )
+        return;
+
+    printf( "client received world block: %d cubes, %d bytes\n", block.num_cubes, receiver.block_size );
+
+    // the world block snapshot is the first baseline the server can send deltas against
+
+    snapshot_history_insert( *client.snapshot_history, block.tick ) = block.snapshot;
+
+    client.snapshot_ack = block.tick;
+
+    client.world_block_ready = true;
+}
+
+void client_apply_world_block( Client & client, World & world )
+{
+    if ( !client.world_block_ready )
+        return;
+
+    const WorldBlock & block = *client.world_block;
+
+    for ( int i = 0; i < block.num_cubes; ++i )
+    {
+        const int entity_index = block.entity_index[i];
+
+        QuantizedCubeState quantized_cube;
+        block.snapshot.GetCube( entity_index, quantized_cube );
+
+        CubeState cube_state;
+        dequantize_cube_state( quantized_cube, cube_state );
+
+        if ( !world.entity_manager->GetEntity( entity_index ) )
         {
-            ConnectionDeniedPacket & packet = (ConnectionDeniedPacket&) base_packet;
-            if ( client.state == CLIENT_SENDING_CONNECT_REQUEST &&
-                 packet.client_guid == client.guid && packet.connect_sequence == client.connect_sequence )
+            if ( !world.cube_manager->CreateCube( cube_state.position, block.scale[i], false, entity_index ) )
+                continue;
+        }
+
+        const int cube_index = world.cube_manager->entity_index_to_cube_index[entity_index];
+
+        world.cube_manager->SetCubeState( cube_index, cube_state.position, cube_state.orientation, vec3f(0,0,0), vec3f(0,0,0) );
+    }
+
+    client.world_block_ready = false;
+    client.world_received = true;
+}
+
+bool client_process_connection_challenge( const Address & from, Packet & base_packet, void * context )
+{
+    Client & client = *(Client*)context;
+
+    ConnectionChallengePacket & packet = (ConnectionChallengePacket&) base_packet;
+    if ( client.state == CLIENT_SENDING_CONNECT_REQUEST &&
+         packet.client_guid == client.guid && packet.connect_sequence == client.connect_sequence )
+    {
+        client.state = CLIENT_SENDING_CHALLENGE_RESPONSE;
+        client.server_guid = packet.server_guid;
+        client.challenge_timestamp = packet.challenge_timestamp;
+        client.challenge_token = packet.challenge_token;
+        return true;
+    }
+
+    return false;
+}
+
+bool client_process_connection_accepted( const Address & from, Packet & base_packet, void * context )
+{
+    Client & client = *(Client*)context;
+
+    ConnectionAcceptedPacket & packet = (ConnectionAcceptedPacket&) base_packet;
+    if ( client.state == CLIENT_SENDING_CHALLENGE_RESPONSE && packet.server_guid == client.server_guid &&
+         packet.client_guid == client.guid && packet.connect_sequence == client.connect_sequence )
+    {
+        printf( "client connected (%d)\n", client.connect_sequence );
+        client.state = CLIENT_CONNECTED;
+        return true;
+    }
+
+    return false;
+}
+
+bool client_process_connection_denied( const Address & from, Packet & base_packet, void * context )
+{
+    Client & client = *(Client*)context;
+
+    ConnectionDeniedPacket & packet = (ConnectionDeniedPacket&) base_packet;
+    if ( client.state == CLIENT_SENDING_CHALLENGE_RESPONSE && packet.server_guid == client.server_guid &&
+         packet.client_guid == client.guid && packet.connect_sequence == client.connect_sequence )
+    {
+        printf( "client connection denied (%d)\n", client.connect_sequence );
+        client.state = CLIENT_CONNECTION_DENIED;
+        return true;
+    }
+
+    return false;
+}
+
+bool client_process_snapshot( const Address & from, Packet & base_packet, void * context )
+{
+    Client & client = *(Client*)context;
+
+    SnapshotPacket & packet = (SnapshotPacket&) base_packet;            
+
+    if ( client.state == CLIENT_CONNECTED )
+        connection_process_header( client.connection, packet.header, client.current_real_time );
+
+    if ( client.state == CLIENT_CONNECTED && packet.tick > client.server_tick )
+    {
+        if ( !client.synchronizing && packet.synchronizing )
+        {
+            printf( "client synchronizing\n" );
+            client.synchronizing = true;
+        }
+        
+        if ( client.synchronizing )
+        {
+            if ( !packet.synchronizing && !client.ready_to_apply_sync )
             {
-                printf( "client connection denied (%d)\n", client.connect_sequence );
-                client.state = CLIENT_CONNECTION_DENIED;
-                return true;
+                client.ready_to_apply_sync = true;
+            }
+            else
+            {
+                client.server_tick = packet.tick;
+                client.sync_offset = packet.sync_offset;
             }
         }
-        break;
-
-        case PACKET_TYPE_SNAPSHOT:
+        else
         {
-            SnapshotPacket & packet = (SnapshotPacket&) base_packet;            
-            if ( client.state == CLIENT_CONNECTED && packet.tick > client.server_tick )
+            if ( !packet.synchronizing )
             {
-                if ( !client.synchronizing && packet.synchronizing )
+                if ( client.bracketing && !packet.bracketing )
+                {
+                    client.ready_to_apply_bracket_offset = true;
+                    client.bracket_offset = packet.bracket_offset;
+                }
+
+                client.reconnect = packet.reconnect;
+                client.bracketing = packet.bracketing;
+                client.input_ack = packet.input_ack;
+                client.server_tick = packet.tick;
+
+                if ( client.adjustment_sequence != packet.adjustment_sequence ) // && packet.adjustment_offset != 0 )
                 {
-                    printf( "client synchronizing\n" );
-                    client.synchronizing = true;
+                    client.adjustment_sequence = packet.adjustment_sequence;
+                    client.adjustment_offset = packet.adjustment_offset;
+                    client.ready_to_apply_adjustment_offset = true;
                 }
-                
-                if ( client.synchronizing )
+
+                interpolation_buffer_add_snapshot( *client.interpolation_buffer, packet.tick, client.current_real_time );
+
+                if ( packet.delta )
                 {
-                    if ( !packet.synchronizing && !client.ready_to_apply_sync )
-                    {
-                        client.ready_to_apply_sync = true;
-                    }
-                    else
-                    {
-                        client.server_tick = packet.tick;
-                        client.sync_offset = packet.sync_offset;
-                    }
+                    client_process_snapshot_delta( client, packet );
                 }
                 else
                 {
-                    if ( !packet.synchronizing )
+                    for ( int i = 0; i < packet.num_cubes; ++i )
                     {
-                        if ( client.bracketing && !packet.bracketing )
-                        {
-                            client.ready_to_apply_bracket_offset = true;
-                            client.bracket_offset = packet.bracket_offset;
-                        }
-
-                        client.reconnect = packet.reconnect;
-                        client.bracketing = packet.bracketing;
-                        client.input_ack = packet.input_ack;
-                        client.server_tick = packet.tick;
-
-                        if ( client.adjustment_sequence != packet.adjustment_sequence ) // && packet.adjustment_offset != 0 )
-                        {
-                            client.adjustment_sequence = packet.adjustment_sequence;
-                            client.adjustment_offset = packet.adjustment_offset;
-                            client.ready_to_apply_adjustment_offset = true;
-                        }
-
-                        client.cube_position = packet.cube_position;
-                        client.cube_orientation = packet.cube_orientation;
-                        client.cube_linear_velocity = packet.cube_linear_velocity;
-                        client.cube_angular_velocity = packet.cube_angular_velocity;
+                        const SnapshotCube & cube = packet.cubes[i];
+                        CubeState cube_state;
+                        dequantize_cube_state( cube.state, cube_state );
+                        cube_state.linear_velocity = cube.linear_velocity;
+                        cube_state.angular_velocity = cube.angular_velocity;
+                        interpolation_buffer_add_cube( *client.interpolation_buffer, cube.entity_index, packet.tick, cube_state );
                     }
                 }
             }
-            return true;
         }
-        break;
+    }
+    return true;
+}
 
-        default:
-            break;
+bool client_process_block_fragment( const Address & from, Packet & base_packet, void * context )
+{
+    Client & client = *(Client*)context;
+
+    BlockFragmentPacket & packet = (BlockFragmentPacket&) base_packet;
+    if ( client.state == CLIENT_CONNECTED && packet.block_id == client.connect_sequence )
+    {
+        connection_process_header( client.connection, packet.header, client.current_real_time );
+
+        if ( block_receiver_process_fragment( client.block_receiver, packet.block_id, packet.block_size, packet.fragment_index, packet.fragment_data, packet.fragment_bytes ) )
+            client_process_world_block( client );
+        return true;
     }
 
     return false;
@@ -350,25 +614,29 @@ bool process_packet( const Address & from, Packet & base_packet, void * context
 
 void client_receive_packets( Client & client )
 {
-    uint8_t buffer[MaxPacketSize];
+    uint8_t * buffer = packet_buffer_alloc( client.packet_buffer_pool );
+    if ( !buffer )
+        return;
 
     while ( true )
     {
         Address from;
-        int bytes_read = client.socket->ReceivePacket( from, buffer, sizeof( buffer ) );
+        int bytes_read = client.socket->ReceivePacket( from, buffer, MaxPacketSize );
         if ( bytes_read == 0 )
             break;
 
-        if ( read_packet( from, buffer, bytes_read, &client ) )
+        if ( read_packet( client.packet_factory, from, buffer, bytes_read, &client ) )
             client.time_last_packet_received = client.current_real_time;
     }
+
+    packet_buffer_free( client.packet_buffer_pool, buffer );
 }
 
 void client_apply_time_synchronization( Client & client, World & world )
 {
     if ( client.synchronizing && client.ready_to_apply_sync )
     {
-        printf( "client synchronized [+%d]\n", (int) client.sync_offset );
+        printf( "client synchronized [+%d] (rtt %.1fms, jitter %.1fms)\n", (int) client.sync_offset, client.connection.rtt * 1000.0, client.connection.jitter * 1000.0 );
         world.tick = client.server_tick + client.sync_offset;
         client.client_tick = world.tick;
         client.synchronizing = false;
@@ -409,19 +677,28 @@ void client_apply_time_synchronization( Client & client, World & world )
             client_add_input( client, Input(), original_world_tick, client.adjustment_offset );
     }
 
-    world.active = client.active;
+    world.active = client.active && client.world_received;
 }
 
 void client_free( Client & client )
 {
+#if PROFILE_PACKETS
+    packet_profile_print( client.packet_profile, stdout );
+#endif // #if PROFILE_PACKETS
+    delete client.snapshot_history;
+    delete [] client.block_receiver.data;
+    delete client.world_block;
+    packet_buffer_pool_free( client.packet_buffer_pool );
+    packet_factory_free( client.packet_factory );
+    delete client.interpolation_buffer;
     delete client.socket;
     client = Client();    
 }
 
 struct Global
 {
-    int display_width;
-    int display_height;
+    std::atomic<int> display_width;                         // written by the framebuffer size callback on the main thread, read by the render thread
+    std::atomic<int> display_height;
 };
 
 Global global;
@@ -430,9 +707,9 @@ void client_tick( World & world, const Input & input )
 {
 //    printf( "%d-%d: %f [%+.4f]\n", (int) world.frame, (int) world.tick, world.time, TickDeltaTime );
 
-    const int player_id = 0;
+    const int num_players = 1;
 
-    game_process_player_input( world, input, player_id );
+    game_process_player_inputs( world, &input, num_players );
 
     world_tick( world );
 }
@@ -469,7 +746,6 @@ int client_main( int argc, char ** argv )
 
     World world;
     world_init( world );
-    world_setup_cubes( world );
     world_tick( world );
 
     signal( SIGINT, interrupt_handler );
@@ -498,6 +774,8 @@ int client_main( int argc, char ** argv )
 
         client_receive_packets( client );
 
+        client_apply_world_block( client, world );
+
         client_apply_time_synchronization( client, world );
 
         client_add_input( client, input, world.tick, TicksPerClientFrame );
@@ -575,16 +853,59 @@ void client_clear()
     glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT );
 }
 
-void client_render( const World & world, bool active )
+struct ClientRenderFrame
+{
+    double time = 0.0;                                      // real time of the client frame this was produced by
+    bool active = false;
+    vec3f origin = vec3f(0,0,0);                            // the camera follows this point. the player cube if there is one
+    RenderState render_state;
+};
+
+struct ClientThreads
+{
+    // shared between the main thread (window events and input), the simulation thread (networking and world ticks)
+    // and the render thread. the simulation thread publishes frames to the render thread through the triple buffer.
+
+    GLFWwindow * window = nullptr;
+    std::atomic<bool> quit;
+    std::mutex input_mutex;
+    Input input;
+    TripleBuffer render_buffer;
+    ClientRenderFrame render_frames[3];
+    std::atomic<float> input_time;                          // time the main thread last spent polling events and sampling input
+    std::atomic<bool> dump_profile;                         // set by the main thread, the render thread writes the dump
+    ProfileRing simulation_profile;
+    ProfileRing render_profile;
+
+    ClientThreads() : quit( false ), input_time( 0.0f ), dump_profile( false ) {}
+};
+
+void client_get_render_frame( const Client & client, const World & world, double frame_time, ClientRenderFrame & frame )
+{
+    CubeEntity * player = (CubeEntity*) world.entity_manager->GetEntity( ENTITY_PLAYER_BEGIN );
+
+    frame.time = frame_time;
+    frame.active = client.active;
+    frame.origin = player ? player->position : vec3f(0,0,0);
+
+    render_get_state( world, frame.render_state );
+}
+
+void client_render( const ClientRenderFrame & previous, const ClientRenderFrame & current, double time, RenderState & render_state, ProfileFrame & profile )
 {
     client_clear();
 
-    if ( !active )
+    if ( !current.active )
         return;
 
-    CubeEntity * player = (CubeEntity*) world.entity_manager->GetEntity( ENTITY_PLAYER_BEGIN );
+    // draw one client frame behind the simulation, blending between the two most recent frames
+
+    float t = 1.0f;
+
+    if ( previous.active && current.time > previous.time )
+        t = clamp( float( ( time - ClientFrameDeltaTime - previous.time ) / ( current.time - previous.time ) ), 0.0f, 1.0f );
 
-    vec3f origin = player ? player->position : vec3f(0,0,0);
+    vec3f origin = previous.active ? previous.origin + ( current.origin - previous.origin ) * t : current.origin;
 
     vec3f lookat = origin - vec3f(0,0,1);
 
@@ -592,8 +913,10 @@ void client_render( const World & world, bool active )
 
     camera.EaseIn( lookat, position );
 
-    RenderState render_state;
-    render_get_state( world, render_state );
+    if ( previous.active )
+        render_interpolate_state( previous.render_state, current.render_state, t, render_state );
+    else
+        render_state = current.render_state;
 
     render.ResizeDisplay( global.display_width, global.display_height );
 
@@ -603,11 +926,21 @@ void client_render( const World & world, bool active )
     
     render.SetLightPosition( camera.lookat + vectorial::vec3f( 25.0f, -50.0f, 100.0f ) );
 
-    render.RenderScene( render_state );
-    
-    render.RenderShadows( render_state );
+    {
+        ProfileScope scope( profile, PROFILE_CULL_SCENE );
+        render.CullScene( render_state );
+    }
 
-    render.RenderShadowQuad();
+    {
+        ProfileScope scope( profile, PROFILE_RENDER_SCENE );
+        render.RenderScene( render_state );
+    }
+
+    {
+        ProfileScope scope( profile, PROFILE_RENDER_SHADOWS );
+        render.RenderShadows( render_state );
+        render.RenderShadowQuad();
+    }
     
     render.EndScene();
 }
@@ -625,6 +958,157 @@ Input client_sample_input( GLFWwindow * window )
     return input;
 }
 
+void client_simulation_thread( ClientThreads * threads, Client * client, World * world )
+{
+    // networking and simulation at the fixed client frame rate, never waiting on vsync
+
+    double next_frame_time = platform_time();
+
+    client_connect( *client, server_address, next_frame_time );
+
+    while ( !threads->quit )
+    {
+        const double time_to_sleep = max( 0.0, next_frame_time - platform_time() - AverageSleepJitter );
+
+        platform_sleep( time_to_sleep );
+
+        const double frame_time = next_frame_time;
+
+        ProfileFrame & profile = profile_ring_begin_frame( threads->simulation_profile, frame_time );
+
+        profile.cpu_time[PROFILE_INPUT] = threads->input_time;
+
+        Input input;
+        {
+            std::lock_guard<std::mutex> lock( threads->input_mutex );
+            input = threads->input;
+        }
+
+        client_add_input( *client, input, world->tick, TicksPerClientFrame );
+
+        client_update( *client, frame_time );
+
+        {
+            ProfileScope scope( profile, PROFILE_RECEIVE_PACKETS );
+            client_receive_packets( *client );
+        }
+
+        client_apply_world_block( *client, *world );
+
+        client_apply_time_synchronization( *client, *world );
+
+        {
+            ProfileScope scope( profile, PROFILE_SEND_PACKETS );
+            client_send_packets( *client );
+        }
+
+        {
+            ProfileScope scope( profile, PROFILE_CLIENT_FRAME );
+            client_frame( *world, input, frame_time, world->frame * ClientFrameDeltaTime );
+        }
+
+        client_post_frame( *client, *world );
+
+        client_apply_snapshot( *client, *world );
+
+        {
+            ProfileScope scope( profile, PROFILE_RENDER_GET_STATE );
+            client_get_render_frame( *client, *world, frame_time, threads->render_frames[triple_buffer_write_index( threads->render_buffer )] );
+        }
+
+        triple_buffer_publish( threads->render_buffer );
+
+        profile_ring_end_frame( threads->simulation_profile );
+
+        if ( client->reconnect )
+        {
+            client_reconnect( *client, platform_time() );
+        }
+
+        const double end_of_frame_time = platform_time();
+
+        while ( next_frame_time < end_of_frame_time + ClientFrameSafety * ClientFrameDeltaTime )
+            next_frame_time += ClientFrameDeltaTime;
+    }
+}
+
+void client_render_thread( ClientThreads * threads )
+{
+    glfwMakeContextCurrent( threads->window );
+
+    glewExperimental = GL_TRUE;
+    glewInit();
+
+    clear_opengl_error();
+
+    client_clear();
+
+    glEnable( GL_FRAMEBUFFER_SRGB );
+
+    glEnable( GL_CULL_FACE );
+    glFrontFace( GL_CW );
+
+    ClientRenderFrame * previous = new ClientRenderFrame();
+
+    RenderState * render_state = new RenderState();
+
+    ProfileFrame * simulation_frames = new ProfileFrame[ProfileHistory];
+    ProfileFrame * render_frames = new ProfileFrame[ProfileHistory];
+
+    while ( !threads->quit )
+    {
+        // keep the last frame around when a newer one arrives, since its slot goes back to the simulation thread
+
+        if ( triple_buffer_fresh( threads->render_buffer ) )
+        {
+            *previous = threads->render_frames[triple_buffer_read_index( threads->render_buffer )];
+            triple_buffer_acquire( threads->render_buffer );
+        }
+
+        const ClientRenderFrame & current = threads->render_frames[triple_buffer_read_index( threads->render_buffer )];
+
+        const double render_time = platform_time();
+
+        ProfileFrame & profile = profile_ring_begin_frame( threads->render_profile, render_time );
+
+        client_render( *previous, current, render_time, *render_state, profile );
+
+        const int num_simulation_frames = profile_ring_read( threads->simulation_profile, simulation_frames );
+        const int num_render_frames = profile_ring_read( threads->render_profile, render_frames );
+
+#if PROFILE_OVERLAY
+        render.RenderProfile( simulation_frames, num_simulation_frames, render_frames, num_render_frames );
+#endif // #if PROFILE_OVERLAY
+
+        if ( threads->dump_profile.exchange( false ) )
+        {
+            if ( profile_dump( "profile.csv", simulation_frames, num_simulation_frames, "simulation", false ) &&
+                 profile_dump( "profile.csv", render_frames, num_render_frames, "render", true ) )
+            {
+                printf( "wrote profile.csv\n" );
+            }
+        }
+
+        {
+            ProfileScope scope( profile, PROFILE_SWAP );
+            glfwSwapBuffers( threads->window );
+        }
+
+        memcpy( profile.gpu_time, render.GetStats().gpu_time, sizeof( profile.gpu_time ) );
+
+        profile_ring_end_frame( threads->render_profile );
+    }
+
+    delete [] simulation_frames;
+    delete [] render_frames;
+
+    delete previous;
+
+    delete render_state;
+
+    glfwMakeContextCurrent( nullptr );
+}
+
 int client_main( int argc, char ** argv )
 {
     InitializeNetwork();
@@ -635,7 +1119,6 @@ int client_main( int argc, char ** argv )
 
     World world;
     world_init( world );
-    world_setup_cubes( world );
     world_tick( world );
 
     glfwInit();
@@ -682,66 +1165,56 @@ int client_main( int argc, char ** argv )
 
     glfwSetWindowPos( window, desktop_width / 2 - window_width / 2, desktop_height / 2 - window_height / 2 );
 
-    glfwGetFramebufferSize( window, &global.display_width, &global.display_height );
+    int display_width, display_height;
+    glfwGetFramebufferSize( window, &display_width, &display_height );
+    global.display_width = display_width;
+    global.display_height = display_height;
 
     glfwSetFramebufferSizeCallback( window, framebuffer_size_callback );
 
-    glfwMakeContextCurrent( window );
+    // the window and its events stay on the main thread, as glfw requires. the gl context moves to the render thread.
 
-    glewExperimental = GL_TRUE;
-    glewInit();
-
-    clear_opengl_error();
-
-    client_clear();
+    ClientThreads * threads = new ClientThreads();
 
-    glEnable( GL_FRAMEBUFFER_SRGB );
+    threads->window = window;
 
-    glEnable( GL_CULL_FACE );
-    glFrontFace( GL_CW );
+    std::thread simulation_thread( client_simulation_thread, threads, &client, &world );
 
-    double previous_frame_time = platform_time();
+    std::thread render_thread( client_render_thread, threads );
 
-    client_connect( client, server_address, 0.0 );
+    bool dump_key_down = false;
 
-    while ( true )
+    while ( !glfwWindowShouldClose( window ) )
     {
-        glfwSwapBuffers( window );
+        const double input_start_time = platform_time();
 
-        double frame_start_time = platform_time();
-
-        previous_frame_time = frame_start_time;
+        glfwPollEvents();
 
         Input input = client_sample_input( window );
 
-        client_add_input( client, input, world.tick, TicksPerClientFrame );
-
-        client_update( client, frame_start_time );
-
-        client_receive_packets( client );
-
-        client_apply_time_synchronization( client, world );
-
-        client_send_packets( client );
+        {
+            std::lock_guard<std::mutex> lock( threads->input_mutex );
+            threads->input = input;
+        }
 
-        client_frame( world, input, frame_start_time, world.frame * ClientFrameDeltaTime );
+        threads->input_time = float( platform_time() - input_start_time );
 
-        client_post_frame( client, world );
+        // press P to write the recent profile history to profile.csv
 
-        client_apply_snapshot( client, world );
+        const bool dump_key = glfwGetKey( window, GLFW_KEY_P ) == GLFW_PRESS;
+        if ( dump_key && !dump_key_down )
+            threads->dump_profile = true;
+        dump_key_down = dump_key;
 
-        client_render( world, client.active );
+        platform_sleep( ClientInputSampleTime );
+    }
 
-        glfwPollEvents();
+    threads->quit = true;
 
-        if ( glfwWindowShouldClose( window ) )
-            break;
+    simulation_thread.join();
+    render_thread.join();
 
-        if ( client.reconnect )
-        {
-            client_reconnect( client, platform_time() );
-        }
-    }
+    delete threads;
 
     world_free( world );
 
@@ -0,0 +1,166 @@
+// Copyright © 2015, The Network Protocol Company, Inc. All Rights Reserved.
+
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include "const.h"
+#include "protocol.h"
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+// per-connection packet sequence numbers and acks. every connected packet carries its own sequence,
+// the most recent sequence received from the other side, and a bitfield of the 32 sequences before that.
+// from this each side measures round trip time, jitter and packet loss of the packets it sends.
+
+struct ConnectionHeader
+{
+    uint16_t sequence = 0;
+    uint16_t ack = 0;
+    uint32_t ack_bits = 0;                                  // bit n set if sequence ack - 1 - n was received
+};
+
+template <typename Stream> void serialize_connection_header( Stream & stream, ConnectionHeader & header )
+{
+    serialize_uint16( stream, header.sequence );
+    serialize_uint16( stream, header.ack );
+    serialize_uint32( stream, header.ack_bits );
+}
+
+struct ConnectionData
+{
+    uint16_t sequence;                                      // sequence of the next packet sent
+    bool received;                                          // true once any packet has been received
+    uint16_t received_sequence;                             // most recent sequence received
+    uint32_t received_bits;                                 // bit n set if received_sequence - 1 - n was received
+    bool sent_valid[ConnectionSentPackets];
+    bool sent_acked[ConnectionSentPackets];
+    uint16_t sent_sequence[ConnectionSentPackets];
+    double sent_time[ConnectionSentPackets];
+    int num_rtt_samples;
+    double rtt;                                             // smoothed round trip time (seconds)
+    double jitter;                                          // smoothed deviation of round trip time samples from rtt (seconds)
+    float packet_loss;                                      // smoothed fraction of sent packets that were not acked
+    uint64_t num_packets_acked;
+    uint64_t num_packets_lost;
+};
+
+inline void connection_reset( ConnectionData & connection )
+{
+    memset( &connection, 0, sizeof( ConnectionData ) );
+
+    // ack a sequence we have not sent yet until something is received, so the other side doesn't take it as an ack
+
+    connection.received_sequence = 0xFFFF;
+}
+
+inline void connection_add_loss_sample( ConnectionData & connection, bool lost )
+{
+    if ( lost )
+        connection.num_packets_lost++;
+    else
+        connection.num_packets_acked++;
+
+    connection.packet_loss += ( ( lost ? 1.0f : 0.0f ) - connection.packet_loss ) * ConnectionLossSmoothing;
+}
+
+inline void connection_write_header( ConnectionData & connection, ConnectionHeader & header, double time )
+{
+    header.sequence = connection.sequence++;
+    header.ack = connection.received_sequence;
+    header.ack_bits = connection.received_bits;
+
+    const int index = header.sequence % ConnectionSentPackets;
+
+    // a packet that falls out of the window without being acked was lost
+
+    if ( connection.sent_valid[index] && !connection.sent_acked[index] )
+        connection_add_loss_sample( connection, true );
+
+    connection.sent_valid[index] = true;
+    connection.sent_acked[index] = false;
+    connection.sent_sequence[index] = header.sequence;
+    connection.sent_time[index] = time;
+}
+
+inline void connection_ack_packet( ConnectionData & connection, uint16_t sequence, double time )
+{
+    const int index = sequence % ConnectionSentPackets;
+
+    if ( !connection.sent_valid[index] || connection.sent_acked[index] || connection.sent_sequence[index] != sequence )
+        return;
+
+    connection.sent_acked[index] = true;
+
+    connection_add_loss_sample( connection, false );
+
+    const double sample = time - connection.sent_time[index];
+
+    if ( connection.num_rtt_samples == 0 )
+    {
+        connection.rtt = sample;
+        connection.jitter = 0.0;
+    }
+    else
+    {
+        connection.jitter += ( fabs( sample - connection.rtt ) - connection.jitter ) * ConnectionRTTSmoothing;
+        connection.rtt += ( sample - connection.rtt ) * ConnectionRTTSmoothing;
+    }
+
+    connection.num_rtt_samples++;
+}
+
+inline void connection_process_header( ConnectionData & connection, const ConnectionHeader & header, double time )
+{
+    // track which sequences we have received so they can be acked back
+
+    if ( !connection.received )
+    {
+        connection.received = true;
+        connection.received_sequence = header.sequence;
+        connection.received_bits = 0;
+    }
+    else if ( sequence_greater_than( header.sequence, connection.received_sequence ) )
+    {
+        // the previous most recent sequence moves into the bitfield along with everything before it
+
+        const int shift = sequence_difference( header.sequence, connection.received_sequence );
+        if ( shift < 32 )
+            connection.received_bits = ( connection.received_bits << shift ) | ( 1u << ( shift - 1 ) );
+        else
+            connection.received_bits = ( shift == 32 ) ? 1u << 31 : 0;
+        connection.received_sequence = header.sequence;
+    }
+    else
+    {
+        const int offset = sequence_difference( connection.received_sequence, header.sequence );
+        if ( offset >= 1 && offset <= 32 )
+            connection.received_bits |= 1u << ( offset - 1 );
+    }
+
+    // acks for packets we sent
+
+    connection_ack_packet( connection, header.ack, time );
+
+    for ( int i = 0; i < 32; ++i )
+    {
+        if ( header.ack_bits & ( 1u << i ) )
+            connection_ack_packet( connection, uint16_t( header.ack - 1 - i ), time );
+    }
+
+    // anything sent long enough ago that it can no longer be acked was lost
+
+    for ( int i = 0; i < ConnectionSentPackets; ++i )
+    {
+        if ( !connection.sent_valid[i] || connection.sent_acked[i] )
+            continue;
+
+        if ( sequence_difference( header.ack, connection.sent_sequence[i] ) > 32 )
+        {
+            connection.sent_valid[i] = false;
+            connection_add_loss_sample( connection, true );
+        }
+    }
+}
+
+#endif // #ifndef CONNECTION_H
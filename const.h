@@ -3,7 +3,26 @@
 #ifndef CONST_H
 #define CONST_H
 
-static const int SnapshotsPerSecond = 10;
+static const int SnapshotsPerSecond = 10;                       // maximum snapshot send rate per-client
+static const int MinSnapshotsPerSecond = 2;                     // send rate never adapts below this
+
+static const int BandwidthBytesPerSecond = 32 * 1024;           // per-client bandwidth budget (256kbps)
+static const int BandwidthBucketSize = 8 * 1024;                // max burst per-client in bytes (two max size packets)
+static const double SendRateAdjustTime = 1.0;                   // measure packet loss over this long before adjusting send rate
+static const double SendRateLossThreshold = 0.05;               // back off send rate if packet loss is above this
+static const double SendRateBackOff = 0.5;
+static const double SendRateRecovery = 1.0;                     // snapshots per-second added back each adjustment when conditions are good
+static const double SendRateRTTThreshold = 0.05;                // back off send rate if smoothed rtt rises this far above its baseline (seconds)
+static const double SendRateJitterThreshold = 0.02;             // back off send rate if smoothed jitter rises this far above its baseline (seconds)
+static const double SendRateBaselineDrift = 0.05;               // rtt and jitter baselines follow increases this much per-adjust, so a slower route becomes the new normal
+
+static const int InterpolationSamplesPerCube = 8;
+static const double InterpolationSafety = 0.025;                // seconds of playout delay on top of snapshot interval and jitter
+static const double InterpolationJitterFactor = 2.0;
+static const double InterpolationSmoothing = 0.1;
+static const double InterpolationOffsetDrift = 0.01;
+static const double InterpolationDelayAdjustRate = 0.1;         // max change in playout delay, in seconds per-second
+static const double InterpolationMaxDelayError = 0.25;          // snap the playout delay if it is further than this from target
 
 static const int MaxInputsPerPacket = 63;
 static const int InputSlidingWindowSize = 256;
@@ -21,6 +40,10 @@ static const double DroppedInputForgetTime = 5.0f;
 
 static const int ServerPort = 20000;
 static const float Timeout = 5.0f;
+static const float ChallengeTimeout = 5.0f;                     // how long a connection challenge token stays valid (seconds)
+static const int ChallengeKeyBytes = 16;
+static const int ConnectionRequestPadding = 24;                 // zero bytes on the end of a connection request so it is no smaller than the challenge sent back
+static const int ConnectionRequestMinBytes = 36;                // the server drops shorter connection requests without replying. the size of a challenge packet
 
 static const int ServerFramesPerSecond = 60;
 static const int ClientFramesPerSecond = 60;
@@ -38,22 +61,36 @@ static const double ServerFrameSafety = 0.5;
 static const double ClientFrameSafety = 0.5;
 
 static const double AverageSleepJitter = 2.25 * 0.001;
+static const double ClientInputSampleTime = 0.001;              // the main thread polls window events and samples input this often (seconds)
 
 static const int MaxClients = 1;
 static const int MaxEntities = 1024;
-static const int MaxPlayers = MaxClients;
+static const int MaxPlayers = 4;                                // the simulation supports this many players. the server only accepts MaxClients of them
 static const int MaxCubes = MaxEntities;
 static const int MaxPhysicsObjects = MaxEntities;
 static const int MaxPhysicsPlanes = MaxEntities;
 
 static const int MaxViewObjects = MaxEntities;
-static const int MaxCubeShadowVertices = 1024 * 32;
+static const int MaxShadowVerticesPerCube = 36;                  // six silhouette edges, each extruded to a quad of two triangles
+static const int MaxCubeShadowVertices = MaxCubes * MaxShadowVerticesPerCube;
+static const int RenderInstanceBufferRegions = 3;                 // regions in the cube instance ring buffer. the cpu writes one while the gpu reads the others
 static const float ShadowAlphaThreshold = 0.15f;
+static const int RenderFrameUniformsBinding = 0;                 // uniform buffer binding point for per-frame camera and light data
+static const int RenderJobThreads = 3;                           // worker threads for building cube instances and shadow silhouettes. the main thread works alongside them
+static const int RenderJobCubes = 128;                           // cubes per render job. a multiple of four for the batched silhouette code
+static const int MaxRenderJobs = ( MaxCubes + RenderJobCubes - 1 ) / RenderJobCubes;
 
 static const float AuthorityThreshold = 0.5f;
+static const float SpatialGridCellSize = 2.0f;                   // meters. at least the push radius, so a push query touches at most 3x3 cells
+static const int SpatialGridBuckets = 4096;                      // power of two. grid cells hash into this many buckets
 
 static const int MaxContexts = 8;
+static const int MaxCategories = 16;
+static const int EntropyContextBits = 12;
+static const int EntropyContexts = 1 << EntropyContextBits;
 static const int MaxPacketSize = 4 * 1024;
+static const int PacketBufferPoolSize = MaxClients * 2 + 8;     // enough for one snapshot per-client plus control packets and receives
+static const int PacketBufferAlignment = 64;                    // cacheline
 static const int UnitsPerMeter = 512;
 static const int OrientationBits = 9;
 static const int PositionBoundXY = 255;
@@ -62,12 +99,59 @@ static const float MaxLinearSpeed = 31;         // note: this can be set directl
 static const float MaxAngularSpeed = 15;
 static const int QuantizedPositionBoundXY = UnitsPerMeter * PositionBoundXY - 1;
 static const int QuantizedPositionBoundZ = UnitsPerMeter * PositionBoundZ - 1;
+static const float LinearVelocityResolution = 0.01f;
+static const float AngularVelocityResolution = 0.01f;
+
+static const int MaxCubesPerSnapshot = 256;
+static const int MaxSnapshotBytes = MaxPacketSize - 64;        // leave some room for packet headers
+static const int BlockFragmentSize = MaxPacketSize - 64;       // world block fragment payload. leave room for the packet header
+static const int MaxBlockFragments = 32;                        // one bit per-fragment in the ack bitfield
+static const int MaxBlockSize = BlockFragmentSize * MaxBlockFragments;
+static const double BlockFragmentResendTime = 0.1;              // resend block fragments not acked within this time (seconds)
+static const int ConnectionSentPackets = 256;                   // sent packets tracked per-connection waiting for acks
+static const double ConnectionRTTSmoothing = 0.1;
+static const float ConnectionLossSmoothing = 0.05f;
+static const int ServerJobThreads = 3;                          // worker threads for snapshot encoding. the main thread works alongside them
+static const int SnapshotHistorySize = 64;                      // quantized snapshots kept as delta baselines (server and client)
+static const float PriorityRelevancyDistance = 8.0f;            // cubes closer than this to the player accumulate priority at full rate
+static const float PriorityMinimumRelevancy = 0.1f;             // relevancy of cubes very far away from the player
+static const float PriorityAuthorityScale = 4.0f;               // cubes under authority of this client's player
+static const float PriorityInteractingScale = 2.0f;             // cubes under authority of some other player
+static const float PriorityPlayer = 1000000.0f;                 // the client's own player cube is always sent
+
+static const int ProfileHistory = 128;                          // client frames kept for the profile overlay and dumps
+static const int ProfileGpuTimerFrames = 4;                     // gpu timer queries are read back this many frames after they are issued
+static const float ProfileGpuTimeUnavailable = -1.0f;           // gpu time of a phase whose timer query still had no result when read back
+
+static const double TelemetrySampleTime = 1.0;                  // bandwidth history is sampled at this interval (seconds)
+static const int TelemetryHistorySize = 60;                     // number of bandwidth samples kept per-client
+static const double TelemetryExportTime = 1.0;                  // how often telemetry is written out (seconds)
+static const int TelemetryHistogramBuckets = 16;
+static const int TelemetryHistogramBucketBytes = 64;            // packet size histogram bucket width. last bucket catches everything larger
 
 static const int ENTITY_NULL = -1;
 static const int ENTITY_WORLD = 0;
 static const int ENTITY_PLAYER_BEGIN = 1;
 static const int ENTITY_PLAYER_END = ENTITY_PLAYER_BEGIN + MaxPlayers;
 
+static_assert( MaxClients <= MaxPlayers, "every client needs a player" );
+
 static const int PHYSICS_NULL = -1;
 
+enum PacketCategory
+{
+    PACKET_CATEGORY_HEADER,
+    PACKET_CATEGORY_SYNC,
+    PACKET_CATEGORY_INPUT,
+    PACKET_CATEGORY_INDEX,
+    PACKET_CATEGORY_POSITION,
+    PACKET_CATEGORY_ORIENTATION,
+    PACKET_CATEGORY_VELOCITY,
+    PACKET_CATEGORY_DELTA,
+    PACKET_CATEGORY_BLOCK,
+    NUM_PACKET_CATEGORIES
+};
+
+static_assert( NUM_PACKET_CATEGORIES <= MaxCategories, "too many packet categories" );
+
 #endif // #ifndef CONST_H
@@ -0,0 +1,140 @@
+// Copyright © 2015, The Network Protocol Company, Inc. All Rights Reserved.
+
+#ifndef CULL_H
+#define CULL_H
+
+#include "const.h"
+#include "render.h"
+#include "vectorial/simd4f.h"
+#include <math.h>
+#include <assert.h>
+
+// view frustum culling for cubes. each cube is bounded by a sphere, and four spheres are tested against a plane at once.
+// a cube outside the frustum can still cast a shadow into it, so shadow casters are tested separately against the
+// volume swept from the cube down to where the light projects it on the ground plane z=0.
+
+struct RenderFrustum
+{
+    float plane[6][4];                                      // ax + by + cz + d >= 0 inside. left, right, bottom, top, near, far
+};
+
+inline void render_frustum_from_view_projection( const mat4f & view_projection, RenderFrustum & frustum )
+{
+    // gribb/hartmann. the planes are sums and differences of the last row with the other rows of the clip matrix
+
+    float column[4][4];
+    simd4f_ustore4( view_projection.value.x, column[0] );
+    simd4f_ustore4( view_projection.value.y, column[1] );
+    simd4f_ustore4( view_projection.value.z, column[2] );
+    simd4f_ustore4( view_projection.value.w, column[3] );
+
+    for ( int i = 0; i < 6; ++i )
+    {
+        const int row = i / 2;
+        const float sign = ( i & 1 ) ? -1.0f : 1.0f;
+
+        float * plane = frustum.plane[i];
+        for ( int j = 0; j < 4; ++j )
+            plane[j] = column[j][3] + sign * column[j][row];
+
+        const float length = sqrtf( plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2] );
+        assert( length > 0.0f );
+        for ( int j = 0; j < 4; ++j )
+            plane[j] /= length;
+    }
+}
+
+inline void render_cull_cubes( const RenderCube * cubes,
+                               int first_cube,
+                               int num_cubes,
+                               const RenderFrustum & frustum,
+                               const vec3f & light_position,
+                               int * visible_cubes,
+                               int & num_visible_cubes,
+                               int * shadow_casters,
+                               int & num_shadow_casters )
+{
+    // writes the indices of cubes in [first_cube, first_cube + num_cubes) that are inside the view frustum,
+    // and those whose shadow volume may be, in increasing order
+
+    const float sqrt_3 = 1.7320508f;
+
+    const simd4f zero = simd4f_zero();
+    const simd4f light_x = simd4f_splat( light_position.x() );
+    const simd4f light_y = simd4f_splat( light_position.y() );
+    const simd4f light_z = simd4f_splat( light_position.z() );
+
+    num_visible_cubes = 0;
+    num_shadow_casters = 0;
+
+    for ( int i = 0; i < num_cubes; i += 4 )
+    {
+        const int num_lanes = min( 4, num_cubes - i );
+
+        const RenderCube * cube[4];
+        for ( int j = 0; j < 4; ++j )
+            cube[j] = &cubes[first_cube + i + min( j, num_lanes - 1 )];
+
+        const simd4f cx = simd4f_create( cube[0]->position.x(), cube[1]->position.x(), cube[2]->position.x(), cube[3]->position.x() );
+        const simd4f cy = simd4f_create( cube[0]->position.y(), cube[1]->position.y(), cube[2]->position.y(), cube[3]->position.y() );
+        const simd4f cz = simd4f_create( cube[0]->position.z(), cube[1]->position.z(), cube[2]->position.z(), cube[3]->position.z() );
+
+        const simd4f radius = simd4f_mul( simd4f_create( cube[0]->scale, cube[1]->scale, cube[2]->scale, cube[3]->scale ), simd4f_splat( sqrt_3 ) );
+
+        // the shadow of the bounding sphere on the ground lies inside a sphere around the projected center. its radius
+        // is the sphere radius scaled by the largest projection factor, plus how far the projection can move the center.
+        // spheres reaching up to the light don't project onto the ground at all, so they are always treated as casters.
+
+        const simd4f dx = simd4f_sub( cx, light_x );
+        const simd4f dy = simd4f_sub( cy, light_y );
+        const simd4f dz = simd4f_sub( cz, light_z );
+
+        const int above_light = simd4f_movemask( simd4f_cmplt( simd4f_sub( light_z, simd4f_add( cz, radius ) ), simd4f_splat( 0.001f ) ) );
+
+        const simd4f t = simd4f_div( light_z, simd4f_sub( light_z, cz ) );
+        const simd4f t_max = simd4f_div( light_z, simd4f_max( simd4f_sub( light_z, simd4f_add( cz, radius ) ), simd4f_splat( 0.001f ) ) );
+
+        const simd4f distance = simd4f_sqrt( simd4f_add( simd4f_add( simd4f_mul( dx, dx ), simd4f_mul( dy, dy ) ), simd4f_mul( dz, dz ) ) );
+
+        const simd4f ex = simd4f_add( light_x, simd4f_mul( dx, t ) );
+        const simd4f ey = simd4f_add( light_y, simd4f_mul( dy, t ) );
+        const simd4f shadow_radius = simd4f_add( simd4f_mul( radius, t_max ), simd4f_mul( simd4f_sub( t_max, t ), distance ) );
+
+        int outside = 0;
+        int shadow_outside = 0;
+
+        for ( int j = 0; j < 6; ++j )
+        {
+            const float * plane = frustum.plane[j];
+
+            const simd4f a = simd4f_splat( plane[0] );
+            const simd4f b = simd4f_splat( plane[1] );
+            const simd4f c = simd4f_splat( plane[2] );
+            const simd4f d = simd4f_splat( plane[3] );
+
+            const simd4f cube_distance = simd4f_add( simd4f_add( simd4f_add( simd4f_mul( a, cx ), simd4f_mul( b, cy ) ), simd4f_mul( c, cz ) ), d );
+            const simd4f ground_distance = simd4f_add( simd4f_add( simd4f_mul( a, ex ), simd4f_mul( b, ey ) ), d );
+
+            const int cube_outside = simd4f_movemask( simd4f_cmplt( simd4f_add( cube_distance, radius ), zero ) );
+            const int ground_outside = simd4f_movemask( simd4f_cmplt( simd4f_add( ground_distance, shadow_radius ), zero ) );
+
+            outside |= cube_outside;
+            shadow_outside |= cube_outside & ground_outside;
+        }
+
+        shadow_outside &= ~above_light;
+
+        for ( int j = 0; j < num_lanes; ++j )
+        {
+            const int index = first_cube + i + j;
+
+            if ( ( outside & ( 1 << j ) ) == 0 )
+                visible_cubes[num_visible_cubes++] = index;
+
+            if ( ( shadow_outside & ( 1 << j ) ) == 0 )
+                shadow_casters[num_shadow_casters++] = index;
+        }
+    }
+}
+
+#endif // #ifndef CULL_H
@@ -3,19 +3,16 @@
 #include "game.h"
 #include "world.h"
 
-void game_process_player_input( World & world, const Input & input, int player_id )
+static void game_process_player_input( World & world, const Input & input, int player_id )
 {
-    if ( !world.active )
-        return;
-
     const double t = world.time * 60;
-    
-    assert( world.entity_manager );
-    assert( world.physics_manager );
 
     const int player_entity_index = ENTITY_PLAYER_BEGIN + player_id;
 
-    assert( world.entity_manager->GetType( player_entity_index ) == ENTITY_TYPE_CUBE );
+    // players that aren't in the world yet have no cube to move
+
+    if ( world.entity_manager->GetType( player_entity_index ) != ENTITY_TYPE_CUBE )
+        return;
 
     CubeEntity * player_cube = (CubeEntity*) world.entity_manager->GetEntity( player_entity_index );
 
@@ -97,15 +94,22 @@ void game_process_player_input( World & world, const Input & input, int player_i
 
     const int player_authority = ENTITY_PLAYER_BEGIN + player_id;
 
+    const float push_radius = 2.0f;
+    const float pull_radius = 1.8f;
+
     if ( input.push || input.pull )
     {
-        for ( int i = 0; i < MaxEntities; ++i )
-        {
-            if ( ( world.entity_manager->GetFlag( i ) & ENTITY_FLAG_ALLOCATED ) == 0 )
-                continue;
+        // only cubes near the player can be pushed or pulled. the push origin is directly below the player cube,
+        // so the player cube itself is always one of the candidates in push mode
 
-            if ( world.entity_manager->GetType( i ) != ENTITY_TYPE_CUBE )
-                continue;
+        int candidates[MaxEntities];
+
+        const int num_candidates = input.push ? spatial_grid_query( *world.spatial_grid, push_origin.x(), push_origin.y(), push_radius, candidates, MaxEntities )
+                                              : spatial_grid_query( *world.spatial_grid, player_cube->position.x(), player_cube->position.y(), pull_radius, candidates, MaxEntities );
+
+        for ( int j = 0; j < num_candidates; ++j )
+        {
+            const int i = candidates[j];
 
             auto cube = (CubeEntity*) world.entity_manager->GetEntity( i );
 
@@ -129,7 +133,7 @@ void game_process_player_input( World & world, const Input & input, int player_i
                 
                 const float distance_squared = length_squared( difference );
 
-                if ( distance_squared > 0.0001f && distance_squared < 4.0f )
+                if ( distance_squared > 0.0001f && distance_squared < push_radius * push_radius )
                 {
                     const float distance = sqrt( distance_squared );
 
@@ -170,7 +174,7 @@ void game_process_player_input( World & world, const Input & input, int player_i
 
                     const float distance_squared = length_squared( difference );
                     
-                    const float effective_radius_squared = 1.8f * 1.8f;
+                    const float effective_radius_squared = pull_radius * pull_radius;
 
                     if ( distance_squared > 0.2f*0.2f && distance_squared < effective_radius_squared )
                     {
@@ -201,3 +205,28 @@ void game_process_player_input( World & world, const Input & input, int player_i
         player_cube->linear_velocity *= vec3f( 0.99999f, 0.99999f, 0.99999f );
     }
 }
+
+void game_process_player_inputs( World & world, const Input * inputs, int num_players )
+{
+    // all players are processed in one pass per-tick. cube positions don't change until the physics update, so the
+    // spatial grid is built once and shared by every player's push and pull queries
+
+    if ( !world.active )
+        return;
+
+    assert( world.entity_manager );
+    assert( world.physics_manager );
+    assert( world.spatial_grid );
+    assert( num_players >= 0 );
+    assert( num_players <= MaxPlayers );
+
+    bool any_push_or_pull = false;
+    for ( int i = 0; i < num_players; ++i )
+        any_push_or_pull |= inputs[i].push || inputs[i].pull;
+
+    if ( any_push_or_pull )
+        spatial_grid_build( *world.spatial_grid, *world.entity_manager );
+
+    for ( int i = 0; i < num_players; ++i )
+        game_process_player_input( world, inputs[i], i );
+}
@@ -38,6 +38,6 @@ struct Input
     }
 };
 
-extern void game_process_player_input( struct World & world, const Input & input, int player_id );
+extern void game_process_player_inputs( struct World & world, const Input * inputs, int num_players );
 
 #endif // #ifndef GAME_H
@@ -0,0 +1,145 @@
+// Copyright © 2015, The Network Protocol Company, Inc. All Rights Reserved.
+
+#ifndef GRID_H
+#define GRID_H
+
+#include "const.h"
+#include "entity.h"
+#include <stdint.h>
+#include <math.h>
+#include <assert.h>
+
+// uniform grid over the ground plane for finding the cubes near a point. cells are hashed into a fixed number of
+// buckets so the grid covers the whole world without storing every cell. it is rebuilt from scratch once per tick:
+// cube entities are counting sorted by bucket, so each bucket is a contiguous run of entity indices and positions.
+
+struct SpatialGrid
+{
+    int num_entities = 0;
+    int bucket_start[SpatialGridBuckets+1];                 // entities in bucket i are [bucket_start[i],bucket_start[i+1])
+    int entity_index[MaxEntities];
+    float x[MaxEntities];                                   // entity positions on the ground plane, in bucket order
+    float y[MaxEntities];
+};
+
+inline int spatial_grid_cell( float value )
+{
+    return (int) floorf( value * ( 1.0f / SpatialGridCellSize ) );
+}
+
+inline int spatial_grid_bucket( int cell_x, int cell_y )
+{
+    return ( uint32_t( cell_x ) * 73856093u ^ uint32_t( cell_y ) * 19349663u ) & ( SpatialGridBuckets - 1 );
+}
+
+inline void spatial_grid_build( SpatialGrid & grid, EntityManager & entity_manager )
+{
+    int entity_bucket[MaxEntities];
+
+    for ( int i = 0; i <= SpatialGridBuckets; ++i )
+        grid.bucket_start[i] = 0;
+
+    for ( int i = 0; i < MaxEntities; ++i )
+    {
+        entity_bucket[i] = -1;
+
+        if ( ( entity_manager.GetFlag( i ) & ENTITY_FLAG_ALLOCATED ) == 0 )
+            continue;
+
+        if ( entity_manager.GetType( i ) != ENTITY_TYPE_CUBE )
+            continue;
+
+        const Entity * entity = entity_manager.GetEntity( i );
+
+        assert( entity );
+
+        entity_bucket[i] = spatial_grid_bucket( spatial_grid_cell( entity->position.x() ), spatial_grid_cell( entity->position.y() ) );
+
+        grid.bucket_start[entity_bucket[i]+1]++;
+    }
+
+    for ( int i = 0; i < SpatialGridBuckets; ++i )
+        grid.bucket_start[i+1] += grid.bucket_start[i];
+
+    grid.num_entities = grid.bucket_start[SpatialGridBuckets];
+
+    // scatter into bucket order. bucket_start[i] walks forward to the end of bucket i, then is shifted back afterwards
+
+    for ( int i = 0; i < MaxEntities; ++i )
+    {
+        const int bucket = entity_bucket[i];
+        if ( bucket < 0 )
+            continue;
+
+        const Entity * entity = entity_manager.GetEntity( i );
+        const int index = grid.bucket_start[bucket]++;
+        grid.entity_index[index] = i;
+        grid.x[index] = entity->position.x();
+        grid.y[index] = entity->position.y();
+    }
+
+    for ( int i = SpatialGridBuckets; i > 0; --i )
+        grid.bucket_start[i] = grid.bucket_start[i-1];
+
+    grid.bucket_start[0] = 0;
+}
+
+inline int spatial_grid_query( const SpatialGrid & grid, float x, float y, float radius, int * entities, int max_entities )
+{
+    // returns the entities within radius of (x,y) on the ground plane. callers still need their own exact distance
+    // test in 3d, this only narrows down the candidates. distinct cells can hash to the same bucket, so each bucket
+    // is only walked once or an entity would be returned twice.
+
+    const int min_cell_x = spatial_grid_cell( x - radius );
+    const int max_cell_x = spatial_grid_cell( x + radius );
+    const int min_cell_y = spatial_grid_cell( y - radius );
+    const int max_cell_y = spatial_grid_cell( y + radius );
+
+    const int MaxQueryBuckets = 64;
+    int buckets[MaxQueryBuckets];
+    int num_buckets = 0;
+
+    const float radius_squared = radius * radius;
+
+    int num_entities = 0;
+
+    for ( int cell_y = min_cell_y; cell_y <= max_cell_y; ++cell_y )
+    {
+        for ( int cell_x = min_cell_x; cell_x <= max_cell_x; ++cell_x )
+        {
+            const int bucket = spatial_grid_bucket( cell_x, cell_y );
+
+            bool visited = false;
+            for ( int i = 0; i < num_buckets; ++i )
+            {
+                if ( buckets[i] == bucket )
+                {
+                    visited = true;
+                    break;
+                }
+            }
+
+            if ( visited )
+                continue;
+
+            assert( num_buckets < MaxQueryBuckets );
+            buckets[num_buckets++] = bucket;
+
+            for ( int i = grid.bucket_start[bucket]; i < grid.bucket_start[bucket+1]; ++i )
+            {
+                const float dx = grid.x[i] - x;
+                const float dy = grid.y[i] - y;
+                if ( dx * dx + dy * dy > radius_squared )
+                    continue;
+
+                assert( num_entities < max_entities );
+                if ( num_entities < max_entities )
+                    entities[num_entities++] = grid.entity_index[i];
+            }
+        }
+    }
+
+    return num_entities;
+}
+
+#endif // #ifndef GRID_H
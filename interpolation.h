@@ -0,0 +1,247 @@
+// Copyright © 2015, The Network Protocol Company, Inc. All Rights Reserved.
+
+#ifndef INTERPOLATION_H
+#define INTERPOLATION_H
+
+#include "const.h"
+#include "core.h"
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+#include "snapshot.h"
+
+struct InterpolationSample
+{
+    uint64_t tick;
+    CubeState state;
+};
+
+struct InterpolationHistory
+{
+    int num_samples;
+    int next_sample;
+    InterpolationSample samples[InterpolationSamplesPerCube];
+};
+
+struct InterpolationBuffer
+{
+    bool receiving;                         // true once the first snapshot has been received
+    uint64_t most_recent_tick;              // tick of the most recent snapshot received
+    double time_offset;                     // receive time minus server time for the earliest arriving snapshots (low envelope)
+    double jitter;                          // smoothed delay of snapshot arrival relative to the time offset (seconds)
+    double snapshot_interval;               // smoothed time between snapshots sent by the server (seconds)
+    double target_playout_delay;            // the playout delay we want given current interval and jitter (seconds)
+    double playout_delay;                   // the playout delay we are actually using, eased towards target (seconds)
+    double previous_time;                   // real time of the previous update
+    double interpolation_tick;              // the server tick we are currently interpolating at (fractional)
+    InterpolationHistory entities[MaxEntities];
+};
+
+inline void interpolation_buffer_reset( InterpolationBuffer & buffer )
+{
+    buffer.receiving = false;
+    buffer.most_recent_tick = 0;
+    buffer.time_offset = 0.0;
+    buffer.jitter = 0.0;
+    buffer.snapshot_interval = 1.0 / SnapshotsPerSecond;
+    buffer.target_playout_delay = buffer.snapshot_interval + InterpolationSafety;
+    buffer.playout_delay = buffer.target_playout_delay;
+    buffer.previous_time = 0.0;
+    buffer.interpolation_tick = 0.0;
+    for ( int i = 0; i < MaxEntities; ++i )
+    {
+        buffer.entities[i].num_samples = 0;
+        buffer.entities[i].next_sample = 0;
+    }
+}
+
+inline void interpolation_buffer_add_snapshot( InterpolationBuffer & buffer, uint64_t tick, double receive_time )
+{
+    // watch how early or late the server is delivering snapshots to us. the low envelope of receive time
+    // minus server time maps server ticks to our clock. anything above that envelope is jitter.
+
+    const double offset = receive_time - tick * TickDeltaTime;
+
+    if ( !buffer.receiving )
+    {
+        buffer.receiving = true;
+        buffer.time_offset = offset;
+        buffer.most_recent_tick = tick;
+        return;
+    }
+
+    assert( tick > buffer.most_recent_tick );
+
+    if ( offset < buffer.time_offset )
+        buffer.time_offset = offset;
+    else
+        buffer.time_offset += ( offset - buffer.time_offset ) * InterpolationOffsetDrift;
+
+    buffer.jitter += ( ( offset - buffer.time_offset ) - buffer.jitter ) * InterpolationSmoothing;
+
+    const double interval = ( tick - buffer.most_recent_tick ) * TickDeltaTime;
+
+    buffer.snapshot_interval += ( interval - buffer.snapshot_interval ) * InterpolationSmoothing;
+
+    buffer.target_playout_delay = buffer.snapshot_interval + buffer.jitter * InterpolationJitterFactor + InterpolationSafety;
+
+    buffer.most_recent_tick = tick;
+}
+
+inline void interpolation_buffer_add_cube( InterpolationBuffer & buffer, int entity_index, uint64_t tick, const CubeState & state )
+{
+    assert( entity_index >= 0 );
+    assert( entity_index < MaxEntities );
+
+    InterpolationHistory & history = buffer.entities[entity_index];
+
+    InterpolationSample & sample = history.samples[history.next_sample];
+    sample.tick = tick;
+    sample.state = state;
+
+    history.next_sample = ( history.next_sample + 1 ) % InterpolationSamplesPerCube;
+    history.num_samples = min( history.num_samples + 1, InterpolationSamplesPerCube );
+}
+
+inline uint64_t interpolation_buffer_most_recent_tick( const InterpolationBuffer & buffer, int entity_index )
+{
+    // tick of the most recent sample for this entity, or zero if it has none
+
+    assert( entity_index >= 0 );
+    assert( entity_index < MaxEntities );
+
+    const InterpolationHistory & history = buffer.entities[entity_index];
+
+    if ( history.num_samples == 0 )
+        return 0;
+
+    return history.samples[( history.next_sample - 1 + InterpolationSamplesPerCube ) % InterpolationSamplesPerCube].tick;
+}
+
+inline vec3f estimate_angular_velocity( const quat4f & previous, const quat4f & current, float inverse_delta_time )
+{
+    // the rotation from previous to current as axis * angle, per-second. take the short way around
+
+    quat4f rotation = normalize( current * conjugate( previous ) );
+    if ( rotation.w() < 0.0f )
+        rotation = quat4f( -rotation.x(), -rotation.y(), -rotation.z(), -rotation.w() );
+
+    const vec3f axis( rotation.x(), rotation.y(), rotation.z() );
+    const float sine = length( axis );
+    if ( sine < 0.00001f )
+        return vec3f(0,0,0);
+
+    const float angle = 2.0f * atan2f( sine, rotation.w() );
+
+    return axis * ( angle / sine * inverse_delta_time );
+}
+
+inline void interpolation_buffer_update( InterpolationBuffer & buffer, double real_time )
+{
+    if ( !buffer.receiving )
+        return;
+
+    // ease the playout delay towards the target slowly so speeding up or slowing down
+    // the interpolation is not visible. if we are way off, just snap to the target.
+
+    const double dt = clamp( real_time - buffer.previous_time, 0.0, 1.0 );
+
+    buffer.previous_time = real_time;
+
+    const double difference = buffer.target_playout_delay - buffer.playout_delay;
+
+    if ( fabs( difference ) > InterpolationMaxDelayError )
+        buffer.playout_delay = buffer.target_playout_delay;
+    else
+        buffer.playout_delay += clamp( difference, -InterpolationDelayAdjustRate * dt, +InterpolationDelayAdjustRate * dt );
+
+    buffer.interpolation_tick = ( real_time - buffer.time_offset - buffer.playout_delay ) / TickDeltaTime;
+}
+
+inline void hermite_spline( float t,
+                            const vec3f & p0, const vec3f & p1,
+                            const vec3f & t0, const vec3f & t1,
+                            vec3f & position, vec3f & tangent )
+{
+    const float t2 = t * t;
+    const float t3 = t2 * t;
+
+    const float h00 =  2*t3 - 3*t2 + 1;
+    const float h10 =    t3 - 2*t2 + t;
+    const float h01 = -2*t3 + 3*t2;
+    const float h11 =    t3 -   t2;
+
+    const float d00 =  6*t2 - 6*t;
+    const float d10 =  3*t2 - 4*t + 1;
+    const float d01 = -6*t2 + 6*t;
+    const float d11 =  3*t2 - 2*t;
+
+    position = p0 * h00 + t0 * h10 + p1 * h01 + t1 * h11;
+    tangent = p0 * d00 + t0 * d10 + p1 * d01 + t1 * d11;
+}
+
+inline bool interpolation_buffer_sample( const InterpolationBuffer & buffer, int entity_index, CubeState & state )
+{
+    assert( entity_index >= 0 );
+    assert( entity_index < MaxEntities );
+
+    const InterpolationHistory & history = buffer.entities[entity_index];
+
+    if ( history.num_samples == 0 )
+        return false;
+
+    // find the pair of samples around the interpolation tick. samples are added in increasing tick order,
+    // so walk backwards from the most recent sample until we find one at or before the interpolation tick.
+
+    const InterpolationSample * a = nullptr;
+    const InterpolationSample * b = nullptr;
+
+    for ( int i = 0; i < history.num_samples; ++i )
+    {
+        const int index = ( history.next_sample - 1 - i + InterpolationSamplesPerCube ) % InterpolationSamplesPerCube;
+        const InterpolationSample & sample = history.samples[index];
+        if ( sample.tick <= buffer.interpolation_tick )
+        {
+            a = &sample;
+            break;
+        }
+        b = &sample;
+    }
+
+    if ( !a )
+    {
+        // interpolation tick is older than anything we have. hold at the oldest sample.
+        state = b->state;
+        return true;
+    }
+
+    if ( !b )
+    {
+        // interpolation tick is ahead of the most recent sample (snapshots late or lost). hold at most recent.
+        state = a->state;
+        return true;
+    }
+
+    const double ticks = double( b->tick - a->tick );
+
+    const float t = clamp( float( ( buffer.interpolation_tick - a->tick ) / ticks ), 0.0f, 1.0f );
+
+    const float interval = float( ticks * TickDeltaTime );
+
+    vec3f tangent;
+
+    hermite_spline( t, a->state.position, b->state.position,
+                    a->state.linear_velocity * interval, b->state.linear_velocity * interval,
+                    state.position, tangent );
+
+    state.linear_velocity = tangent / interval;
+
+    state.orientation = normalize( slerp( t, a->state.orientation, b->state.orientation ) );
+
+    state.angular_velocity = a->state.angular_velocity + ( b->state.angular_velocity - a->state.angular_velocity ) * t;
+
+    return true;
+}
+
+#endif // #ifndef INTERPOLATION_H
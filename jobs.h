@@ -0,0 +1,126 @@
+// Copyright © 2015, The Network Protocol Company, Inc. All Rights Reserved.
+
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdint.h>
+#include <assert.h>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+
+// a small fixed pool of worker threads. the calling thread hands out a batch of jobs,
+// works on them alongside the workers, and returns once every job in the batch is done.
+
+typedef void (*JobFunction)( void * context, int index );
+
+struct JobSystem
+{
+    int num_threads = 0;
+    std::thread * threads = nullptr;
+    std::mutex mutex;
+    std::condition_variable work_condition;
+    std::condition_variable done_condition;
+    uint64_t batch = 0;                                     // incremented for each batch so workers pick it up exactly once
+    bool quit = false;
+    JobFunction function = nullptr;
+    void * context = nullptr;
+    int num_jobs = 0;
+    std::atomic<int> next_job;
+    int num_working = 0;                                    // workers that have not finished the current batch
+};
+
+inline void job_system_work( JobSystem & jobs )
+{
+    while ( true )
+    {
+        const int index = jobs.next_job.fetch_add( 1 );
+        if ( index >= jobs.num_jobs )
+            break;
+        jobs.function( jobs.context, index );
+    }
+}
+
+inline void job_system_worker( JobSystem * jobs )
+{
+    uint64_t batch = 0;
+
+    while ( true )
+    {
+        {
+            std::unique_lock<std::mutex> lock( jobs->mutex );
+            jobs->work_condition.wait( lock, [jobs, batch] { return jobs->quit || jobs->batch != batch; } );
+            if ( jobs->quit )
+                return;
+            batch = jobs->batch;
+        }
+
+        job_system_work( *jobs );
+
+        {
+            std::lock_guard<std::mutex> lock( jobs->mutex );
+            if ( --jobs->num_working == 0 )
+                jobs->done_condition.notify_one();
+        }
+    }
+}
+
+inline void job_system_init( JobSystem & jobs, int num_threads )
+{
+    assert( num_threads >= 0 );
+    jobs.num_threads = num_threads;
+    jobs.next_job = 0;
+    jobs.threads = num_threads > 0 ? new std::thread[num_threads] : nullptr;
+    for ( int i = 0; i < num_threads; ++i )
+        jobs.threads[i] = std::thread( job_system_worker, &jobs );
+}
+
+inline void job_system_run( JobSystem & jobs, JobFunction function, void * context, int num_jobs )
+{
+    if ( num_jobs <= 0 )
+        return;
+
+    if ( jobs.num_threads == 0 || num_jobs == 1 )
+    {
+        for ( int i = 0; i < num_jobs; ++i )
+            function( context, i );
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock( jobs.mutex );
+        jobs.function = function;
+        jobs.context = context;
+        jobs.num_jobs = num_jobs;
+        jobs.next_job = 0;
+        jobs.num_working = jobs.num_threads;
+        jobs.batch++;
+    }
+
+    jobs.work_condition.notify_all();
+
+    job_system_work( jobs );
+
+    std::unique_lock<std::mutex> lock( jobs.mutex );
+    jobs.done_condition.wait( lock, [&jobs] { return jobs.num_working == 0; } );
+}
+
+inline void job_system_free( JobSystem & jobs )
+{
+    {
+        std::lock_guard<std::mutex> lock( jobs.mutex );
+        jobs.quit = true;
+    }
+
+    jobs.work_condition.notify_all();
+
+    for ( int i = 0; i < jobs.num_threads; ++i )
+        jobs.threads[i].join();
+
+    delete [] jobs.threads;
+    jobs.threads = nullptr;
+    jobs.num_threads = 0;
+}
+
+#endif // #ifndef JOBS_H
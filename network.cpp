@@ -436,6 +436,30 @@ Socket::~Socket()
     m_socket = 0;
 }
 
+static int get_socket_address( const Address & address, sockaddr_storage & s_addr )
+{
+    memset( &s_addr, 0, sizeof( s_addr ) );
+
+    if ( address.GetType() == ADDRESS_IPV6 )
+    {
+        sockaddr_in6 & s_addr6 = (sockaddr_in6&) s_addr;
+        s_addr6.sin6_family = AF_INET6;
+        s_addr6.sin6_port = htons( address.GetPort() );
+        memcpy( &s_addr6.sin6_addr, address.GetAddress6(), sizeof( s_addr6.sin6_addr ) );
+        return sizeof( sockaddr_in6 );
+    }
+    else if ( address.GetType() == ADDRESS_IPV4 )
+    {
+        sockaddr_in & s_addr4 = (sockaddr_in&) s_addr;
+        s_addr4.sin_family = AF_INET;
+        s_addr4.sin_addr.s_addr = address.GetAddress4();
+        s_addr4.sin_port = htons( (unsigned short) address.GetPort() );
+        return sizeof( sockaddr_in );
+    }
+
+    return 0;
+}
+
 bool Socket::SendPacket( const Address & address, const uint8_t * data, int bytes )
 {
     assert( m_socket );
@@ -444,24 +468,11 @@ bool Socket::SendPacket( const Address & address, const uint8_t * data, int byte
 
     bool result = false;
 
-    if ( address.GetType() == ADDRESS_IPV6 )
+    sockaddr_storage s_addr;
+    const int s_addr_length = get_socket_address( address, s_addr );
+    if ( s_addr_length > 0 )
     {
-        sockaddr_in6 s_addr;
-        memset( &s_addr, 0, sizeof( s_addr ) );
-        s_addr.sin6_family = AF_INET6;
-        s_addr.sin6_port = htons( address.GetPort() );
-        memcpy( &s_addr.sin6_addr, address.GetAddress6(), sizeof( s_addr.sin6_addr ) );
-        const int sent_bytes = sendto( m_socket, (const char*)data, bytes, 0, (sockaddr*)&s_addr, sizeof(sockaddr_in6) );
-        result = sent_bytes == bytes;
-    }
-    else if ( address.GetType() == ADDRESS_IPV4 )
-    {
-        sockaddr_in s_addr;
-        memset( &s_addr, 0, sizeof( s_addr ) );
-        s_addr.sin_family = AF_INET;
-        s_addr.sin_addr.s_addr = address.GetAddress4();
-        s_addr.sin_port = htons( (unsigned short) address.GetPort() );
-        const int sent_bytes = sendto( m_socket, (const char*)data, bytes, 0, (sockaddr*)&s_addr, sizeof(sockaddr_in) );
+        const int sent_bytes = sendto( m_socket, (const char*)data, bytes, 0, (sockaddr*)&s_addr, s_addr_length );
         result = sent_bytes == bytes;
     }
 
@@ -471,6 +482,71 @@ bool Socket::SendPacket( const Address & address, const uint8_t * data, int byte
     return result;
 }
 
+int Socket::SendPackets( const PacketSend * packets, int num_packets )
+{
+    assert( m_socket );
+    assert( packets );
+
+#ifdef __linux__
+
+    // one system call per batch. the iovecs point straight at the packet data, so nothing is copied here
+
+    const int MaxBatch = 64;
+
+    int num_sent = 0;
+
+    while ( num_sent < num_packets )
+    {
+        const int num_batch = ( num_packets - num_sent < MaxBatch ) ? num_packets - num_sent : MaxBatch;
+
+        mmsghdr messages[MaxBatch];
+        iovec iov[MaxBatch];
+        sockaddr_storage addresses[MaxBatch];
+
+        memset( messages, 0, sizeof( mmsghdr ) * num_batch );
+
+        for ( int i = 0; i < num_batch; ++i )
+        {
+            const PacketSend & packet = packets[num_sent+i];
+            assert( packet.address.IsValid() );
+            assert( packet.bytes > 0 );
+            iov[i].iov_base = (void*) packet.data;
+            iov[i].iov_len = packet.bytes;
+            messages[i].msg_hdr.msg_name = &addresses[i];
+            messages[i].msg_hdr.msg_namelen = get_socket_address( packet.address, addresses[i] );
+            messages[i].msg_hdr.msg_iov = &iov[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        const int result = sendmmsg( m_socket, messages, num_batch, 0 );
+
+        if ( result <= 0 )
+        {
+            fprintf( stderr, "sendmmsg failed: %s\n", strerror( errno ) );
+            break;
+        }
+
+        num_sent += result;
+    }
+
+    return num_sent;
+
+#else // #ifdef __linux__
+
+    int num_sent = 0;
+
+    for ( int i = 0; i < num_packets; ++i )
+    {
+        if ( !SendPacket( packets[i].address, packets[i].data, packets[i].bytes ) )
+            break;
+        num_sent++;
+    }
+
+    return num_sent;
+
+#endif // #ifdef __linux__
+}
+
 int Socket::ReceivePacket( Address & sender, uint8_t * buffer, int buffer_size )
 {
     assert( m_socket );
@@ -93,6 +93,13 @@ enum SocketError
     SOCKET_ERROR_SET_NON_BLOCKING_FAILED
 };
 
+struct PacketSend
+{
+    Address address;
+    const uint8_t * data;
+    int bytes;
+};
+
 class Socket
 {
 public:
@@ -103,6 +110,8 @@ public:
 
     bool SendPacket( const Address & address, const uint8_t * data, int bytes );
 
+    int SendPackets( const PacketSend * packets, int num_packets );
+
     int ReceivePacket( Address & sender, uint8_t * buffer, int buffer_size );
 
     uint16_t GetPort() { return m_port; }
@@ -4,19 +4,27 @@
 #define PACKETS_H
 
 #include "protocol.h"
+#include "snapshot.h"
+#include "connection.h"
 #include "game.h"
 #include "vectorial/vec3f.h"
 #include "vectorial/quat4f.h"
+#include <stdio.h>
+#include <inttypes.h>
+#include <stdlib.h>
 
 using namespace vectorial;
 
 enum PacketType
 {
     PACKET_TYPE_CONNECTION_REQUEST,
+    PACKET_TYPE_CONNECTION_CHALLENGE,
+    PACKET_TYPE_CONNECTION_RESPONSE,
     PACKET_TYPE_CONNECTION_ACCEPTED,
     PACKET_TYPE_CONNECTION_DENIED,
     PACKET_TYPE_INPUT,
     PACKET_TYPE_SNAPSHOT,
+    PACKET_TYPE_BLOCK_FRAGMENT,
     NUM_PACKET_TYPES
 };
 
@@ -29,11 +37,49 @@ struct ConnectionRequestPacket : public Packet
 {
     uint64_t client_guid;
     uint16_t connect_sequence;
+    uint8_t padding[ConnectionRequestPadding] = {};     // so a spoofed request can't get back more bytes than it sent
 
     SERIALIZE_OBJECT( stream )
     {
         serialize_uint64( stream, client_guid );
         serialize_uint16( stream, connect_sequence );
+        serialize_bytes( stream, padding, ConnectionRequestPadding );
+    }
+};
+
+struct ConnectionChallengePacket : public Packet
+{
+    uint64_t client_guid;
+    uint16_t connect_sequence;
+    uint64_t server_guid;
+    uint64_t challenge_timestamp;
+    uint64_t challenge_token;
+
+    SERIALIZE_OBJECT( stream )
+    {
+        serialize_uint64( stream, client_guid );
+        serialize_uint16( stream, connect_sequence );
+        serialize_uint64( stream, server_guid );
+        serialize_uint64( stream, challenge_timestamp );
+        serialize_uint64( stream, challenge_token );
+    }
+};
+
+struct ConnectionResponsePacket : public Packet
+{
+    uint64_t client_guid;
+    uint16_t connect_sequence;
+    uint64_t server_guid;
+    uint64_t challenge_timestamp;
+    uint64_t challenge_token;
+
+    SERIALIZE_OBJECT( stream )
+    {
+        serialize_uint64( stream, client_guid );
+        serialize_uint16( stream, connect_sequence );
+        serialize_uint64( stream, server_guid );
+        serialize_uint64( stream, challenge_timestamp );
+        serialize_uint64( stream, challenge_token );
     }
 };
 
@@ -41,11 +87,13 @@ struct ConnectionAcceptedPacket : public Packet
 {
     uint64_t client_guid;
     uint16_t connect_sequence;
+    uint64_t server_guid;
 
     SERIALIZE_OBJECT( stream )
     {
         serialize_uint64( stream, client_guid );
         serialize_uint16( stream, connect_sequence );
+        serialize_uint64( stream, server_guid );
     }
 };
 
@@ -53,29 +101,48 @@ struct ConnectionDeniedPacket : public Packet
 {
     uint64_t client_guid;
     uint16_t connect_sequence;
+    uint64_t server_guid;
 
     SERIALIZE_OBJECT( stream )
     {
         serialize_uint64( stream, client_guid );
+        serialize_uint16( stream, connect_sequence );
+        serialize_uint64( stream, server_guid );
     }
 };
 
 struct InputPacket : public Packet
 {
+    ConnectionHeader header;
     bool synchronizing = false;
     bool bracketed = false;
     uint16_t sync_offset = 0;
     uint16_t sync_sequence = 0;
     uint16_t adjustment_sequence = 0;
     uint64_t tick = 0;
+    uint64_t snapshot_ack = 0;                              // most recent snapshot the client has the full state of. 0 if none yet
+    bool block_ack = false;                                 // true while the client is receiving the world block
+    uint16_t block_id = 0;
+    uint32_t block_acks = 0;                                // bitfield of world block fragments received
     int num_inputs = 0;
     Input input[MaxInputsPerPacket];
 
     SERIALIZE_OBJECT( stream )
     {
+        serialize_category( stream, PACKET_CATEGORY_HEADER );
+        serialize_connection_header( stream, header );
         serialize_bool( stream, synchronizing );
+        serialize_category( stream, PACKET_CATEGORY_BLOCK );
+        serialize_bool( stream, block_ack );
+        if ( block_ack )
+        {
+            serialize_uint16( stream, block_id );
+            serialize_uint32( stream, block_acks );
+        }
+        serialize_category( stream, PACKET_CATEGORY_HEADER );
         if ( synchronizing )
         {
+            serialize_category( stream, PACKET_CATEGORY_SYNC );
             serialize_uint16( stream, sync_offset );
             serialize_uint16( stream, sync_sequence );
             serialize_uint64( stream, tick );
@@ -83,8 +150,12 @@ struct InputPacket : public Packet
         else
         {
             serialize_uint64( stream, tick );
+            serialize_category( stream, PACKET_CATEGORY_SYNC );
             serialize_bool( stream, bracketed );
             serialize_uint16( stream, adjustment_sequence );
+            serialize_category( stream, PACKET_CATEGORY_HEADER );
+            serialize_uint64( stream, snapshot_ack );
+            serialize_category( stream, PACKET_CATEGORY_INPUT );
             serialize_int( stream, num_inputs, 0, MaxInputsPerPacket );
             for ( int i = 0; i < num_inputs; ++i )
             {
@@ -153,8 +224,55 @@ template <typename Stream> inline void serialize_quaternion( Stream & stream, ve
         quaternion.load( values );
 }
 
+template <typename Stream> inline void serialize_compressed_vector( Stream & stream, vec3f & vector, float maximum, float resolution )
+{
+    float values[3];
+    if ( Stream::IsWriting )
+        vector.store( values );
+    serialize_compressed_float( stream, values[0], -maximum, +maximum, resolution );
+    serialize_compressed_float( stream, values[1], -maximum, +maximum, resolution );
+    serialize_compressed_float( stream, values[2], -maximum, +maximum, resolution );
+    if ( Stream::IsReading )
+        vector.load( values );
+}
+
+struct SnapshotCube
+{
+    int entity_index;
+    QuantizedCubeState state;
+    bool at_rest;
+    vec3f linear_velocity;
+    vec3f angular_velocity;
+
+    SERIALIZE_OBJECT( stream )
+    {
+        serialize_category( stream, PACKET_CATEGORY_INDEX );
+        serialize_int( stream, entity_index, 0, MaxEntities - 1 );
+        serialize_bool( stream, state.interacting );
+        serialize_bool( stream, at_rest );
+        serialize_category( stream, PACKET_CATEGORY_POSITION );
+        serialize_int( stream, state.position_x, -QuantizedPositionBoundXY, QuantizedPositionBoundXY );
+        serialize_int( stream, state.position_y, -QuantizedPositionBoundXY, QuantizedPositionBoundXY );
+        serialize_int( stream, state.position_z, 0, QuantizedPositionBoundZ );
+        serialize_category( stream, PACKET_CATEGORY_ORIENTATION );
+        serialize_object( stream, state.orientation );
+        if ( !at_rest )
+        {
+            serialize_category( stream, PACKET_CATEGORY_VELOCITY );
+            serialize_compressed_vector( stream, linear_velocity, MaxLinearSpeed, LinearVelocityResolution );
+            serialize_compressed_vector( stream, angular_velocity, MaxAngularSpeed, AngularVelocityResolution );
+        }
+        else if ( Stream::IsReading )
+        {
+            linear_velocity = vec3f(0,0,0);
+            angular_velocity = vec3f(0,0,0);
+        }
+    }
+};
+
 struct SnapshotPacket : public Packet
 {
+    ConnectionHeader header;
     bool synchronizing = false;
     bool bracketing = false;
     bool reconnect = false;
@@ -164,22 +282,29 @@ struct SnapshotPacket : public Packet
     int adjustment_offset = 0;
     uint64_t tick = 0;
     uint64_t input_ack = 0;
-    vec3f cube_position;
-    quat4f cube_orientation;
-    vec3f cube_linear_velocity;
-    vec3f cube_angular_velocity;
+    bool delta = false;                                     // if true, the full snapshot encoded relative to baseline tick follows
+    uint64_t baseline_tick = 0;
+    int delta_bytes = 0;
+    uint8_t delta_data[MaxSnapshotBytes];
+    int num_cubes = 0;
+    SnapshotCube cubes[MaxCubesPerSnapshot];
 
     SERIALIZE_OBJECT( stream )
     {
+        serialize_category( stream, PACKET_CATEGORY_HEADER );
+        serialize_connection_header( stream, header );
         serialize_bool( stream, synchronizing );
         if ( synchronizing )
         {
+            serialize_category( stream, PACKET_CATEGORY_SYNC );
             serialize_uint64( stream, tick );
             serialize_uint16( stream, sync_offset );
         }
         else
         {
             serialize_bool( stream, reconnect );
+
+            serialize_category( stream, PACKET_CATEGORY_SYNC );
             serialize_bool( stream, bracketing );
             serialize_uint16( stream, bracket_offset );
 
@@ -189,144 +314,336 @@ struct SnapshotPacket : public Packet
                 serialize_int( stream, adjustment_offset, AdjustmentOffsetMinimum, AdjustmentOffsetMaximum );
             }
 
+            serialize_category( stream, PACKET_CATEGORY_HEADER );
             serialize_uint64( stream, tick );
             serialize_uint64( stream, input_ack );
 
-            serialize_vector( stream, cube_position );
-            serialize_quaternion( stream, cube_orientation );
-            serialize_vector( stream, cube_linear_velocity );
-            serialize_vector( stream, cube_angular_velocity );
+            serialize_bool( stream, delta );
+            if ( delta )
+            {
+                serialize_uint64( stream, baseline_tick );
+                serialize_category( stream, PACKET_CATEGORY_DELTA );
+                serialize_int( stream, delta_bytes, 1, MaxSnapshotBytes );
+                serialize_bytes( stream, delta_data, delta_bytes );
+            }
+            else
+            {
+                serialize_category( stream, PACKET_CATEGORY_INDEX );
+                serialize_int( stream, num_cubes, 0, MaxCubesPerSnapshot );
+                for ( int i = 0; i < num_cubes; ++i )
+                    serialize_object( stream, cubes[i] );
+            }
         }
     }
 };
 
-bool write_packet( WriteStream & stream, Packet & base_packet, int & packet_bytes )
+struct BlockFragmentPacket : public Packet
 {
-    typedef WriteStream Stream;
-    serialize_int( stream, base_packet.type, 0, NUM_PACKET_TYPES - 1 );
-    switch ( base_packet.type )
+    ConnectionHeader header;
+    uint16_t block_id = 0;
+    int block_size = 0;
+    int fragment_index = 0;
+    int fragment_bytes = 0;
+    uint8_t fragment_data[BlockFragmentSize];
+
+    SERIALIZE_OBJECT( stream )
     {
-        // todo: convert these to macros
+        serialize_category( stream, PACKET_CATEGORY_HEADER );
+        serialize_connection_header( stream, header );
+        serialize_uint16( stream, block_id );
+        serialize_int( stream, block_size, 1, MaxBlockSize );
+        serialize_int( stream, fragment_index, 0, MaxBlockFragments - 1 );
+        serialize_int( stream, fragment_bytes, 1, BlockFragmentSize );
+        serialize_category( stream, PACKET_CATEGORY_BLOCK );
+        serialize_bytes( stream, fragment_data, fragment_bytes );
+    }
+};
 
-        case PACKET_TYPE_CONNECTION_REQUEST:
-        {
-            ConnectionRequestPacket & packet = (ConnectionRequestPacket&) base_packet;
-            serialize_object( stream, packet );
-        }
-        break;
+// each packet type has an entry in the table below with the functions that serialize it for each stream, create
+// it and name it. adding a packet type means adding its enum value, its struct and one line in the table.
 
-        case PACKET_TYPE_CONNECTION_ACCEPTED:
-        {
-            ConnectionAcceptedPacket & packet = (ConnectionAcceptedPacket&) base_packet;
-            serialize_object( stream, packet );
-        }
-        break;
+struct PacketTypeInfo
+{
+    const char * name;
+    void (*serialize_read)( ReadStream & stream, Packet & packet );
+    void (*serialize_write)( WriteStream & stream, Packet & packet );
+    void (*serialize_measure)( MeasureStream & stream, Packet & packet );
+    Packet * (*create)();
+    void (*destroy)( Packet * packet );
+};
 
-        case PACKET_TYPE_CONNECTION_DENIED:
-        {
-            ConnectionDeniedPacket & packet = (ConnectionDeniedPacket&) base_packet;
-            serialize_object( stream, packet );
-        }
-        break;
+template <typename T, typename Stream> void serialize_packet_type( Stream & stream, Packet & packet )
+{
+    serialize_object( stream, (T&) packet );
+}
 
-        case PACKET_TYPE_INPUT:
-        {
-            InputPacket & packet = (InputPacket&) base_packet;
-            serialize_object( stream, packet );
-        }
-        break;
+template <typename T> Packet * create_packet_type()
+{
+    return new T();
+}
 
-        case PACKET_TYPE_SNAPSHOT:
-        {
-            SnapshotPacket & packet = (SnapshotPacket&) base_packet;
-            serialize_object( stream, packet );
-        }
-        break;
+template <typename T> void destroy_packet_type( Packet * packet )
+{
+    delete (T*) packet;
+}
+
+#define PACKET_TYPE_INFO( name, packet_struct )                     \
+    {                                                               \
+        name,                                                       \
+        serialize_packet_type<packet_struct, ReadStream>,           \
+        serialize_packet_type<packet_struct, WriteStream>,          \
+        serialize_packet_type<packet_struct, MeasureStream>,        \
+        create_packet_type<packet_struct>,                          \
+        destroy_packet_type<packet_struct>                          \
     }
+
+static const PacketTypeInfo packet_type_info[] =
+{
+    PACKET_TYPE_INFO( "connection request", ConnectionRequestPacket ),          // PACKET_TYPE_CONNECTION_REQUEST
+    PACKET_TYPE_INFO( "connection challenge", ConnectionChallengePacket ),      // PACKET_TYPE_CONNECTION_CHALLENGE
+    PACKET_TYPE_INFO( "connection response", ConnectionResponsePacket ),        // PACKET_TYPE_CONNECTION_RESPONSE
+    PACKET_TYPE_INFO( "connection accepted", ConnectionAcceptedPacket ),        // PACKET_TYPE_CONNECTION_ACCEPTED
+    PACKET_TYPE_INFO( "connection denied", ConnectionDeniedPacket ),            // PACKET_TYPE_CONNECTION_DENIED
+    PACKET_TYPE_INFO( "input", InputPacket ),                                   // PACKET_TYPE_INPUT
+    PACKET_TYPE_INFO( "snapshot", SnapshotPacket ),                             // PACKET_TYPE_SNAPSHOT
+    PACKET_TYPE_INFO( "block fragment", BlockFragmentPacket ),                  // PACKET_TYPE_BLOCK_FRAGMENT
+};
+
+static_assert( sizeof( packet_type_info ) / sizeof( PacketTypeInfo ) == NUM_PACKET_TYPES, "every packet type needs an entry in the packet type table" );
+
+inline void serialize_packet_body( ReadStream & stream, Packet & packet ) { packet_type_info[packet.type].serialize_read( stream, packet ); }
+
+inline void serialize_packet_body( WriteStream & stream, Packet & packet ) { packet_type_info[packet.type].serialize_write( stream, packet ); }
+
+inline void serialize_packet_body( MeasureStream & stream, Packet & packet ) { packet_type_info[packet.type].serialize_measure( stream, packet ); }
+
+template <typename Stream> void serialize_packet( Stream & stream, Packet & base_packet )
+{
+    serialize_category( stream, PACKET_CATEGORY_HEADER );
+    serialize_int( stream, base_packet.type, 0, NUM_PACKET_TYPES - 1 );
+    serialize_packet_body( stream, base_packet );
+}
+
+bool write_packet( WriteStream & stream, Packet & base_packet, int & packet_bytes )
+{
+    serialize_packet( stream, base_packet );
     stream.Flush();
     packet_bytes = stream.GetBytesProcessed();
     return !stream.IsOverflow();
 }
 
-extern bool process_packet( const class Address & from, Packet & packet, void * context );
+int measure_packet( MeasureStream & stream, Packet & base_packet )
+{
+    serialize_packet( stream, base_packet );
+    return stream.GetBitsProcessed();
+}
 
-bool read_packet( const class Address & from, uint8_t * buffer, int buffer_size, void * context )
+int peek_packet_type( uint8_t * buffer, int buffer_size )
 {
     typedef ReadStream Stream;
     int packet_type;
     ReadStream stream( buffer, buffer_size );
     serialize_int( stream, packet_type, 0, NUM_PACKET_TYPES - 1 );
-    switch( packet_type )
-    {
-        // todo: convert these to macros
+    return !stream.IsOverflow() ? packet_type : -1;
+}
 
-        case PACKET_TYPE_CONNECTION_REQUEST:
-        {
-            ConnectionRequestPacket packet;
-            packet.type = packet_type;
-            serialize_object( stream, packet );
-            if ( !stream.IsOverflow() )
-                return process_packet( from, packet, context );
-        }
-        break;
+typedef bool (*PacketProcessFunction)( const class Address & from, Packet & packet, void * context );
 
-        case PACKET_TYPE_CONNECTION_ACCEPTED:
-        {
-            ConnectionAcceptedPacket packet;
-            packet.type = packet_type;
-            serialize_object( stream, packet );
-            if ( !stream.IsOverflow() )
-                return process_packet( from, packet, context );
-        }
-        break;
+struct PacketFactory
+{
+    // the server and client each register a process function for the packet types they accept. received packets
+    // are read into one packet object per type that is reused for every packet, so nothing is constructed per-packet.
+    // fields a packet doesn't serialize keep their values from the previous packet of that type, so process functions
+    // must only look at fields the packet's flags say are present.
 
-        case PACKET_TYPE_CONNECTION_DENIED:
-        {
-            ConnectionDeniedPacket packet;
-            packet.type = packet_type;
-            serialize_object( stream, packet );
-            if ( !stream.IsOverflow() )
-                return process_packet( from, packet, context );
-        }
-        break;
+    Packet * packets[NUM_PACKET_TYPES];
+    PacketProcessFunction process[NUM_PACKET_TYPES];
+};
 
-        case PACKET_TYPE_INPUT:
-        {
-            InputPacket packet;
-            packet.type = packet_type;
-            serialize_object( stream, packet );
-            if ( !stream.IsOverflow() )
-                return process_packet( from, packet, context );
-        }
-        break;
+inline void packet_factory_init( PacketFactory & factory )
+{
+    for ( int i = 0; i < NUM_PACKET_TYPES; ++i )
+    {
+        factory.packets[i] = nullptr;
+        factory.process[i] = nullptr;
+    }
+}
 
-        case PACKET_TYPE_SNAPSHOT:
-        {
-            SnapshotPacket packet;
-            packet.type = packet_type;
-            serialize_object( stream, packet );
-            if ( !stream.IsOverflow() )
-                return process_packet( from, packet, context );
-        }
-        break;
+inline void packet_factory_register( PacketFactory & factory, int packet_type, PacketProcessFunction process )
+{
+    assert( packet_type >= 0 );
+    assert( packet_type < NUM_PACKET_TYPES );
+    assert( process );
+    assert( !factory.packets[packet_type] );
+    factory.packets[packet_type] = packet_type_info[packet_type].create();
+    factory.packets[packet_type]->type = packet_type;
+    factory.process[packet_type] = process;
+}
+
+inline void packet_factory_free( PacketFactory & factory )
+{
+    for ( int i = 0; i < NUM_PACKET_TYPES; ++i )
+    {
+        if ( factory.packets[i] )
+            packet_type_info[i].destroy( factory.packets[i] );
+        factory.packets[i] = nullptr;
+        factory.process[i] = nullptr;
     }
+}
 
-    return false;
+bool read_packet( PacketFactory & factory, const class Address & from, uint8_t * buffer, int buffer_size, void * context )
+{
+    typedef ReadStream Stream;
+    int packet_type;
+    ReadStream stream( buffer, buffer_size );
+    serialize_int( stream, packet_type, 0, NUM_PACKET_TYPES - 1 );
+    if ( stream.IsOverflow() || packet_type >= NUM_PACKET_TYPES || !factory.packets[packet_type] )
+        return false;
+
+    Packet & packet = *factory.packets[packet_type];
+    serialize_packet_body( stream, packet );
+    if ( stream.IsOverflow() )
+        return false;
+
+    return factory.process[packet_type]( from, packet, context );
 }
 
 const char * packet_type_string( int packet_type )
 {
-    switch ( packet_type )
+    assert( packet_type >= 0 );
+    assert( packet_type < NUM_PACKET_TYPES );
+    return packet_type_info[packet_type].name;
+}
+
+const char * packet_category_string( int packet_category )
+{
+    switch ( packet_category )
     {
-        case PACKET_TYPE_CONNECTION_REQUEST:                return "connection request";
-        case PACKET_TYPE_CONNECTION_ACCEPTED:               return "connection accepted";
-        case PACKET_TYPE_CONNECTION_DENIED:                 return "connection denied";
-        case PACKET_TYPE_INPUT:                             return "input";
-        case PACKET_TYPE_SNAPSHOT:                          return "snapshot";
+        case PACKET_CATEGORY_HEADER:                        return "header";
+        case PACKET_CATEGORY_SYNC:                          return "sync";
+        case PACKET_CATEGORY_INPUT:                         return "input";
+        case PACKET_CATEGORY_INDEX:                         return "index";
+        case PACKET_CATEGORY_POSITION:                      return "position";
+        case PACKET_CATEGORY_ORIENTATION:                   return "orientation";
+        case PACKET_CATEGORY_VELOCITY:                      return "velocity";
+        case PACKET_CATEGORY_DELTA:                         return "delta";
+        case PACKET_CATEGORY_BLOCK:                         return "block";
         default:
             assert( false );
             return "???";
     }
 }
 
+struct PacketBufferPool
+{
+    // preallocated packet buffers that packets are written into and sent from, and received into.
+    // each buffer is MaxPacketSize bytes and starts on a cacheline.
+
+    void * memory = nullptr;
+    uint8_t * buffers = nullptr;
+    int num_free = 0;
+    int free_list[PacketBufferPoolSize];
+};
+
+static_assert( MaxPacketSize % PacketBufferAlignment == 0, "packet buffers must stay cacheline aligned" );
+
+inline void packet_buffer_pool_init( PacketBufferPool & pool )
+{
+    pool.memory = malloc( PacketBufferPoolSize * MaxPacketSize + PacketBufferAlignment - 1 );
+    pool.buffers = (uint8_t*) ( ( uintptr_t( pool.memory ) + PacketBufferAlignment - 1 ) & ~uintptr_t( PacketBufferAlignment - 1 ) );
+    pool.num_free = PacketBufferPoolSize;
+    for ( int i = 0; i < PacketBufferPoolSize; ++i )
+        pool.free_list[i] = PacketBufferPoolSize - 1 - i;
+}
+
+inline void packet_buffer_pool_free( PacketBufferPool & pool )
+{
+    assert( pool.num_free == PacketBufferPoolSize );
+    free( pool.memory );
+    pool.memory = nullptr;
+    pool.buffers = nullptr;
+    pool.num_free = 0;
+}
+
+inline uint8_t * packet_buffer_alloc( PacketBufferPool & pool )
+{
+    if ( pool.num_free == 0 )
+        return nullptr;
+    return pool.buffers + pool.free_list[--pool.num_free] * MaxPacketSize;
+}
+
+inline void packet_buffer_free( PacketBufferPool & pool, uint8_t * buffer )
+{
+    assert( buffer );
+    assert( buffer >= pool.buffers );
+    assert( buffer < pool.buffers + PacketBufferPoolSize * MaxPacketSize );
+    assert( ( buffer - pool.buffers ) % MaxPacketSize == 0 );
+    assert( pool.num_free < PacketBufferPoolSize );
+    pool.free_list[pool.num_free++] = int( ( buffer - pool.buffers ) / MaxPacketSize );
+}
+
+struct PacketProfile
+{
+    uint64_t num_packets[NUM_PACKET_TYPES];
+    uint64_t packet_bytes[NUM_PACKET_TYPES];
+    uint64_t category_bits[NUM_PACKET_TYPES][NUM_PACKET_CATEGORIES];
+};
+
+inline void packet_profile_reset( PacketProfile & profile )
+{
+    memset( &profile, 0, sizeof( profile ) );
+}
+
+inline void packet_profile_add( PacketProfile & profile, Packet & packet, int packet_bytes )
+{
+    // run the packet through a measure stream to find out where the bits went. the measure stream
+    // counts worst case alignment, so the category breakdown can be a few bits over the actual size.
+
+    assert( packet.type < NUM_PACKET_TYPES );
+
+    MeasureStream stream( MaxPacketSize );
+
+    measure_packet( stream, packet );
+
+    profile.num_packets[packet.type]++;
+    profile.packet_bytes[packet.type] += packet_bytes;
+
+    for ( int i = 0; i < NUM_PACKET_CATEGORIES; ++i )
+        profile.category_bits[packet.type][i] += stream.GetCategoryBits( i );
+}
+
+inline void packet_profile_print( const PacketProfile & profile, FILE * file )
+{
+    fprintf( file, "%-20s %10s %12s %10s", "packet type", "packets", "bytes", "avg bytes" );
+    for ( int i = 0; i < NUM_PACKET_CATEGORIES; ++i )
+        fprintf( file, " %12s", packet_category_string( i ) );
+    fprintf( file, "\n" );
+
+    uint64_t total_bytes = 0;
+    uint64_t total_category_bits[NUM_PACKET_CATEGORIES] = {};
+
+    for ( int i = 0; i < NUM_PACKET_TYPES; ++i )
+    {
+        if ( profile.num_packets[i] == 0 )
+            continue;
+
+        fprintf( file, "%-20s %10" PRIu64 " %12" PRIu64 " %10.1f", packet_type_string( i ), profile.num_packets[i], profile.packet_bytes[i], profile.packet_bytes[i] / double( profile.num_packets[i] ) );
+
+        for ( int j = 0; j < NUM_PACKET_CATEGORIES; ++j )
+        {
+            fprintf( file, " %11.1f%%", profile.packet_bytes[i] ? 100.0 * profile.category_bits[i][j] / ( profile.packet_bytes[i] * 8.0 ) : 0.0 );
+            total_category_bits[j] += profile.category_bits[i][j];
+        }
+
+        fprintf( file, "\n" );
+
+        total_bytes += profile.packet_bytes[i];
+    }
+
+    fprintf( file, "%-20s %10s %12" PRIu64 " %10s", "total bytes", "", total_bytes, "" );
+    for ( int i = 0; i < NUM_PACKET_CATEGORIES; ++i )
+        fprintf( file, " %12" PRIu64, total_category_bits[i] / 8 );
+    fprintf( file, "\n" );
+}
+
 #endif // #ifndef PACKETS_H
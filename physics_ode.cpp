@@ -472,6 +472,9 @@ void PhysicsManager::WalkInteractions( EntityManager * entity_manager )
 {
 	for ( int player_id = ENTITY_PLAYER_BEGIN; player_id < ENTITY_PLAYER_END; ++player_id )
 	{
+		if ( entity_manager->GetType( player_id ) != ENTITY_TYPE_CUBE )
+			continue;
+
 		std::vector<bool> interacting( MaxPhysicsObjects, false );
 		std::vector<bool> ignores( MaxPhysicsObjects, false );
 		std::vector<int> queue( MaxPhysicsObjects );
@@ -12,7 +12,7 @@ project "server"
     buildoptions "-std=c++11"
     kind "ConsoleApp"
     files { "*.cpp" }
-    excludes { "client.cpp", "render.cpp" }
+    excludes { "client.cpp", "render.cpp", "bench.cpp", "render_bench.cpp", "test.cpp" }
     links { "ode", "pthread" }
     defines { "SERVER" }
 
@@ -21,13 +21,37 @@ project "client"
     buildoptions "-std=c++11 -stdlib=libc++ -Wno-deprecated-declarations"
     kind "ConsoleApp"
     files { "*.cpp" }
-    excludes { "server.cpp" }
+    excludes { "server.cpp", "bench.cpp", "render_bench.cpp", "test.cpp" }
     links { "ode", "glew", "glfw3", "GLUT.framework", "OpenGL.framework", "Cocoa.framework", "CoreVideo.framework", "IOKit.framework" }
     defines { "CLIENT" }
 
+project "bench"
+    language "C++"
+    buildoptions "-std=c++11"
+    kind "ConsoleApp"
+    files { "bench.cpp" }
+
+project "test"
+    language "C++"
+    buildoptions "-std=c++11"
+    kind "ConsoleApp"
+    files { "test.cpp", "network.cpp", "game.cpp" }
+
+project "render_bench"
+    language "C++"
+    buildoptions "-std=c++11 -Wno-deprecated-declarations"
+    kind "ConsoleApp"
+    files { "*.cpp" }
+    excludes { "client.cpp", "server.cpp", "bench.cpp", "test.cpp" }
+    links { "ode", "GLEW", "EGL", "GL", "pthread" }
+    defines { "CLIENT" }
+
 if _ACTION == "clean" then
     os.remove "client"
     os.remove "server"
+    os.remove "bench"
+    os.remove "test"
+    os.remove "render_bench"
     os.rmdir "obj"
     if not os.is "windows" then
         os.execute "rm -f *.zip"
@@ -72,4 +96,49 @@ if not os.is "windows" then
         end
     }
 
+    newaction
+    {
+        trigger     = "bench",
+        description = "Build and run benchmarks",
+        valid_kinds = premake.action.get("gmake").valid_kinds,
+        valid_languages = premake.action.get("gmake").valid_languages,
+        valid_tools = premake.action.get("gmake").valid_tools,
+     
+        execute = function ()
+            if os.execute "make bench config=release_x64" == 0 then
+                os.execute "./bench"
+            end
+        end
+    }
+
+    newaction
+    {
+        trigger     = "test",
+        description = "Build and run tests",
+        valid_kinds = premake.action.get("gmake").valid_kinds,
+        valid_languages = premake.action.get("gmake").valid_languages,
+        valid_tools = premake.action.get("gmake").valid_tools,
+     
+        execute = function ()
+            if os.execute "make test" == 0 then
+                os.execute "./test"
+            end
+        end
+    }
+
+    newaction
+    {
+        trigger     = "render_bench",
+        description = "Build and run the offscreen render benchmark",
+        valid_kinds = premake.action.get("gmake").valid_kinds,
+        valid_languages = premake.action.get("gmake").valid_languages,
+        valid_tools = premake.action.get("gmake").valid_tools,
+     
+        execute = function ()
+            if os.execute "make render_bench config=release_x64" == 0 then
+                os.execute "./render_bench"
+            end
+        end
+    }
+
 end
@@ -0,0 +1,148 @@
+// Copyright © 2015, The Network Protocol Company, Inc. All Rights Reserved.
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "const.h"
+#include "platform.h"
+#include <stdint.h>
+#include <string.h>
+#include <stdio.h>
+#include <assert.h>
+#include <atomic>
+
+// per-frame timings for the phases of a client frame. each thread that does work fills in one profile frame per loop
+// with scoped timers, then publishes it to its own ring. a ring has one writer, and readers take a copy of the most
+// recent frames for the overlay or a dump to file. gpu timings come from timer queries, a few frames after the fact.
+
+enum ProfilePhase
+{
+    PROFILE_INPUT,                                          // window events and input sampling on the main thread
+    PROFILE_RECEIVE_PACKETS,
+    PROFILE_CLIENT_FRAME,
+    PROFILE_RENDER_GET_STATE,
+    PROFILE_SEND_PACKETS,
+    PROFILE_CULL_SCENE,
+    PROFILE_RENDER_SCENE,
+    PROFILE_RENDER_SHADOWS,
+    PROFILE_SWAP,
+    NUM_PROFILE_PHASES
+};
+
+inline const char * profile_phase_string( int phase )
+{
+    switch ( phase )
+    {
+        case PROFILE_INPUT:                 return "input";
+        case PROFILE_RECEIVE_PACKETS:       return "receive packets";
+        case PROFILE_CLIENT_FRAME:          return "client frame";
+        case PROFILE_RENDER_GET_STATE:      return "render get state";
+        case PROFILE_SEND_PACKETS:          return "send packets";
+        case PROFILE_CULL_SCENE:            return "cull scene";
+        case PROFILE_RENDER_SCENE:          return "render scene";
+        case PROFILE_RENDER_SHADOWS:        return "render shadows";
+        case PROFILE_SWAP:                  return "swap";
+        default:
+            assert( false );
+            return "???";
+    }
+}
+
+struct ProfileFrame
+{
+    uint64_t frame;
+    double time;                                            // real time at the start of the frame
+    float cpu_time[NUM_PROFILE_PHASES];                     // seconds. zero for phases this thread doesn't run
+    float gpu_time[NUM_PROFILE_PHASES];                     // seconds. only phases that issue gl draws have gpu times. ProfileGpuTimeUnavailable if the query wasn't ready
+};
+
+struct ProfileRing
+{
+    // twice the history readers copy, so the writer would have to lap a reader by a full history to tear a frame it is copying
+
+    ProfileFrame frames[ProfileHistory * 2];
+    std::atomic<uint64_t> num_frames;
+
+    ProfileRing() : num_frames( 0 ) {}
+};
+
+inline ProfileFrame & profile_ring_begin_frame( ProfileRing & ring, double time )
+{
+    const uint64_t frame = ring.num_frames.load( std::memory_order_relaxed );
+    ProfileFrame & profile = ring.frames[frame % ( ProfileHistory * 2 )];
+    memset( &profile, 0, sizeof( ProfileFrame ) );
+    profile.frame = frame;
+    profile.time = time;
+    return profile;
+}
+
+inline void profile_ring_end_frame( ProfileRing & ring )
+{
+    ring.num_frames.store( ring.num_frames.load( std::memory_order_relaxed ) + 1, std::memory_order_release );
+}
+
+inline int profile_ring_read( const ProfileRing & ring, ProfileFrame * frames )
+{
+    // copies up to ProfileHistory of the most recently published frames, oldest first
+
+    const uint64_t num_frames = ring.num_frames.load( std::memory_order_acquire );
+    const int count = num_frames < ProfileHistory ? (int) num_frames : ProfileHistory;
+
+    for ( int i = 0; i < count; ++i )
+        frames[i] = ring.frames[( num_frames - count + i ) % ( ProfileHistory * 2 )];
+
+    return count;
+}
+
+struct ProfileScope
+{
+    // adds the time from construction to destruction to a phase of the profile frame
+
+    ProfileFrame & profile;
+    ProfilePhase phase;
+    double start_time;
+
+    ProfileScope( ProfileFrame & _profile, ProfilePhase _phase ) : profile( _profile ), phase( _phase ), start_time( platform_time() ) {}
+
+    ~ProfileScope()
+    {
+        profile.cpu_time[phase] += float( platform_time() - start_time );
+    }
+};
+
+inline bool profile_dump( const char * filename, const ProfileFrame * frames, int num_frames, const char * name, bool append )
+{
+    FILE * file = fopen( filename, append ? "a" : "w" );
+    if ( !file )
+        return false;
+
+    fprintf( file, "%s\n", name );
+
+    fprintf( file, "frame,time" );
+    for ( int i = 0; i < NUM_PROFILE_PHASES; ++i )
+        fprintf( file, ",%s cpu,%s gpu", profile_phase_string( i ), profile_phase_string( i ) );
+    fprintf( file, "\n" );
+
+    for ( int i = 0; i < num_frames; ++i )
+    {
+        const ProfileFrame & frame = frames[i];
+        fprintf( file, "%llu,%.6f", (unsigned long long) frame.frame, frame.time );
+        for ( int j = 0; j < NUM_PROFILE_PHASES; ++j )
+        {
+            // unavailable gpu times are left empty, so they don't read as a measurement of zero
+            if ( frame.gpu_time[j] < 0.0f )
+                fprintf( file, ",%.3f,", frame.cpu_time[j] * 1000.0f );
+            else
+                fprintf( file, ",%.3f,%.3f", frame.cpu_time[j] * 1000.0f, frame.gpu_time[j] * 1000.0f );
+        }
+        fprintf( file, "\n" );
+    }
+
+    fprintf( file, "\n" );
+
+    fclose( file );
+
+    return true;
+}
+
+#endif // #ifndef PROFILER_H
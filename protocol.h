@@ -135,7 +135,7 @@ public:
         m_bitIndex = 0;
         m_wordIndex = 0;
         m_overflow = false;
-        memset( m_data, 0, bytes );
+        // no need to clear the buffer. every word is stored whole from the scratch
     }
 
     void WriteBits( uint32_t value, int bits )
@@ -542,6 +542,11 @@ public:
         m_context = context;
     }
 
+    void SetCategory( int /*category*/ )
+    {
+        // only measure streams track categories
+    }
+
     const void * GetContext( int index ) const
     {
         assert( index >= 0 );
@@ -639,6 +644,11 @@ public:
         m_context = context;
     }
 
+    void SetCategory( int /*category*/ )
+    {
+        // only measure streams track categories
+    }
+
     const void * GetContext( int index ) const
     {
         assert( index >= 0 );
@@ -676,7 +686,10 @@ public:
     enum { IsWriting = 1 };
     enum { IsReading = 0 };
 
-    MeasureStream( int bytes ) : m_totalBytes( bytes ), m_bitsWritten(0), m_context( nullptr ), m_aborted( false ) {}
+    MeasureStream( int bytes ) : m_totalBytes( bytes ), m_bitsWritten(0), m_category(0), m_context( nullptr ), m_aborted( false )
+    {
+        memset( m_categoryBits, 0, sizeof( m_categoryBits ) );
+    }
 
     void SerializeInteger( int32_t value, int32_t min, int32_t max )
     {
@@ -684,26 +697,26 @@ public:
         assert( value >= min );
         assert( value <= max );
         const int bits = bits_required( min, max );
-        m_bitsWritten += bits;
+        AddBits( bits );
     }
 
     void SerializeBits( uint32_t value, int bits )
     {
         assert( bits > 0 );
         assert( bits <= 32 );
-        m_bitsWritten += bits;
+        AddBits( bits );
     }
 
     void SerializeBytes( const uint8_t * data, int bytes )
     {
         Align();
-        m_bitsWritten += bytes * 8;
+        AddBits( bytes * 8 );
     }
 
     void Align()
     {
         const int alignBits = GetAlignBits();
-        m_bitsWritten += alignBits;
+        AddBits( alignBits );
     }
 
     int GetAlignBits() const
@@ -714,7 +727,7 @@ public:
     bool Check( uint32_t magic )
     {
         Align();
-        m_bitsWritten += 32;
+        AddBits( 32 );
         return true;
     }
 
@@ -748,6 +761,20 @@ public:
         m_context = context;
     }
 
+    void SetCategory( int category )
+    {
+        assert( category >= 0 );
+        assert( category < MaxCategories );
+        m_category = category;
+    }
+
+    int GetCategoryBits( int category ) const
+    {
+        assert( category >= 0 );
+        assert( category < MaxCategories );
+        return m_categoryBits[category];
+    }
+
     const void * GetContext( int index ) const
     {
         assert( index >= 0 );
@@ -767,8 +794,502 @@ public:
 
 private:
 
+    void AddBits( int bits )
+    {
+        m_bitsWritten += bits;
+        m_categoryBits[m_category] += bits;
+    }
+
     int m_totalBytes;
     int m_bitsWritten;
+    int m_category;
+    int m_categoryBits[MaxCategories];
+    const void ** m_context;
+    bool m_aborted;
+};
+
+// entropy coded streams. same interface as read and write streams, but every bit goes through an adaptive binary
+// range coder. bit probabilities are looked up by a context made from the current category, how many fields have
+// been serialized since the category was set, the field size and the bits of the field coded so far. a model trained
+// on recorded traffic gives the starting probabilities, so small packets compress well before adaptation kicks in.
+
+enum 
+{
+    EntropyProbabilityBits = 11,
+    EntropyProbabilityOne = 1 << EntropyProbabilityBits,
+    EntropyAdaptShift = 5,
+    EntropyTopValue = 1 << 24,
+    EntropyTreeBits = 8,
+    EntropyMaxOrdinal = 31
+};
+
+struct EntropyModel
+{
+    uint16_t probability[EntropyContexts];              // probability of a zero bit out of EntropyProbabilityOne
+};
+
+struct EntropyTrainer
+{
+    uint32_t zeros[EntropyContexts];
+    uint32_t ones[EntropyContexts];
+};
+
+inline void entropy_model_reset( EntropyModel & model )
+{
+    for ( int i = 0; i < EntropyContexts; ++i )
+        model.probability[i] = EntropyProbabilityOne / 2;
+}
+
+inline void entropy_trainer_reset( EntropyTrainer & trainer )
+{
+    memset( &trainer, 0, sizeof( trainer ) );
+}
+
+inline void entropy_model_train( EntropyModel & model, const EntropyTrainer & trainer )
+{
+    for ( int i = 0; i < EntropyContexts; ++i )
+    {
+        const double p = ( trainer.zeros[i] + 0.5 ) / ( trainer.zeros[i] + trainer.ones[i] + 1.0 );
+        model.probability[i] = (uint16_t) clamp( int( p * EntropyProbabilityOne + 0.5 ), 31, EntropyProbabilityOne - 31 );
+    }
+}
+
+class EntropyContextState
+{
+public:
+
+    void Reset( const EntropyModel & model )
+    {
+        m_category = 0;
+        m_ordinal = 0;
+        memcpy( m_probability, model.probability, sizeof( m_probability ) );
+    }
+
+    void SetCategory( int category )
+    {
+        m_category = category;
+        m_ordinal = 0;
+    }
+
+    uint32_t BeginField( int bits )
+    {
+        const uint32_t field = ( ( m_category * ( EntropyMaxOrdinal + 1 ) + m_ordinal ) * 33 + bits );
+        m_ordinal = min( m_ordinal + 1, (int) EntropyMaxOrdinal );
+        return field;
+    }
+
+    int GetContext( uint32_t field, uint32_t node ) const
+    {
+        const uint32_t hash = ( ( field << 10 ) | node ) * 2654435761U;
+        return hash >> ( 32 - EntropyContextBits );
+    }
+
+    uint16_t & GetProbability( int context )
+    {
+        assert( context >= 0 );
+        assert( context < EntropyContexts );
+        return m_probability[context];
+    }
+
+private:
+
+    int m_category;
+    int m_ordinal;
+    uint16_t m_probability[EntropyContexts];
+};
+
+class EntropyWriteStream
+{
+public:
+
+    enum { IsWriting = 1 };
+    enum { IsReading = 0 };
+
+    EntropyWriteStream( uint8_t * buffer, int bytes, const EntropyModel & model ) 
+        : m_data( buffer ), m_totalBytes( bytes ), m_bytesWritten( 0 ), m_low( 0 ), m_range( 0xFFFFFFFF ), m_cache( 0 ), m_cacheSize( 1 ),
+          m_overflow( false ), m_trainer( nullptr ), m_context( nullptr ), m_aborted( false )
+    {
+        m_state.Reset( model );
+    }
+
+    void SerializeInteger( int32_t value, int32_t min, int32_t max )
+    {
+        assert( min < max );
+        assert( value >= min );
+        assert( value <= max );
+        const int bits = bits_required( min, max );
+        uint32_t unsigned_value = value - min;
+        EncodeField( unsigned_value, bits );
+    }
+
+    void SerializeBits( uint32_t value, int bits )
+    {
+        assert( bits > 0 );
+        assert( bits <= 32 );
+        EncodeField( value, bits );
+    }
+
+    void SerializeBytes( const uint8_t * data, int bytes )
+    {
+        for ( int i = 0; i < bytes; ++i )
+            EncodeField( data[i], 8 );
+    }
+
+    void Align()
+    {
+        // range coded output is not bit aligned
+    }
+
+    int GetAlignBits() const
+    {
+        return 0;
+    }
+
+    bool Check( uint32_t magic )
+    {
+        SerializeBits( magic, 32 );
+        return true;
+    }
+
+    void Flush()
+    {
+        for ( int i = 0; i < 5; ++i )
+            ShiftLow();
+    }
+
+    const uint8_t * GetData() const
+    {
+        return m_data;
+    }
+
+    int GetBytesProcessed() const
+    {
+        return m_bytesWritten;
+    }
+
+    int GetBitsProcessed() const
+    {
+        return ( m_bytesWritten + m_cacheSize ) * 8;
+    }
+
+    int GetBitsRemaining() const
+    {
+        return GetTotalBits() - GetBitsProcessed();
+    }
+
+    int GetTotalBits() const
+    {
+        return m_totalBytes * 8;
+    }
+
+    int GetTotalBytes() const
+    {
+        return m_totalBytes;
+    }
+
+    bool IsOverflow() const
+    {
+        return m_overflow;
+    }
+
+    void SetContext( const void ** context )
+    {
+        m_context = context;
+    }
+
+    void SetCategory( int category )
+    {
+        m_state.SetCategory( category );
+    }
+
+    const void * GetContext( int index ) const
+    {
+        assert( index >= 0 );
+        assert( index < MaxContexts );
+        return m_context ? m_context[index] : nullptr;
+    }
+
+    void SetTrainer( EntropyTrainer * trainer )
+    {
+        m_trainer = trainer;
+    }
+
+    void Abort()
+    {
+        m_aborted = true;
+    }
+
+    bool Aborted() const
+    {
+        return m_aborted;
+    }
+
+private:
+
+    void EncodeField( uint32_t value, int bits )
+    {
+        // the top bits of the field are coded as a binary tree so each bit is predicted from the bits above it.
+        // anything below that is coded with one probability per bit position.
+
+        const uint32_t field = m_state.BeginField( bits );
+
+        const int tree_bits = min( bits, (int) EntropyTreeBits );
+
+        uint32_t node = 1;
+
+        for ( int i = bits - 1; i >= bits - tree_bits; --i )
+        {
+            const uint32_t bit = ( value >> i ) & 1;
+            EncodeBit( m_state.GetContext( field, node ), bit );
+            node = ( node << 1 ) | bit;
+        }
+
+        for ( int i = bits - tree_bits - 1; i >= 0; --i )
+        {
+            const uint32_t position = ( 1 << EntropyTreeBits ) + i;
+            EncodeBit( m_state.GetContext( field, position ), ( value >> i ) & 1 );
+        }
+    }
+
+    void EncodeBit( int context, uint32_t bit )
+    {
+        if ( m_trainer )
+            ( bit ? m_trainer->ones : m_trainer->zeros )[context]++;
+
+        uint16_t & probability = m_state.GetProbability( context );
+
+        const uint32_t bound = ( m_range >> EntropyProbabilityBits ) * probability;
+
+        if ( bit == 0 )
+        {
+            m_range = bound;
+            probability += ( EntropyProbabilityOne - probability ) >> EntropyAdaptShift;
+        }
+        else
+        {
+            m_low += bound;
+            m_range -= bound;
+            probability -= probability >> EntropyAdaptShift;
+        }
+
+        while ( m_range < EntropyTopValue )
+        {
+            m_range <<= 8;
+            ShiftLow();
+        }
+    }
+
+    void ShiftLow()
+    {
+        // carry propagation: bytes of 0xFF are held back until we know if a carry will ripple through them
+
+        if ( uint32_t( m_low ) < 0xFF000000U || ( m_low >> 32 ) != 0 )
+        {
+            const uint8_t carry = uint8_t( m_low >> 32 );
+            uint8_t temp = m_cache;
+            do
+            {
+                WriteByte( temp + carry );
+                temp = 0xFF;
+            }
+            while ( --m_cacheSize != 0 );
+            m_cache = uint8_t( m_low >> 24 );
+        }
+        m_cacheSize++;
+        m_low = ( m_low & 0x00FFFFFF ) << 8;
+    }
+
+    void WriteByte( uint8_t value )
+    {
+        if ( m_bytesWritten >= m_totalBytes )
+        {
+            m_overflow = true;
+            return;
+        }
+        m_data[m_bytesWritten++] = value;
+    }
+
+    uint8_t * m_data;
+    int m_totalBytes;
+    int m_bytesWritten;
+    uint64_t m_low;
+    uint32_t m_range;
+    uint8_t m_cache;
+    int m_cacheSize;
+    bool m_overflow;
+    EntropyTrainer * m_trainer;
+    EntropyContextState m_state;
+    const void ** m_context;
+    bool m_aborted;
+};
+
+class EntropyReadStream
+{
+public:
+
+    enum { IsWriting = 0 };
+    enum { IsReading = 1 };
+
+    EntropyReadStream( const uint8_t * buffer, int bytes, const EntropyModel & model ) 
+        : m_data( buffer ), m_totalBytes( bytes ), m_bytesRead( 0 ), m_code( 0 ), m_range( 0xFFFFFFFF ), m_overflow( false ), m_context( nullptr ), m_aborted( false )
+    {
+        m_state.Reset( model );
+        for ( int i = 0; i < 5; ++i )
+            m_code = ( m_code << 8 ) | ReadByte();
+    }
+
+    void SerializeInteger( int32_t & value, int32_t min, int32_t max )
+    {
+        assert( min < max );
+        const int bits = bits_required( min, max );
+        uint32_t unsigned_value = DecodeField( bits );
+        value = (int32_t) unsigned_value + min;
+    }
+
+    void SerializeBits( uint32_t & value, int bits )
+    {
+        assert( bits > 0 );
+        assert( bits <= 32 );
+        value = DecodeField( bits );
+    }
+
+    void SerializeBytes( uint8_t * data, int bytes )
+    {
+        for ( int i = 0; i < bytes; ++i )
+            data[i] = (uint8_t) DecodeField( 8 );
+    }
+
+    void Align()
+    {
+        // range coded input is not bit aligned
+    }
+
+    int GetAlignBits() const
+    {
+        return 0;
+    }
+
+    bool Check( uint32_t magic )
+    {
+        uint32_t value = 0;
+        SerializeBits( value, 32 );
+        assert( value == magic );
+        return value == magic;
+    }
+
+    int GetBitsProcessed() const
+    {
+        return m_bytesRead * 8;
+    }
+
+    int GetBytesProcessed() const
+    {
+        return m_bytesRead;
+    }
+
+    bool IsOverflow() const
+    {
+        return m_overflow;
+    }
+
+    void SetContext( const void ** context )
+    {
+        m_context = context;
+    }
+
+    void SetCategory( int category )
+    {
+        m_state.SetCategory( category );
+    }
+
+    const void * GetContext( int index ) const
+    {
+        assert( index >= 0 );
+        assert( index < MaxContexts );
+        return m_context ? m_context[index] : nullptr;
+    }
+
+    void Abort()
+    {
+        m_aborted = true;
+    }
+
+    bool Aborted() const
+    {
+        return m_aborted;
+    }
+
+private:
+
+    uint32_t DecodeField( int bits )
+    {
+        const uint32_t field = m_state.BeginField( bits );
+
+        const int tree_bits = min( bits, (int) EntropyTreeBits );
+
+        uint32_t node = 1;
+
+        for ( int i = 0; i < tree_bits; ++i )
+            node = ( node << 1 ) | DecodeBit( m_state.GetContext( field, node ) );
+
+        uint32_t value = node - ( 1 << tree_bits );
+
+        for ( int i = bits - tree_bits - 1; i >= 0; --i )
+            value = ( value << 1 ) | DecodeBit( m_state.GetContext( field, ( 1 << EntropyTreeBits ) + i ) );
+
+        return value;
+    }
+
+    uint32_t DecodeBit( int context )
+    {
+        uint16_t & probability = m_state.GetProbability( context );
+
+        const uint32_t bound = ( m_range >> EntropyProbabilityBits ) * probability;
+
+        uint32_t bit;
+
+        if ( m_code < bound )
+        {
+            m_range = bound;
+            probability += ( EntropyProbabilityOne - probability ) >> EntropyAdaptShift;
+            bit = 0;
+        }
+        else
+        {
+            m_code -= bound;
+            m_range -= bound;
+            probability -= probability >> EntropyAdaptShift;
+            bit = 1;
+        }
+
+        while ( m_range < EntropyTopValue )
+        {
+            m_range <<= 8;
+            m_code = ( m_code << 8 ) | ReadByte();
+        }
+
+        return bit;
+    }
+
+    uint8_t ReadByte()
+    {
+        if ( m_bytesRead >= m_totalBytes )
+        {
+            // reading past the end is only an error if we read more than the encoder's flush bytes
+            m_overflow = m_bytesRead > m_totalBytes + 4;
+            m_bytesRead++;
+            return 0;
+        }
+        return m_data[m_bytesRead++];
+    }
+
+    const uint8_t * m_data;
+    int m_totalBytes;
+    int m_bytesRead;
+    uint32_t m_code;
+    uint32_t m_range;
+    bool m_overflow;
+    EntropyContextState m_state;
     const void ** m_context;
     bool m_aborted;
 };
@@ -788,6 +1309,16 @@ template <typename T> void serialize_object( MeasureStream & stream, T & object
     object.SerializeMeasure( stream );
 }
 
+template <typename T> void serialize_object( EntropyReadStream & stream, T & object )
+{                        
+    object.SerializeEntropyRead( stream );
+}
+
+template <typename T> void serialize_object( EntropyWriteStream & stream, T & object )
+{                        
+    object.SerializeEntropyWrite( stream );
+}
+
 #define serialize_int( stream, value, min, max )            \
     do                                                      \
     {                                                       \
@@ -823,6 +1354,8 @@ template <typename T> void serialize_object( MeasureStream & stream, T & object
 
 #define serialize_bool( stream, value ) serialize_bits( stream, value, 1 )
 
+#define serialize_category( stream, category ) stream.SetCategory( category )
+
 template <typename Stream> void serialize_uint16( Stream & stream, uint16_t & value )
 {
     serialize_bits( stream, value, 16 );
@@ -971,10 +1504,12 @@ inline int unsigned_to_signed( uint32_t n )
     return ( n >> 1 ) ^ ( -( n & 1 ) );
 }
 
-#define SERIALIZE_OBJECT( stream )                                                          \
-    void SerializeRead( class ReadStream & stream ) { Serialize( stream ); };               \
-    void SerializeWrite( class WriteStream & stream ) { Serialize( stream ); };             \
-    void SerializeMeasure( class MeasureStream & stream ) { Serialize( stream ); };         \
-    template <typename Stream> void Serialize( Stream & stream )                            
+#define SERIALIZE_OBJECT( stream )                                                               \
+    void SerializeRead( class ReadStream & stream ) { Serialize( stream ); };                    \
+    void SerializeWrite( class WriteStream & stream ) { Serialize( stream ); };                  \
+    void SerializeMeasure( class MeasureStream & stream ) { Serialize( stream ); };              \
+    void SerializeEntropyRead( class EntropyReadStream & stream ) { Serialize( stream ); };      \
+    void SerializeEntropyWrite( class EntropyWriteStream & stream ) { Serialize( stream ); };    \
+    template <typename Stream> void Serialize( Stream & stream )                                 
 
 #endif // #ifndef PROTOCOL_H
@@ -1,6 +1,10 @@
 #include "render.h"
 #include "world.h"
+#include "shadow.h"
+#include "cull.h"
+#include "jobs.h"
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
@@ -57,18 +61,12 @@ void render_get_state( const World & world, RenderState & render_state )
 
         CubeEntity & cube_entity = world.cube_manager->cubes[i];
 
-        mat4f translation = mat4f::translation( cube_entity.position );
-        mat4f rotation = mat4f::rotation( cube_entity.orientation );
-        mat4f scale = mat4f::scale( cube_entity.scale * 0.5f );
-
-        mat4f inv_translation = mat4f::translation( -cube_entity.position );
-        mat4f inv_rotation = transpose( rotation );
-        mat4f inv_scale = mat4f::scale( 1.0f / ( cube_entity.scale * 0.5f ) );
-
         RenderCube & render_cube = render_state.cube[render_state.num_cubes];
 
-        render_cube.transform = translation * rotation * scale;
-        render_cube.inverse_transform = inv_rotation * inv_translation * inv_scale;
+        render_cube.id = i;
+        render_cube.position = cube_entity.position;
+        render_cube.orientation = cube_entity.orientation;
+        render_cube.scale = cube_entity.scale * 0.5f;
 
         int authority = world.entity_manager->GetAuthority( cube_entity.entity_index );
         
@@ -80,6 +78,53 @@ void render_get_state( const World & world, RenderState & render_state )
     }
 }
 
+void render_interpolate_state( const RenderState & previous, const RenderState & current, float t, RenderState & render_state )
+{
+    // blend each cube in the current state with the same cube in the previous state. cubes that were only
+    // just created are drawn where they are now. both states are sorted by id so this is a single merge pass.
+
+    assert( t >= 0.0f );
+    assert( t <= 1.0f );
+
+    render_state.num_cubes = current.num_cubes;
+
+    int j = 0;
+
+    for ( int i = 0; i < current.num_cubes; ++i )
+    {
+        const RenderCube & current_cube = current.cube[i];
+
+        RenderCube & cube = render_state.cube[i];
+
+        cube = current_cube;
+
+        while ( j < previous.num_cubes && previous.cube[j].id < current_cube.id )
+            j++;
+
+        if ( j == previous.num_cubes || previous.cube[j].id != current_cube.id )
+            continue;
+
+        const RenderCube & previous_cube = previous.cube[j];
+
+        cube.r = previous_cube.r + ( current_cube.r - previous_cube.r ) * t;
+        cube.g = previous_cube.g + ( current_cube.g - previous_cube.g ) * t;
+        cube.b = previous_cube.b + ( current_cube.b - previous_cube.b ) * t;
+        cube.a = previous_cube.a + ( current_cube.a - previous_cube.a ) * t;
+        cube.position = previous_cube.position + ( current_cube.position - previous_cube.position ) * t;
+        cube.orientation = nlerp( t, previous_cube.orientation, current_cube.orientation );
+        cube.scale = previous_cube.scale + ( current_cube.scale - previous_cube.scale ) * t;
+    }
+}
+
+struct RenderFrameUniforms
+{
+    // matches the FrameUniforms block in the shaders, std140 layout
+
+    float view_projection[16];
+    float eye_position[4];
+    float light_position[4];
+};
+
 struct CubeVertex
 {
     float x,y,z;
@@ -151,27 +196,68 @@ Render::Render()
     initialized = false;    
     display_width = 0;
     display_height = 0;
-    cubes_vao = 0;
     cubes_vbo = 0;
     cubes_ibo = 0;
     cubes_instance_buffer = 0;
+    cubes_instance_memory = nullptr;
+    cubes_instance_region = 0;
+    for ( int i = 0; i < RenderInstanceBufferRegions; ++i )
+    {
+        cubes_vao[i] = 0;
+        cubes_instance_fence[i] = nullptr;
+    }
     shadow_vao = 0;
     shadow_vbo = 0;
     mask_vao = 0;
     mask_vbo = 0;
+    profile_vao = 0;
+    profile_vbo = 0;
+    memset( gpu_timer_queries, 0, sizeof( gpu_timer_queries ) );
+    memset( gpu_timer_issued, 0, sizeof( gpu_timer_issued ) );
+    gpu_timer_frame = 0;
     shadow_shader = 0;
     cubes_shader = 0;
     debug_shader = 0;
+    jobs = nullptr;
+    frame_uniform_buffer = 0;
+    frame_uniforms_dirty = true;
+    culled_render_state = nullptr;
+    memset( num_job_visible_cubes, 0, sizeof( num_job_visible_cubes ) );
+    memset( num_job_shadow_casters, 0, sizeof( num_job_shadow_casters ) );
+    memset( num_shadow_vertices, 0, sizeof( num_shadow_vertices ) );
 }
 
 Render::~Render()
 {
-    glDeleteVertexArrays( 1, &cubes_vao );
+    if ( jobs )
+    {
+        job_system_free( *jobs );
+        delete jobs;
+        jobs = nullptr;
+    }
+
+    for ( int i = 0; i < RenderInstanceBufferRegions; ++i )
+    {
+        if ( cubes_instance_fence[i] )
+            glDeleteSync( (GLsync) cubes_instance_fence[i] );
+        cubes_instance_fence[i] = nullptr;
+    }
+
+    if ( cubes_instance_memory )
+    {
+        glBindBuffer( GL_ARRAY_BUFFER, cubes_instance_buffer );
+        glUnmapBuffer( GL_ARRAY_BUFFER );
+        glBindBuffer( GL_ARRAY_BUFFER, 0 );
+        cubes_instance_memory = nullptr;
+    }
+
+    glDeleteVertexArrays( RenderInstanceBufferRegions, cubes_vao );
     glDeleteBuffers( 1, &cubes_vbo );
     glDeleteBuffers( 1, &cubes_ibo );
     glDeleteBuffers( 1, &cubes_instance_buffer );
 
-    cubes_vao = 0;
+    for ( int i = 0; i < RenderInstanceBufferRegions; ++i )
+        cubes_vao[i] = 0;
     cubes_vbo = 0;
     cubes_ibo = 0;
     cubes_instance_buffer = 0;
@@ -187,12 +273,29 @@ Render::~Render()
 
     mask_vao = 0;
     mask_vbo = 0;
+
+    glDeleteBuffers( 1, &frame_uniform_buffer );
+
+    frame_uniform_buffer = 0;
+
+    glDeleteVertexArrays( 1, &profile_vao );
+    glDeleteBuffers( 1, &profile_vbo );
+
+    profile_vao = 0;
+    profile_vbo = 0;
+
+    glDeleteQueries( ProfileGpuTimerFrames * NUM_PROFILE_PHASES, &gpu_timer_queries[0][0] );
+
+    memset( gpu_timer_queries, 0, sizeof( gpu_timer_queries ) );
 }
 
 void Render::Initialize()
 {
     assert( !initialized );
 
+    jobs = new JobSystem();
+    job_system_init( *jobs, RenderJobThreads );
+
     check_opengl_error( "before load shaders" );
 
     cubes_shader = load_shader( "shaders/cubes.vert", "shaders/cubes.frag" );
@@ -211,6 +314,28 @@ void Render::Initialize()
     if ( !cubes_shader )
         return;
 
+    // camera and light go in one uniform buffer, updated once per-frame and shared by the cubes and shadow shaders
+
+    {
+        glGenBuffers( 1, &frame_uniform_buffer );
+        glBindBuffer( GL_UNIFORM_BUFFER, frame_uniform_buffer );
+        glBufferData( GL_UNIFORM_BUFFER, sizeof( RenderFrameUniforms ), nullptr, GL_DYNAMIC_DRAW );
+        glBindBuffer( GL_UNIFORM_BUFFER, 0 );
+
+        glBindBufferBase( GL_UNIFORM_BUFFER, RenderFrameUniformsBinding, frame_uniform_buffer );
+
+        const uint32_t frame_shaders[] = { cubes_shader, shadow_shader };
+
+        for ( int i = 0; i < (int) ( sizeof( frame_shaders ) / sizeof( frame_shaders[0] ) ); ++i )
+        {
+            const uint32_t block_index = glGetUniformBlockIndex( frame_shaders[i], "FrameUniforms" );
+            if ( block_index != GL_INVALID_INDEX )
+                glUniformBlockBinding( frame_shaders[i], block_index, RenderFrameUniformsBinding );
+        }
+    }
+
+    check_opengl_error( "after frame uniforms setup" );
+
     // setup cubes draw call
     {
         glUseProgram( cubes_shader );
@@ -218,9 +343,9 @@ void Render::Initialize()
         const int position_location = glGetAttribLocation( cubes_shader, "VertexPosition" );
         const int normal_location = glGetAttribLocation( cubes_shader, "VertexNormal" );
         const int color_location = glGetAttribLocation( cubes_shader, "VertexColor" );
-        const int model_location = glGetAttribLocation( cubes_shader, "Model" );
-        const int model_view_location = glGetAttribLocation( cubes_shader, "ModelView" );
-        const int model_view_projection_location = glGetAttribLocation( cubes_shader, "ModelViewProjection" );
+        const int instance_position_location = glGetAttribLocation( cubes_shader, "InstancePosition" );
+        const int instance_orientation_location = glGetAttribLocation( cubes_shader, "InstanceOrientation" );
+        const int instance_scale_location = glGetAttribLocation( cubes_shader, "InstanceScale" );
 
         glGenBuffers( 1, &cubes_vbo );
         glBindBuffer( GL_ARRAY_BUFFER, cubes_vbo );
@@ -232,64 +357,83 @@ void Render::Initialize()
         glBufferData( GL_ELEMENT_ARRAY_BUFFER, sizeof( cube_indices ), cube_indices, GL_STATIC_DRAW );
         glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, 0 );
 
-        glGenBuffers( 1, &cubes_instance_buffer );
-
-        glGenVertexArrays( 1, &cubes_vao );
-
-        glBindVertexArray( cubes_vao );
+        // the instance buffer is a ring of regions, each big enough for every cube. it is allocated once, and mapped
+        // persistently where buffer storage is supported, so nothing is reallocated or orphaned per-frame.
 
-        glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, cubes_ibo );
-
-        glBindBuffer( GL_ARRAY_BUFFER, cubes_vbo );
+        const int instance_buffer_size = sizeof( RenderCubeInstance ) * MaxCubes * RenderInstanceBufferRegions;
 
-        if ( position_location >= 0 )
+        glGenBuffers( 1, &cubes_instance_buffer );
+        glBindBuffer( GL_ARRAY_BUFFER, cubes_instance_buffer );
+        if ( GLEW_ARB_buffer_storage )
         {
-            glEnableVertexAttribArray( position_location );
-            glVertexAttribPointer( position_location, 3, GL_FLOAT, GL_FALSE, sizeof(CubeVertex), (GLubyte*)0 );
+            const GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+            glBufferStorage( GL_ARRAY_BUFFER, instance_buffer_size, nullptr, flags );
+            cubes_instance_memory = (uint8_t*) glMapBufferRange( GL_ARRAY_BUFFER, 0, instance_buffer_size, flags );
         }
-
-        if ( normal_location >= 0 )
+        else
         {
-            glEnableVertexAttribArray( normal_location );
-            glVertexAttribPointer( normal_location, 3, GL_FLOAT, GL_FALSE, sizeof(CubeVertex), (GLubyte*)(3*4) );
+            glBufferData( GL_ARRAY_BUFFER, instance_buffer_size, nullptr, GL_STREAM_DRAW );
         }
+        glBindBuffer( GL_ARRAY_BUFFER, 0 );
 
-        glBindBuffer( GL_ARRAY_BUFFER, cubes_instance_buffer );
+        glGenVertexArrays( RenderInstanceBufferRegions, cubes_vao );
 
-        if ( color_location >= 0 )
+        for ( int region = 0; region < RenderInstanceBufferRegions; ++region )
         {
-            glEnableVertexAttribArray( color_location );
-            glVertexAttribPointer( color_location, 4, GL_FLOAT, GL_FALSE, sizeof( RenderCubeInstance ), (void*) ( offsetof( RenderCubeInstance, r ) ) );
-            glVertexAttribDivisor( color_location, 1 );
-        }
+            const size_t region_offset = sizeof( RenderCubeInstance ) * MaxCubes * region;
 
-        for ( unsigned int i = 0; i < 4 ; ++i )
-        {
-            if ( model_location >= 0 )
+            glBindVertexArray( cubes_vao[region] );
+
+            glBindBuffer( GL_ELEMENT_ARRAY_BUFFER, cubes_ibo );
+
+            glBindBuffer( GL_ARRAY_BUFFER, cubes_vbo );
+
+            if ( position_location >= 0 )
             {
-                glEnableVertexAttribArray( model_location + i );
-                glVertexAttribPointer( model_location + i, 4, GL_FLOAT, GL_FALSE, sizeof( RenderCubeInstance ), (void*) ( offsetof( RenderCubeInstance, model ) + ( sizeof(float) * 4 * i ) ) );
-                glVertexAttribDivisor( model_location + i, 1 );
+                glEnableVertexAttribArray( position_location );
+                glVertexAttribPointer( position_location, 3, GL_FLOAT, GL_FALSE, sizeof(CubeVertex), (GLubyte*)0 );
             }
 
-            if ( model_view_location >= 0 )
+            if ( normal_location >= 0 )
             {
-                glEnableVertexAttribArray( model_view_location + i );
-                glVertexAttribPointer( model_view_location + i, 4, GL_FLOAT, GL_FALSE, sizeof( RenderCubeInstance ), (void*) ( offsetof( RenderCubeInstance, model_view ) + ( sizeof(float) * 4 * i ) ) );
-                glVertexAttribDivisor( model_view_location + i, 1 );
+                glEnableVertexAttribArray( normal_location );
+                glVertexAttribPointer( normal_location, 3, GL_FLOAT, GL_FALSE, sizeof(CubeVertex), (GLubyte*)(3*4) );
             }
 
-            if ( model_view_projection_location >= 0 )
+            glBindBuffer( GL_ARRAY_BUFFER, cubes_instance_buffer );
+
+            if ( color_location >= 0 )
             {
-                glEnableVertexAttribArray( model_view_projection_location + i );
-                glVertexAttribPointer( model_view_projection_location + i, 4, GL_FLOAT, GL_FALSE, sizeof( RenderCubeInstance ), (void*) ( offsetof( RenderCubeInstance, model_view_projection ) + ( sizeof(float) * 4 * i ) ) );
-                glVertexAttribDivisor( model_view_projection_location + i, 1 );
+                glEnableVertexAttribArray( color_location );
+                glVertexAttribPointer( color_location, 4, GL_UNSIGNED_BYTE, GL_TRUE, sizeof( RenderCubeInstance ), (void*) ( region_offset + offsetof( RenderCubeInstance, color ) ) );
+                glVertexAttribDivisor( color_location, 1 );
             }
-        }
 
-        glBindBuffer( GL_ARRAY_BUFFER, 0 );
+            if ( instance_position_location >= 0 )
+            {
+                glEnableVertexAttribArray( instance_position_location );
+                glVertexAttribPointer( instance_position_location, 3, GL_FLOAT, GL_FALSE, sizeof( RenderCubeInstance ), (void*) ( region_offset + offsetof( RenderCubeInstance, position ) ) );
+                glVertexAttribDivisor( instance_position_location, 1 );
+            }
 
-        glBindVertexArray( 0 );
+            if ( instance_orientation_location >= 0 )
+            {
+                glEnableVertexAttribArray( instance_orientation_location );
+                glVertexAttribPointer( instance_orientation_location, 4, GL_FLOAT, GL_FALSE, sizeof( RenderCubeInstance ), (void*) ( region_offset + offsetof( RenderCubeInstance, orientation ) ) );
+                glVertexAttribDivisor( instance_orientation_location, 1 );
+            }
+
+            if ( instance_scale_location >= 0 )
+            {
+                glEnableVertexAttribArray( instance_scale_location );
+                glVertexAttribPointer( instance_scale_location, 1, GL_FLOAT, GL_FALSE, sizeof( RenderCubeInstance ), (void*) ( region_offset + offsetof( RenderCubeInstance, scale ) ) );
+                glVertexAttribDivisor( instance_scale_location, 1 );
+            }
+
+            glBindBuffer( GL_ARRAY_BUFFER, 0 );
+
+            glBindVertexArray( 0 );
+        }
 
         glUseProgram( 0 );
     }
@@ -371,16 +515,64 @@ void Render::Initialize()
 
         glBindVertexArray( 0 );
 
+        // the mask is a full screen quad, so its transform never changes
+
+        const int model_view_projection_location = glGetUniformLocation( debug_shader, "ModelViewProjection" );
+        if ( model_view_projection_location >= 0 )
+        {
+            float values[16];
+            mat4f::ortho( 0.0f, 1.0f, 1.0f, 0.0f, -1.0f, 1.0f ).store( values );
+            glUniformMatrix4fv( model_view_projection_location, 1, GL_FALSE, values );
+        }
+
         glUseProgram( 0 );
     }
 
     check_opengl_error( "after shadow mask render init" );
+
+    // setup profile overlay draw call. vertices are streamed each frame
+
+    {
+        const int position_location = glGetAttribLocation( debug_shader, "VertexPosition" );
+        const int color_location = glGetAttribLocation( debug_shader, "VertexColor" );
+
+        glGenBuffers( 1, &profile_vbo );
+
+        glGenVertexArrays( 1, &profile_vao );
+
+        glBindVertexArray( profile_vao );
+
+        glBindBuffer( GL_ARRAY_BUFFER, profile_vbo );
+
+        if ( position_location >= 0 )
+        {
+            glEnableVertexAttribArray( position_location );
+            glVertexAttribPointer( position_location, 3, GL_FLOAT, GL_FALSE, sizeof(DebugVertex), (GLubyte*)0 );
+        }
+
+        if ( color_location >= 0 )
+        {
+            glEnableVertexAttribArray( color_location );
+            glVertexAttribPointer( color_location, 4, GL_FLOAT, GL_FALSE, sizeof(DebugVertex), (GLubyte*) ( 3 * 4 ) );
+        }
+
+        glBindBuffer( GL_ARRAY_BUFFER, 0 );
+
+        glBindVertexArray( 0 );
+    }
+
+    glGenQueries( ProfileGpuTimerFrames * NUM_PROFILE_PHASES, &gpu_timer_queries[0][0] );
+
+    check_opengl_error( "after profile init" );
     
     initialized = true;
 }
 
 void Render::ResizeDisplay( int _display_width, int _display_height )
 {
+    if ( _display_width != display_width || _display_height != display_height )
+        frame_uniforms_dirty = true;
+
     display_width = _display_width;
     display_height = _display_height;
 }
@@ -388,6 +580,7 @@ void Render::ResizeDisplay( int _display_width, int _display_height )
 void Render::SetLightPosition( const vec3f & _light_position )
 {
     light_position = _light_position;
+    frame_uniforms_dirty = true;
 }
 
 void Render::SetCamera( const vec3f & position, const vec3f & lookat, const vec3f & up )
@@ -395,6 +588,7 @@ void Render::SetCamera( const vec3f & position, const vec3f & lookat, const vec3
     camera_position = position;
     camera_lookat = lookat;
     camera_up = up;
+    frame_uniforms_dirty = true;
 }
 
 void Render::ClearScreen()
@@ -423,184 +617,324 @@ void Render::BeginScene( float x1, float y1, float x2, float y2 )
 
     glEnable( GL_DEPTH_TEST );
     glDepthFunc( GL_LESS );
+
+    // read back the oldest set of gpu timers, then reuse those queries for this frame
+
+    gpu_timer_frame = ( gpu_timer_frame + 1 ) % ProfileGpuTimerFrames;
+
+    // phases that weren't drawn that frame get zero. a result that isn't ready yet is marked as unavailable,
+    // rather than showing whatever that phase measured the last time it was read back
+
+    for ( int i = 0; i < NUM_PROFILE_PHASES; ++i )
+    {
+        if ( !gpu_timer_issued[gpu_timer_frame][i] )
+        {
+            stats.gpu_time[i] = 0.0f;
+            continue;
+        }
+
+        gpu_timer_issued[gpu_timer_frame][i] = false;
+
+        GLint available = 0;
+        glGetQueryObjectiv( gpu_timer_queries[gpu_timer_frame][i], GL_QUERY_RESULT_AVAILABLE, &available );
+        if ( !available )
+        {
+            stats.gpu_time[i] = ProfileGpuTimeUnavailable;
+            continue;
+        }
+
+        GLuint64 elapsed = 0;
+        glGetQueryObjectui64v( gpu_timer_queries[gpu_timer_frame][i], GL_QUERY_RESULT, &elapsed );
+        stats.gpu_time[i] = float( elapsed / 1000000000.0 );
+    }
+}
+
+void Render::BeginGpuTimer( ProfilePhase phase )
+{
+    // only one time elapsed query can be active at a time, so gpu timers don't nest
+
+    glBeginQuery( GL_TIME_ELAPSED, gpu_timer_queries[gpu_timer_frame][phase] );
+    gpu_timer_issued[gpu_timer_frame][phase] = true;
+}
+
+void Render::EndGpuTimer()
+{
+    glEndQuery( GL_TIME_ELAPSED );
 }
         
+void Render::UpdateFrameUniforms()
+{
+    if ( !frame_uniforms_dirty )
+        return;
+
+    mat4f view_matrix = mat4f::lookAt( camera_position, camera_lookat, camera_up );
+
+    mat4f projection_matrix = mat4f::perspective( 40.0f, display_width / (float)display_height, 0.1f, 100.0f );
+
+    view_projection = projection_matrix * view_matrix;
+
+    RenderFrameUniforms uniforms;
+    view_projection.store( uniforms.view_projection );
+    camera_position.store( uniforms.eye_position );
+    light_position.store( uniforms.light_position );
+    uniforms.eye_position[3] = 1.0f;
+    uniforms.light_position[3] = 1.0f;
+
+    glBindBuffer( GL_UNIFORM_BUFFER, frame_uniform_buffer );
+    glBufferSubData( GL_UNIFORM_BUFFER, 0, sizeof( RenderFrameUniforms ), &uniforms );
+    glBindBuffer( GL_UNIFORM_BUFFER, 0 );
+
+    frame_uniforms_dirty = false;
+}
+
+inline int render_job_count( const RenderState & render_state )
+{
+    return ( render_state.num_cubes + RenderJobCubes - 1 ) / RenderJobCubes;
+}
+
+struct RenderCullJobs
+{
+    const RenderState * render_state;
+    RenderFrustum frustum;
+    vec3f light_position;
+    int * visible_cubes;
+    int * shadow_casters;
+    int * num_visible_cubes;
+    int * num_shadow_casters;
+};
+
+void render_cull_job( void * context, int index )
+{
+    RenderCullJobs & cull_jobs = *(RenderCullJobs*)context;
+
+    const RenderState & render_state = *cull_jobs.render_state;
+
+    const int first_cube = index * RenderJobCubes;
+    const int num_cubes = min( RenderJobCubes, render_state.num_cubes - first_cube );
+
+    render_cull_cubes( render_state.cube, first_cube, num_cubes, cull_jobs.frustum, cull_jobs.light_position,
+                       cull_jobs.visible_cubes + first_cube, cull_jobs.num_visible_cubes[index],
+                       cull_jobs.shadow_casters + first_cube, cull_jobs.num_shadow_casters[index] );
+}
+
+void Render::CullScene( const RenderState & render_state )
+{
+    // call after the camera and light are set for the frame, and before RenderScene and RenderShadows
+
+    UpdateFrameUniforms();
+
+    const int num_jobs = render_job_count( render_state );
+
+    RenderCullJobs cull_jobs;
+    cull_jobs.render_state = &render_state;
+    render_frustum_from_view_projection( view_projection, cull_jobs.frustum );
+    cull_jobs.light_position = light_position;
+    cull_jobs.visible_cubes = visible_cubes;
+    cull_jobs.shadow_casters = shadow_casters;
+    cull_jobs.num_visible_cubes = num_job_visible_cubes;
+    cull_jobs.num_shadow_casters = num_job_shadow_casters;
+
+    job_system_run( *jobs, render_cull_job, &cull_jobs, num_jobs );
+
+    stats.num_cubes = render_state.num_cubes;
+    stats.num_visible_cubes = 0;
+    stats.num_shadow_casters = 0;
+    stats.num_shadow_vertices = 0;
+    stats.instance_time = 0.0f;
+    stats.silhouette_time = 0.0f;
+
+    for ( int i = 0; i < num_jobs; ++i )
+    {
+        stats.num_visible_cubes += num_job_visible_cubes[i];
+        stats.num_shadow_casters += num_job_shadow_casters[i];
+    }
+
+    culled_render_state = &render_state;
+}
+
+struct RenderInstanceJobs
+{
+    const RenderState * render_state;
+    const int * visible_cubes;
+    const int * num_visible_cubes;
+    RenderCubeInstance * instances;
+};
+
+void render_write_instances_job( void * context, int index )
+{
+    // visible cubes from each job's range are packed one after another in the instance buffer
+
+    RenderInstanceJobs & instance_jobs = *(RenderInstanceJobs*)context;
+
+    const RenderState & render_state = *instance_jobs.render_state;
+
+    int first_instance = 0;
+    for ( int i = 0; i < index; ++i )
+        first_instance += instance_jobs.num_visible_cubes[i];
+
+    const int * visible_cubes = instance_jobs.visible_cubes + index * RenderJobCubes;
+
+    for ( int i = 0; i < instance_jobs.num_visible_cubes[index]; ++i )
+    {
+        const RenderCube & cube = render_state.cube[visible_cubes[i]];
+        RenderCubeInstance & instance = instance_jobs.instances[first_instance + i];
+        cube.position.store( instance.position );
+        cube.orientation.store( instance.orientation );
+        instance.scale = cube.scale;
+        instance.color[0] = uint8_t( cube.r * 255.0f + 0.5f );
+        instance.color[1] = uint8_t( cube.g * 255.0f + 0.5f );
+        instance.color[2] = uint8_t( cube.b * 255.0f + 0.5f );
+        instance.color[3] = uint8_t( cube.a * 255.0f + 0.5f );
+    }
+}
+
 void Render::RenderScene( const RenderState & render_state )
 {
-    if ( render_state.num_cubes == 0 )
+    assert( culled_render_state == &render_state );
+
+    if ( stats.num_visible_cubes == 0 )
         return;
 
+    BeginGpuTimer( PROFILE_RENDER_SCENE );
+
     glUseProgram( cubes_shader );
 
-    const int eye_location = glGetUniformLocation( cubes_shader, "EyePosition" );
-    const int light_location = glGetUniformLocation( cubes_shader, "LightPosition" );
+    UpdateFrameUniforms();
+
+    // wait for the gpu to finish with the last draw from this region. with three regions in flight it normally already has.
+
+    const int region = cubes_instance_region;
 
-    if ( eye_location >= 0 )
+    cubes_instance_region = ( cubes_instance_region + 1 ) % RenderInstanceBufferRegions;
+
+    if ( cubes_instance_fence[region] )
     {
-        float data[3];
-        camera_position.store( data );
-        glUniform3fv( eye_location, 1, data );
+        GLsync fence = (GLsync) cubes_instance_fence[region];
+        while ( glClientWaitSync( fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000 ) == GL_TIMEOUT_EXPIRED );
+        glDeleteSync( fence );
+        cubes_instance_fence[region] = nullptr;
     }
 
-    if ( light_location >= 0 )
+    // write instance data straight into the region. the memory is write combined, so only write to it, never read back.
+    // instances are built here rather than in render_get_state, because render_get_state runs on the simulation thread
+    // and must not touch gl memory. the render thread also interpolates between simulation frames and culls before this.
+
+    const size_t region_offset = sizeof( RenderCubeInstance ) * MaxCubes * region;
+
+    RenderCubeInstance * instances = nullptr;
+
+    if ( cubes_instance_memory )
     {
-        float data[3];
-        light_position.store( data );
-        glUniform3fv( light_location, 1, data );
+        instances = (RenderCubeInstance*) ( cubes_instance_memory + region_offset );
+    }
+    else
+    {
+        glBindBuffer( GL_ARRAY_BUFFER, cubes_instance_buffer );
+        instances = (RenderCubeInstance*) glMapBufferRange( GL_ARRAY_BUFFER, region_offset, sizeof( RenderCubeInstance ) * stats.num_visible_cubes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT );
     }
 
-    mat4f view_matrix = mat4f::lookAt( camera_position, camera_lookat, camera_up );
-
-    mat4f projection_matrix = mat4f::perspective( 40.0f, display_width / (float)display_height, 0.1f, 100.0f );
+    if ( instances )
+    {
+        RenderInstanceJobs instance_jobs;
+        instance_jobs.render_state = &render_state;
+        instance_jobs.visible_cubes = visible_cubes;
+        instance_jobs.num_visible_cubes = num_job_visible_cubes;
+        instance_jobs.instances = instances;
+        const double start_time = platform_time();
+        job_system_run( *jobs, render_write_instances_job, &instance_jobs, render_job_count( render_state ) );
+        stats.instance_time = float( platform_time() - start_time );
+    }
 
-    for ( int i = 0; i < render_state.num_cubes; ++i )
+    if ( !cubes_instance_memory )
     {
-        RenderCubeInstance & instance = instance_data[i];
-        instance.r = render_state.cube[i].r;
-        instance.g = render_state.cube[i].g;
-        instance.b = render_state.cube[i].b;
-        instance.a = render_state.cube[i].a;
-        instance.model = render_state.cube[i].transform;
-        instance.model_view = view_matrix * instance.model;
-        instance.model_view_projection = projection_matrix * instance.model_view;
+        if ( instances )
+            glUnmapBuffer( GL_ARRAY_BUFFER );
+        glBindBuffer( GL_ARRAY_BUFFER, 0 );
     }
 
-    glBindBuffer( GL_ARRAY_BUFFER, cubes_instance_buffer );
-    glBufferData( GL_ARRAY_BUFFER, sizeof(RenderCubeInstance) * render_state.num_cubes, instance_data, GL_STREAM_DRAW );
-    glBindBuffer( GL_ARRAY_BUFFER, 0 );
+    if ( instances )
+    {
+        glBindVertexArray( cubes_vao[region] );
 
-    glBindVertexArray( cubes_vao );
+        glDrawElementsInstanced( GL_TRIANGLES, sizeof( cube_indices ) / 2, GL_UNSIGNED_SHORT, nullptr, stats.num_visible_cubes );
 
-    glDrawElementsInstanced( GL_TRIANGLES, sizeof( cube_indices ) / 2, GL_UNSIGNED_SHORT, nullptr, render_state.num_cubes );
+        glBindVertexArray( 0 );
 
-    glBindVertexArray( 0 );
+        cubes_instance_fence[region] = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
+    }
 
     glUseProgram( 0 );
 
+    EndGpuTimer();
+
     check_opengl_error( "after render scene" );
 }
 
-inline void GenerateSilhoutteVerts( int & vertex_index,
-                                    __restrict vec3f * vertices,
-                                    const mat4f & transform,
-                                    const vec3f & local_light,
-                                    const vec3f & world_light,
-                                    vec3f a, 
-                                    vec3f b,
-                                    const vec3f & left_normal,
-                                    const vec3f & right_normal,
-                                    bool left_dot,
-                                    bool right_dot )
+struct RenderShadowJobs
 {
-    // check if silhouette edge
-    if ( left_dot ^ right_dot )
-    {
-        // ensure correct winding order for silhouette edge
+    const RenderState * render_state;
+    const int * shadow_casters;
+    const int * num_shadow_casters;
+    vec3f light_position;
+    vec3f * vertices;
+    int * num_vertices;
+};
 
-        if ( dot( cross( b - a, local_light ), a ) < 0 )
-        {
-            vec3f tmp = a;
-            a = b;
-            b = tmp;
-        }
-        
-        // transform into world space
-        
-        vec3f world_a = transformPoint( transform, a );
-        vec3f world_b = transformPoint( transform, b );
-        
-        // extrude to ground plane z=0 in world space
-        
-        vec3f difference_a = world_a - world_light;
-        vec3f difference_b = world_b - world_light;
-        
-        const float at = world_light.z() / difference_a.z();
-        const float bt = world_light.z() / difference_b.z();
-        
-        vec3f extruded_a = world_light - difference_a * at;
-        vec3f extruded_b = world_light - difference_b * bt;
-        
-        // emit extruded quad as two triangles
-        
-        vertices[vertex_index]   = world_b;
-        vertices[vertex_index+1] = world_a;
-        vertices[vertex_index+2] = extruded_a;
-        vertices[vertex_index+3] = world_b;
-        vertices[vertex_index+4] = extruded_a;
-        vertices[vertex_index+5] = extruded_b;
-        
-        vertex_index += 6;
-    }
-}
+void render_generate_shadows_job( void * context, int index )
+{
+    // each job writes silhouettes for its range of cubes to its own slice of the vertex array
 
-static vec3f a(-1,+1,-1);
-static vec3f b(+1,+1,-1);
-static vec3f c(+1,+1,+1);
-static vec3f d(-1,+1,+1);
-static vec3f e(-1,-1,-1);
-static vec3f f(+1,-1,-1);
-static vec3f g(+1,-1,+1);
-static vec3f h(-1,-1,+1);
+    RenderShadowJobs & shadow_jobs = *(RenderShadowJobs*)context;
 
-static vec3f normals[6] =
-{
-    vec3f(+1,0,0),
-    vec3f(-1,0,0),
-    vec3f(0,+1,0),
-    vec3f(0,-1,0),
-    vec3f(0,0,+1),
-    vec3f(0,0,-1)
-};
+    const RenderState & render_state = *shadow_jobs.render_state;
+
+    const int max_vertices = RenderJobCubes * MaxShadowVerticesPerCube;
+
+    shadow_jobs.num_vertices[index] = generate_shadow_vertices( render_state.cube, shadow_jobs.shadow_casters + index * RenderJobCubes, shadow_jobs.num_shadow_casters[index], shadow_jobs.light_position, shadow_jobs.vertices + index * max_vertices, max_vertices );
+}
 
 void Render::RenderShadows( const RenderState & render_state )
 {
-    // generate shadow silhoutte vertices
+    assert( culled_render_state == &render_state );
 
-    vec3f world_light = light_position;
-    
-    int vertex_index = 0;
-    
-    for ( int i = 0; i < (int) render_state.num_cubes; ++i )
-    {
-        const RenderCube & cube = render_state.cube[i];
+    // generate shadow silhouette vertices
 
-        if ( cube.a < ShadowAlphaThreshold )
-            continue;
+    const int num_jobs = render_job_count( render_state );
 
-        vec3f local_light = transformPoint( cube.inverse_transform, world_light );
-        
-        bool dot[6];
-        dot[0] = vectorial::dot( normals[0], local_light ) > 0;
-        dot[1] = vectorial::dot( normals[1], local_light ) > 0;
-        dot[2] = vectorial::dot( normals[2], local_light ) > 0;
-        dot[3] = vectorial::dot( normals[3], local_light ) > 0;
-        dot[4] = vectorial::dot( normals[4], local_light ) > 0;
-        dot[5] = vectorial::dot( normals[5], local_light ) > 0;
-        
-        assert( vertex_index < MaxCubeShadowVertices );
+    RenderShadowJobs shadow_jobs;
+    shadow_jobs.render_state = &render_state;
+    shadow_jobs.shadow_casters = shadow_casters;
+    shadow_jobs.num_shadow_casters = num_job_shadow_casters;
+    shadow_jobs.light_position = light_position;
+    shadow_jobs.vertices = shadow_vertices;
+    shadow_jobs.num_vertices = num_shadow_vertices;
 
-        GenerateSilhoutteVerts( vertex_index, shadow_vertices, cube.transform, local_light, world_light, a, b, normals[5], normals[2], dot[5], dot[2] );
-        GenerateSilhoutteVerts( vertex_index, shadow_vertices, cube.transform, local_light, world_light, b, c, normals[0], normals[2], dot[0], dot[2] );
-        GenerateSilhoutteVerts( vertex_index, shadow_vertices, cube.transform, local_light, world_light, c, d, normals[4], normals[2], dot[4], dot[2] );
-        GenerateSilhoutteVerts( vertex_index, shadow_vertices, cube.transform, local_light, world_light, d, a, normals[1], normals[2], dot[1], dot[2] );
-        
-        GenerateSilhoutteVerts( vertex_index, shadow_vertices, cube.transform, local_light, world_light, e, f, normals[3], normals[5], dot[3], dot[5] );
-        GenerateSilhoutteVerts( vertex_index, shadow_vertices, cube.transform, local_light, world_light, f, g, normals[3], normals[0], dot[3], dot[0] );
-        GenerateSilhoutteVerts( vertex_index, shadow_vertices, cube.transform, local_light, world_light, g, h, normals[3], normals[4], dot[3], dot[4] );
-        GenerateSilhoutteVerts( vertex_index, shadow_vertices, cube.transform, local_light, world_light, h, e, normals[3], normals[1], dot[3], dot[1] );
+    const double start_time = platform_time();
+    job_system_run( *jobs, render_generate_shadows_job, &shadow_jobs, num_jobs );
+    stats.silhouette_time = float( platform_time() - start_time );
 
-        GenerateSilhoutteVerts( vertex_index, shadow_vertices, cube.transform, local_light, world_light, a, e, normals[1], normals[5], dot[1], dot[5] );
-        GenerateSilhoutteVerts( vertex_index, shadow_vertices, cube.transform, local_light, world_light, b, f, normals[5], normals[0], dot[5], dot[0] );
-        GenerateSilhoutteVerts( vertex_index, shadow_vertices, cube.transform, local_light, world_light, c, g, normals[0], normals[4], dot[0], dot[4] );
-        GenerateSilhoutteVerts( vertex_index, shadow_vertices, cube.transform, local_light, world_light, d, h, normals[4], normals[1], dot[4], dot[1] );
+    BeginGpuTimer( PROFILE_RENDER_SHADOWS );
 
-        assert( vertex_index < MaxCubeShadowVertices );
-    }
+    // upload each job's slice of vertices to the shadow vbo back to back
 
-    // upload vertices to shadow vbo
+    int vertex_index = 0;
+    for ( int i = 0; i < num_jobs; ++i )
+        vertex_index += num_shadow_vertices[i];
+
+    stats.num_shadow_vertices = vertex_index;
 
     glBindBuffer( GL_ARRAY_BUFFER, shadow_vbo );
-    glBufferData( GL_ARRAY_BUFFER, sizeof( vec3f ) * vertex_index, shadow_vertices, GL_STREAM_DRAW );
+    glBufferData( GL_ARRAY_BUFFER, sizeof( vec3f ) * vertex_index, nullptr, GL_STREAM_DRAW );
+
+    int upload_index = 0;
+    for ( int i = 0; i < num_jobs; ++i )
+    {
+        if ( num_shadow_vertices[i] == 0 )
+            continue;
+        glBufferSubData( GL_ARRAY_BUFFER, sizeof( vec3f ) * upload_index, sizeof( vec3f ) * num_shadow_vertices[i], shadow_vertices + i * RenderJobCubes * MaxShadowVerticesPerCube );
+        upload_index += num_shadow_vertices[i];
+    }
+
     glBindBuffer( GL_ARRAY_BUFFER, 0 );
 
     // setup for zpass stencil shadow rendering in one pass
@@ -627,15 +961,7 @@ void Render::RenderShadows( const RenderState & render_state )
 
     glUseProgram( shadow_shader );
 
-    mat4f viewMatrix = mat4f::lookAt( camera_position, camera_lookat, camera_up );
-
-    mat4f projectionMatrix = mat4f::perspective( 40.0f, display_width / (float)display_height, 0.1f, 100.0f );
-
-    mat4f modelViewProjection = projectionMatrix * viewMatrix;
-
-    int location = glGetUniformLocation( shadow_shader, "ModelViewProjection" );
-    if ( location >= 0 )
-        glUniformMatrix4fv( location, 1, GL_FALSE, (float*) &modelViewProjection );
+    UpdateFrameUniforms();
 
     glBindVertexArray( shadow_vao );
 
@@ -651,6 +977,8 @@ void Render::RenderShadows( const RenderState & render_state )
     glColorMask( GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE );
     glDepthMask( GL_TRUE );
     glDisable( GL_STENCIL_TEST );
+
+    EndGpuTimer();
    
     check_opengl_error( "after cube shadows" );
 }
@@ -679,16 +1007,6 @@ void Render::RenderShadowQuad()
     glEnable( GL_BLEND );
     glBlendFunc( GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA );
 
-    mat4f modelViewProjection = mat4f::ortho( 0.0f, 1.0f, 1.0f, 0.0f, -1.0f, 1.0f );
-
-    int location = glGetUniformLocation( debug_shader, "ModelViewProjection" );
-    if ( location >= 0 )
-    {
-        float values[16];
-        modelViewProjection.store( values );
-        glUniformMatrix4fv( location, 1, GL_FALSE, values );
-    }
-
     glBindVertexArray( mask_vao );
 
     glDrawArrays( GL_TRIANGLES, 0, 6 );
@@ -710,6 +1028,121 @@ void Render::EndScene()
     glDisable( GL_BLEND );
 }
 
+static const float profile_phase_colors[NUM_PROFILE_PHASES][3] =
+{
+    { 0.5f, 0.5f, 0.5f },                                   // input
+    { 0.2f, 0.4f, 1.0f },                                   // receive packets
+    { 0.9f, 0.2f, 0.1f },                                   // client frame
+    { 1.0f, 0.6f, 0.0f },                                   // render get state
+    { 0.4f, 0.8f, 1.0f },                                   // send packets
+    { 0.6f, 0.3f, 0.9f },                                   // cull scene
+    { 0.1f, 0.8f, 0.2f },                                   // render scene
+    { 0.1f, 0.1f, 0.1f },                                   // render shadows
+    { 1.0f, 0.9f, 0.2f },                                   // swap
+};
+
+static void profile_add_quad( DebugVertex * vertices, int & num_vertices, float x1, float y1, float x2, float y2, const float color[3], float alpha )
+{
+    const DebugVertex quad[6] =
+    {
+        { x1, y1, 0, color[0], color[1], color[2], alpha },
+        { x2, y1, 0, color[0], color[1], color[2], alpha },
+        { x2, y2, 0, color[0], color[1], color[2], alpha },
+        { x1, y1, 0, color[0], color[1], color[2], alpha },
+        { x2, y2, 0, color[0], color[1], color[2], alpha },
+        { x1, y2, 0, color[0], color[1], color[2], alpha },
+    };
+
+    memcpy( vertices + num_vertices, quad, sizeof( quad ) );
+
+    num_vertices += 6;
+}
+
+static void profile_add_graph( DebugVertex * vertices, int & num_vertices, const ProfileFrame * frames, int num_frames, bool gpu, float y )
+{
+    // one bar per-frame with phases stacked bottom up. the graph is as tall as two client frames, with a line at one frame
+
+    const float graph_height = 0.1f;
+    const float bar_width = 1.0f / ProfileHistory;
+    const float scale = graph_height / float( 2.0 * ClientFrameDeltaTime );
+
+    const float background[3] = { 1.0f, 1.0f, 1.0f };
+    const float budget[3] = { 0.0f, 0.0f, 0.0f };
+
+    profile_add_quad( vertices, num_vertices, 0.0f, y - graph_height, 1.0f, y, background, 0.5f );
+
+    for ( int i = 0; i < num_frames; ++i )
+    {
+        const float * times = gpu ? frames[i].gpu_time : frames[i].cpu_time;
+
+        const float x = ( ProfileHistory - num_frames + i ) * bar_width;
+
+        float bar_y = y;
+
+        for ( int j = 0; j < NUM_PROFILE_PHASES; ++j )
+        {
+            if ( times[j] <= 0.0f )                         // not run, or gpu time unavailable
+                continue;
+
+            const float height = min( times[j] * scale, bar_y - ( y - graph_height ) );
+
+            profile_add_quad( vertices, num_vertices, x, bar_y - height, x + bar_width, bar_y, profile_phase_colors[j], 0.9f );
+
+            bar_y -= height;
+        }
+    }
+
+    const float budget_y = y - graph_height * 0.5f;
+
+    profile_add_quad( vertices, num_vertices, 0.0f, budget_y - 0.002f, 1.0f, budget_y, budget, 0.75f );
+}
+
+void Render::RenderProfile( const ProfileFrame * simulation_frames, int num_simulation_frames, const ProfileFrame * render_frames, int num_render_frames )
+{
+    // bar graphs along the bottom of the screen: simulation thread cpu, render thread cpu, and render gpu
+
+    static const int MaxProfileVertices = 3 * ( ProfileHistory * NUM_PROFILE_PHASES + 2 ) * 6;
+
+    static DebugVertex vertices[MaxProfileVertices];
+
+    int num_vertices = 0;
+
+    profile_add_graph( vertices, num_vertices, simulation_frames, num_simulation_frames, false, 0.77f );
+    profile_add_graph( vertices, num_vertices, render_frames, num_render_frames, false, 0.88f );
+    profile_add_graph( vertices, num_vertices, render_frames, num_render_frames, true, 0.99f );
+
+    assert( num_vertices <= MaxProfileVertices );
+
+    glViewport( 0, 0, display_width, display_height );
+
+    glDisable( GL_DEPTH_TEST );
+    glDisable( GL_STENCIL_TEST );
+    glDisable( GL_CULL_FACE );
+
+    glEnable( GL_BLEND );
+    glBlendFunc( GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA );
+
+    glBindBuffer( GL_ARRAY_BUFFER, profile_vbo );
+    glBufferData( GL_ARRAY_BUFFER, sizeof( DebugVertex ) * num_vertices, vertices, GL_STREAM_DRAW );
+    glBindBuffer( GL_ARRAY_BUFFER, 0 );
+
+    glUseProgram( debug_shader );
+
+    glBindVertexArray( profile_vao );
+
+    glDrawArrays( GL_TRIANGLES, 0, num_vertices );
+
+    glBindVertexArray( 0 );
+
+    glUseProgram( 0 );
+
+    glDisable( GL_BLEND );
+
+    glEnable( GL_DEPTH_TEST );
+
+    check_opengl_error( "after profile" );
+}
+
 void clear_opengl_error()
 {
     while ( glGetError() != GL_NO_ERROR );
@@ -5,16 +5,23 @@
 
 #include "core.h"
 #include "const.h"
+#include "profiler.h"
 #include "vectorial/vec3f.h"
 #include "vectorial/mat4f.h"
+#include "vectorial/quat4f.h"
+#include <stdint.h>
+
+struct JobSystem;
 
 using namespace vectorial;
 
 struct RenderCube
 {
+    int id;                                 // cube manager index. render states list cubes in increasing id order
     float r,g,b,a;
-    mat4f transform;
-    mat4f inverse_transform;
+    vec3f position;
+    quat4f orientation;
+    float scale;                            // half the edge length, since the cube model spans -1 to +1
 };
 
 struct RenderState
@@ -30,12 +37,29 @@ struct RenderState
 
 void render_get_state( const struct World & world, RenderState & render_state );
 
+void render_interpolate_state( const RenderState & previous, const RenderState & current, float t, RenderState & render_state );
+
 struct RenderCubeInstance
 {
-    float r,g,b,a;
-    mat4f model;
-    mat4f model_view;
-    mat4f model_view_projection;
+    // the vertex shader builds the model transform from this, so it is all the per-cube data we upload
+
+    float position[3];
+    float orientation[4];
+    float scale;
+    uint8_t color[4];
+};
+
+static_assert( sizeof( RenderCubeInstance ) == 36, "cube instances should stay tightly packed" );
+
+struct RenderStats
+{
+    int num_cubes = 0;
+    int num_visible_cubes = 0;                              // inside the view frustum. only these are drawn
+    int num_shadow_casters = 0;                             // shadow volume may be inside the view frustum. only these get silhouettes
+    int num_shadow_vertices = 0;
+    float instance_time = 0.0f;                             // building cube instances on the render jobs (seconds)
+    float silhouette_time = 0.0f;                           // generating shadow silhouettes on the render jobs (seconds)
+    float gpu_time[NUM_PROFILE_PHASES] = {};                // from timer queries issued ProfileGpuTimerFrames frames ago (seconds). ProfileGpuTimeUnavailable if not ready
 };
 
 class Render
@@ -54,6 +78,8 @@ public:
     void ClearScreen();
 
     void BeginScene( float x1, float y1, float x2, float y2 );
+
+    void CullScene( const RenderState & render_state );
  
     void RenderScene( const RenderState & render_state );
     
@@ -62,11 +88,21 @@ public:
     void RenderShadowQuad();
 
     void EndScene();
+
+    void RenderProfile( const ProfileFrame * simulation_frames, int num_simulation_frames, const ProfileFrame * render_frames, int num_render_frames );
+
+    const RenderStats & GetStats() const { return stats; }
                 
 private:
 
     void Initialize();
 
+    void UpdateFrameUniforms();
+
+    void BeginGpuTimer( ProfilePhase phase );
+
+    void EndGpuTimer();
+
     bool initialized;
 
     int display_width;
@@ -78,14 +114,21 @@ private:
 
     vec3f light_position;
 
+    uint32_t frame_uniform_buffer;                          // RenderFrameUniforms, bound to RenderFrameUniformsBinding
+    bool frame_uniforms_dirty;                              // camera, light or display size changed since the frame uniforms were last written
+    mat4f view_projection;
+
     uint32_t shadow_shader;
     uint32_t cubes_shader;
     uint32_t debug_shader;
 
-    uint32_t cubes_vao;
+    uint32_t cubes_vao[RenderInstanceBufferRegions];       // one per instance buffer region, so the instance attributes never need to be respecified
     uint32_t cubes_vbo;
     uint32_t cubes_ibo;
     uint32_t cubes_instance_buffer;
+    uint8_t * cubes_instance_memory;                        // persistently mapped instance buffer. null if buffer storage is not supported
+    int cubes_instance_region;                              // the next instance buffer region to write
+    void * cubes_instance_fence[RenderInstanceBufferRegions];   // signalled when the gpu has finished drawing from each region
 
     uint32_t shadow_vao;
     uint32_t shadow_vbo;
@@ -93,9 +136,25 @@ private:
     uint32_t mask_vao;
     uint32_t mask_vbo;
 
+    JobSystem * jobs;                                       // builds cube instances and shadow silhouettes in parallel. the main thread only makes gl calls
+
+    const RenderState * culled_render_state;               // the render state CullScene was last called with
+    RenderStats stats;
+
+    int visible_cubes[MaxCubes];                            // indices of visible cubes. each job writes its own range of cubes starting at job index * RenderJobCubes
+    int shadow_casters[MaxCubes];                           // indices of shadow casters, laid out the same way
+    int num_job_visible_cubes[MaxRenderJobs];
+    int num_job_shadow_casters[MaxRenderJobs];
+
+    int num_shadow_vertices[MaxRenderJobs];                 // shadow vertices generated by each job, starting at job index * RenderJobCubes * MaxShadowVerticesPerCube
     vec3f shadow_vertices[MaxCubeShadowVertices];
 
-    RenderCubeInstance instance_data[MaxCubes];
+    uint32_t gpu_timer_queries[ProfileGpuTimerFrames][NUM_PROFILE_PHASES];
+    bool gpu_timer_issued[ProfileGpuTimerFrames][NUM_PROFILE_PHASES];
+    int gpu_timer_frame;                                    // set of queries issued this frame. the oldest set is read back when it comes around again
+
+    uint32_t profile_vao;
+    uint32_t profile_vbo;
 };
 
 struct Camera
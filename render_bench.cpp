@@ -0,0 +1,357 @@
+// Copyright © 2015, The Network Protocol Company, Inc. All Rights Reserved.
+
+#include "platform.h"
+#include "world.h"
+#include "render.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+#include <GL/glew.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+// times the client render path without a display. renders a synthetic world of cubes into an offscreen
+// framebuffer on a surfaceless EGL context (mesa llvmpipe is fine) and reports per-phase medians.
+
+static const int RenderBenchWidth = 1000;
+static const int RenderBenchHeight = 500;
+static const int RenderBenchDefaultFrames = 1000;
+static const int RenderBenchWarmupFrames = 10;
+
+enum RenderBenchPhase
+{
+    RENDER_BENCH_GET_STATE,
+    RENDER_BENCH_CULL,
+    RENDER_BENCH_BUILD_INSTANCES,
+    RENDER_BENCH_SUBMIT_SCENE,
+    RENDER_BENCH_GENERATE_SILHOUETTES,
+    RENDER_BENCH_SUBMIT_SHADOWS,
+    RENDER_BENCH_GPU_SCENE,
+    RENDER_BENCH_GPU_SHADOWS,
+    RENDER_BENCH_FINISH,
+    NUM_RENDER_BENCH_PHASES
+};
+
+static const char * render_bench_phase_names[] =
+{
+    "render_get_state",
+    "cull",
+    "build instances",
+    "submit scene",
+    "generate silhouettes",
+    "submit shadows",
+    "gpu scene",
+    "gpu shadows",
+    "finish",
+};
+
+static_assert( sizeof( render_bench_phase_names ) / sizeof( render_bench_phase_names[0] ) == NUM_RENDER_BENCH_PHASES, "render bench phase names out of sync" );
+
+struct RenderBenchContext
+{
+    EGLDisplay display = EGL_NO_DISPLAY;
+    EGLContext context = EGL_NO_CONTEXT;
+    GLuint framebuffer = 0;
+    GLuint color_renderbuffer = 0;
+    GLuint depth_stencil_renderbuffer = 0;
+};
+
+bool render_bench_create_context( RenderBenchContext & bench )
+{
+    // prefer the surfaceless platform so no window system is needed at all
+
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress( "eglGetPlatformDisplayEXT" );
+
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+    if ( get_platform_display )
+        bench.display = get_platform_display( EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr );
+#endif // #ifdef EGL_PLATFORM_SURFACELESS_MESA
+
+    if ( bench.display == EGL_NO_DISPLAY )
+        bench.display = eglGetDisplay( EGL_DEFAULT_DISPLAY );
+
+    if ( bench.display == EGL_NO_DISPLAY || !eglInitialize( bench.display, nullptr, nullptr ) )
+    {
+        printf( "error: failed to initialize egl display\n" );
+        return false;
+    }
+
+    const EGLint config_attributes[] =
+    {
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_NONE
+    };
+
+    EGLConfig config;
+    EGLint num_configs = 0;
+    if ( !eglChooseConfig( bench.display, config_attributes, &config, 1, &num_configs ) || num_configs == 0 )
+    {
+        printf( "error: no egl config for desktop opengl\n" );
+        return false;
+    }
+
+    eglBindAPI( EGL_OPENGL_API );
+
+    const EGLint context_attributes[] =
+    {
+        EGL_CONTEXT_MAJOR_VERSION, 4,
+        EGL_CONTEXT_MINOR_VERSION, 1,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+
+    bench.context = eglCreateContext( bench.display, config, EGL_NO_CONTEXT, context_attributes );
+    if ( bench.context == EGL_NO_CONTEXT )
+    {
+        printf( "error: failed to create opengl 4.1 core context\n" );
+        return false;
+    }
+
+    if ( !eglMakeCurrent( bench.display, EGL_NO_SURFACE, EGL_NO_SURFACE, bench.context ) )
+    {
+        printf( "error: failed to make context current without a surface\n" );
+        return false;
+    }
+
+    // glew built against glx fails with GLEW_ERROR_NO_GLX_DISPLAY here, but only after loading the core entry points
+
+    glewExperimental = GL_TRUE;
+    GLenum glew_result = glewInit();
+#ifdef GLEW_ERROR_NO_GLX_DISPLAY
+    if ( glew_result == GLEW_ERROR_NO_GLX_DISPLAY && glGenVertexArrays )
+        glew_result = GLEW_OK;
+#endif // #ifdef GLEW_ERROR_NO_GLX_DISPLAY
+    if ( glew_result != GLEW_OK )
+    {
+        printf( "error: failed to load opengl entry points: %s\n", (const char*)glewGetErrorString( glew_result ) );
+        return false;
+    }
+
+    clear_opengl_error();
+
+    // there is no default framebuffer, so render into our own with the stencil bits the shadows need
+
+    glGenRenderbuffers( 1, &bench.color_renderbuffer );
+    glBindRenderbuffer( GL_RENDERBUFFER, bench.color_renderbuffer );
+    glRenderbufferStorage( GL_RENDERBUFFER, GL_SRGB8_ALPHA8, RenderBenchWidth, RenderBenchHeight );
+
+    glGenRenderbuffers( 1, &bench.depth_stencil_renderbuffer );
+    glBindRenderbuffer( GL_RENDERBUFFER, bench.depth_stencil_renderbuffer );
+    glRenderbufferStorage( GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, RenderBenchWidth, RenderBenchHeight );
+
+    glBindRenderbuffer( GL_RENDERBUFFER, 0 );
+
+    glGenFramebuffers( 1, &bench.framebuffer );
+    glBindFramebuffer( GL_FRAMEBUFFER, bench.framebuffer );
+    glFramebufferRenderbuffer( GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, bench.color_renderbuffer );
+    glFramebufferRenderbuffer( GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, bench.depth_stencil_renderbuffer );
+
+    if ( glCheckFramebufferStatus( GL_FRAMEBUFFER ) != GL_FRAMEBUFFER_COMPLETE )
+    {
+        printf( "error: offscreen framebuffer is incomplete\n" );
+        return false;
+    }
+
+    check_opengl_error( "after offscreen framebuffer" );
+
+    printf( "%s (%s)\n", glGetString( GL_RENDERER ), glGetString( GL_VERSION ) );
+
+    return true;
+}
+
+void render_bench_destroy_context( RenderBenchContext & bench )
+{
+    if ( bench.context != EGL_NO_CONTEXT )
+    {
+        glDeleteFramebuffers( 1, &bench.framebuffer );
+        glDeleteRenderbuffers( 1, &bench.color_renderbuffer );
+        glDeleteRenderbuffers( 1, &bench.depth_stencil_renderbuffer );
+        eglMakeCurrent( bench.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT );
+        eglDestroyContext( bench.display, bench.context );
+    }
+
+    if ( bench.display != EGL_NO_DISPLAY )
+        eglTerminate( bench.display );
+
+    bench = RenderBenchContext();
+}
+
+int render_bench_setup_world( World & world, int num_cubes )
+{
+    // the player cube plus a square grid of small cubes with random orientations, like the commented out grid in world_setup_cubes
+
+    world_init( world );
+    world_setup_cubes( world );
+
+    const float NonPlayerCubeSize = 0.4f;
+
+    const int grid_size = (int) ceil( sqrt( (double) max( num_cubes - 1, 1 ) ) );
+    const float origin = -grid_size / 2.0f + 0.5f;
+
+    int num_created = 1;
+
+    for ( int i = 0; i < grid_size * grid_size && num_created < num_cubes; ++i )
+    {
+        const vec3f position( ( i % grid_size ) + origin, ( i / grid_size ) + origin, NonPlayerCubeSize / 2.0f );
+
+        CubeEntity * cube = world.cube_manager->CreateCube( position, NonPlayerCubeSize, false );
+        if ( !cube )
+            break;
+
+        const float random_axis[4] = { rand() / float( RAND_MAX ) - 0.5f, rand() / float( RAND_MAX ) - 0.5f, rand() / float( RAND_MAX ) - 0.5f, rand() / float( RAND_MAX ) - 0.5f };
+        cube->orientation = normalize( quat4f( random_axis[0], random_axis[1], random_axis[2], random_axis[3] ) );
+
+        num_created++;
+    }
+
+    return num_created;
+}
+
+float render_bench_percentile( float * samples, int num_samples, float percentile )
+{
+    std::sort( samples, samples + num_samples );
+    const int index = min( num_samples - 1, (int) ( percentile * num_samples ) );
+    return samples[index];
+}
+
+int main( int argc, char ** argv )
+{
+    // usage: render_bench [num cubes] [num frames]
+
+    srand( 0 );
+
+    const int requested_cubes = argc > 1 ? atoi( argv[1] ) : MaxCubes;
+    const int num_frames = argc > 2 ? max( 1, atoi( argv[2] ) ) : RenderBenchDefaultFrames;
+
+    RenderBenchContext bench;
+
+    if ( !render_bench_create_context( bench ) )
+    {
+        render_bench_destroy_context( bench );
+        return 1;
+    }
+
+    World world;
+    const int num_cubes = render_bench_setup_world( world, clamp( requested_cubes, 1, MaxCubes ) );
+
+    printf( "render bench: %d cubes, %d frames, %dx%d\n", num_cubes, num_frames, RenderBenchWidth, RenderBenchHeight );
+
+    Render * render = new Render();
+    RenderState * render_state = new RenderState();
+
+    float * samples[NUM_RENDER_BENCH_PHASES];
+    int num_samples[NUM_RENDER_BENCH_PHASES];
+    for ( int i = 0; i < NUM_RENDER_BENCH_PHASES; ++i )
+    {
+        samples[i] = new float[num_frames];
+        num_samples[i] = 0;
+    }
+
+    int num_visible_cubes = 0;
+    int num_shadow_casters = 0;
+    int num_shadow_vertices = 0;
+
+    for ( int frame = -RenderBenchWarmupFrames; frame < num_frames; ++frame )
+    {
+        // orbit the camera around the middle of the grid, so culling sees a changing view
+
+        const float angle = frame * 0.01f;
+        const vec3f lookat = vec3f( cosf( angle ) * 8.0f, sinf( angle ) * 8.0f, 0.0f ) - vec3f(0,0,1);
+        const vec3f position = lookat + vec3f(0,-11,5);
+
+        float times[NUM_RENDER_BENCH_PHASES];
+
+        double start_time = platform_time();
+
+        render_get_state( world, *render_state );
+
+        times[RENDER_BENCH_GET_STATE] = float( platform_time() - start_time );
+
+        glBindFramebuffer( GL_FRAMEBUFFER, bench.framebuffer );
+        glViewport( 0, 0, RenderBenchWidth, RenderBenchHeight );
+        glClearStencil( 0 );
+        glClearColor( 1.0f, 1.0f, 1.0f, 1.0f );
+        glClear( GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT | GL_STENCIL_BUFFER_BIT );
+
+        render->ResizeDisplay( RenderBenchWidth, RenderBenchHeight );
+        render->BeginScene( 0, 0, RenderBenchWidth, RenderBenchHeight );
+        render->SetCamera( position, lookat, vec3f(0,0,1) );
+        render->SetLightPosition( lookat + vec3f( 25.0f, -50.0f, 100.0f ) );
+
+        start_time = platform_time();
+        render->CullScene( *render_state );
+        times[RENDER_BENCH_CULL] = float( platform_time() - start_time );
+
+        start_time = platform_time();
+        render->RenderScene( *render_state );
+        const float scene_time = float( platform_time() - start_time );
+
+        start_time = platform_time();
+        render->RenderShadows( *render_state );
+        render->RenderShadowQuad();
+        const float shadows_time = float( platform_time() - start_time );
+
+        render->EndScene();
+
+        start_time = platform_time();
+        glFinish();
+        times[RENDER_BENCH_FINISH] = float( platform_time() - start_time );
+
+        const RenderStats & stats = render->GetStats();
+
+        times[RENDER_BENCH_BUILD_INSTANCES] = stats.instance_time;
+        times[RENDER_BENCH_SUBMIT_SCENE] = scene_time - stats.instance_time;
+        times[RENDER_BENCH_GENERATE_SILHOUETTES] = stats.silhouette_time;
+        times[RENDER_BENCH_SUBMIT_SHADOWS] = shadows_time - stats.silhouette_time;
+        times[RENDER_BENCH_GPU_SCENE] = stats.gpu_time[PROFILE_RENDER_SCENE];
+        times[RENDER_BENCH_GPU_SHADOWS] = stats.gpu_time[PROFILE_RENDER_SHADOWS];
+
+        if ( frame < 0 )
+            continue;
+
+        // gpu timer results that weren't ready in time are left out, rather than counted as zero
+
+        for ( int i = 0; i < NUM_RENDER_BENCH_PHASES; ++i )
+        {
+            if ( times[i] < 0.0f )
+                continue;
+            samples[i][num_samples[i]++] = times[i];
+        }
+
+        num_visible_cubes += stats.num_visible_cubes;
+        num_shadow_casters += stats.num_shadow_casters;
+        num_shadow_vertices += stats.num_shadow_vertices;
+    }
+
+    check_opengl_error( "after render bench" );
+
+    printf( "    %.1f visible cubes, %.1f shadow casters, %.1f shadow vertices per-frame\n",
+        num_visible_cubes / double( num_frames ), num_shadow_casters / double( num_frames ), num_shadow_vertices / double( num_frames ) );
+
+    // one line per-phase in a fixed format, so ci can diff runs
+
+    for ( int i = 0; i < NUM_RENDER_BENCH_PHASES; ++i )
+    {
+        if ( num_samples[i] == 0 )
+        {
+            printf( "    %-22s unavailable\n", render_bench_phase_names[i] );
+            continue;
+        }
+        const float median = render_bench_percentile( samples[i], num_samples[i], 0.5f );
+        const float high = render_bench_percentile( samples[i], num_samples[i], 0.95f );
+        printf( "    %-22s median %8.3f ms, 95th %8.3f ms\n", render_bench_phase_names[i], median * 1000.0f, high * 1000.0f );
+    }
+
+    for ( int i = 0; i < NUM_RENDER_BENCH_PHASES; ++i )
+        delete [] samples[i];
+
+    delete render_state;
+    delete render;
+
+    world_free( world );
+
+    render_bench_destroy_context( bench );
+
+    return 0;
+}
@@ -0,0 +1,101 @@
+// Copyright © 2015, The Network Protocol Company, Inc. All Rights Reserved.
+
+#ifndef SEND_RATE_H
+#define SEND_RATE_H
+
+#include "const.h"
+#include "core.h"
+#include "connection.h"
+#include <stdint.h>
+
+// per-client snapshot send rate. once per adjust period the rate backs off if the connection looks congested and
+// otherwise recovers slowly towards the maximum. congestion is packet loss, or round trip time or jitter rising above
+// the best the connection has shown. queues filling up along the path show up as rtt before packets are dropped.
+
+struct SendRateData
+{
+    double next_send_time = 0.0;                            // next time a snapshot is due to be sent to this client
+    double snapshots_per_second = SnapshotsPerSecond;       // current send rate, adapts to packet loss, rtt and jitter
+    double bandwidth_tokens = BandwidthBucketSize;          // token bucket. bytes we may send right now
+    double bandwidth_time = 0.0;                            // time tokens were last added to the bucket
+    double adjust_time = 0.0;                               // time the send rate was last adjusted
+    uint64_t num_packets_acked = 0;                         // connection packets acked as of the last adjust
+    uint64_t num_packets_lost = 0;                          // connection packets lost as of the last adjust
+    float packet_loss = 0.0f;
+    bool has_baseline = false;                              // true once rtt has been measured
+    double rtt_baseline = 0.0;                              // lowest smoothed rtt seen, drifting up towards the current rtt (seconds)
+    double jitter_baseline = 0.0;                           // lowest smoothed jitter seen, drifting up the same way (seconds)
+};
+
+inline void send_rate_update_baseline( double & baseline, double value )
+{
+    if ( value < baseline )
+        baseline = value;
+    else
+        baseline += ( value - baseline ) * SendRateBaselineDrift;
+}
+
+inline bool send_rate_congested( const SendRateData & send_rate_data, const ConnectionData & connection )
+{
+    if ( send_rate_data.packet_loss > SendRateLossThreshold )
+        return true;
+
+    if ( !send_rate_data.has_baseline )
+        return false;
+
+    return connection.rtt > send_rate_data.rtt_baseline + SendRateRTTThreshold ||
+           connection.jitter > send_rate_data.jitter_baseline + SendRateJitterThreshold;
+}
+
+inline bool send_rate_adjust( SendRateData & send_rate_data, const ConnectionData & connection, double real_time )
+{
+    // returns true if the send rate changed
+
+    if ( real_time < send_rate_data.adjust_time + SendRateAdjustTime )
+        return false;
+
+    send_rate_data.adjust_time = real_time;
+
+    // packet loss over the adjust period, from the acks the client sends back for packets we sent it
+
+    const int num_acked = int( connection.num_packets_acked - send_rate_data.num_packets_acked );
+    const int num_lost = int( connection.num_packets_lost - send_rate_data.num_packets_lost );
+
+    send_rate_data.num_packets_acked = connection.num_packets_acked;
+    send_rate_data.num_packets_lost = connection.num_packets_lost;
+
+    if ( num_acked + num_lost == 0 )
+        return false;
+
+    send_rate_data.packet_loss = num_lost / float( num_acked + num_lost );
+
+    // compare before updating the baselines, so a sudden rise is measured against where rtt and jitter were
+
+    const bool congested = send_rate_congested( send_rate_data, connection );
+
+    if ( connection.num_rtt_samples > 0 )
+    {
+        if ( !send_rate_data.has_baseline )
+        {
+            send_rate_data.has_baseline = true;
+            send_rate_data.rtt_baseline = connection.rtt;
+            send_rate_data.jitter_baseline = connection.jitter;
+        }
+        else
+        {
+            send_rate_update_baseline( send_rate_data.rtt_baseline, connection.rtt );
+            send_rate_update_baseline( send_rate_data.jitter_baseline, connection.jitter );
+        }
+    }
+
+    const double previous_snapshots_per_second = send_rate_data.snapshots_per_second;
+
+    if ( congested )
+        send_rate_data.snapshots_per_second = max( double( MinSnapshotsPerSecond ), send_rate_data.snapshots_per_second * SendRateBackOff );
+    else
+        send_rate_data.snapshots_per_second = min( double( SnapshotsPerSecond ), send_rate_data.snapshots_per_second + SendRateRecovery );
+
+    return send_rate_data.snapshots_per_second != previous_snapshots_per_second;
+}
+
+#endif // #ifndef SEND_RATE_H
@@ -6,8 +6,19 @@
 #include "shared.h"
 #include "world.h"
 #include "game.h"
+#include "telemetry.h"
+#include "jobs.h"
+#include "block.h"
+#include "challenge.h"
+#include "send_rate.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <signal.h>
+#include <random>
+
+#define PROFILE_PACKETS 0
+#define TELEMETRY 0
+#define TELEMETRY_FILE "server_telemetry.json"
 
 enum ClientState
 {
@@ -58,10 +69,69 @@ struct InputData
     InputEntry inputs[InputSlidingWindowSize];
 };
 
+struct PriorityData
+{
+    double time = 0.0;                                      // time priorities were last accumulated for this client
+    float priority[MaxEntities] = {};                       // priority accumulator per-entity. cubes not sent carry their priority over
+};
+
+struct SnapshotData
+{
+    bool exists[MaxEntities];
+    int authority[MaxEntities];
+    CubeState cubes[MaxEntities];
+    float scale[MaxEntities];
+    QuantizedCubeState quantized_cubes[MaxEntities];
+
+    // scratch for quantizing all cubes in one batch
+    CubeStateBatch batch;
+    int batch_entity_index[MaxCubes];
+    QuantizedCubeState batch_quantized[MaxCubes];
+};
+
+struct SnapshotEncodeEntry
+{
+    uint64_t baseline_tick = 0;
+    const QuantizedSnapshot * baseline = nullptr;
+    int bytes = 0;                                          // 0 if the delta doesn't fit in a snapshot packet
+    uint8_t data[MaxSnapshotBytes];
+};
+
+struct SnapshotEncodeCache
+{
+    // each (baseline, current) delta is serialized once per-tick and shared by every client acking that baseline
+
+    uint64_t tick = 0;
+    int num_entries = 0;
+    SnapshotEncodeEntry entries[MaxClients];
+};
+
+struct SnapshotSendData
+{
+    bool sending = false;
+    double real_time = 0.0;
+    int budget_bytes = 0;
+    int encode_entry = -1;                                  // index into the snapshot encode cache for this client's baseline. -1 if it has none
+    int packet_bytes = 0;
+    SnapshotPacket packet;
+    uint8_t * buffer = nullptr;                             // from the packet buffer pool. written by a worker thread, sent from the main thread
+};
+
+struct ClientWorldBlock
+{
+    WorldBlock block;                                       // also the client's first delta baseline. see server_find_baseline
+    BlockSender sender;
+    uint8_t data[MaxBlockSize];
+};
+
 struct Server
 {
     Socket * socket = nullptr;
 
+    uint64_t server_guid = 0;                               // random per-server. clients must echo it back along with the challenge token
+
+    uint8_t challenge_key[ChallengeKeyBytes];               // random per-server secret key for challenge tokens
+
     uint64_t tick = 0;
 
     uint64_t client_guid[MaxClients];
@@ -84,34 +154,95 @@ struct Server
 
     InputData client_input_data[MaxClients];
 
-    // hack: we just need this position of one cube for now -- eventually this will be a ring buffer of snapshots containing all world state
-    vec3f cube_position;
-    quat4f cube_orientation;
-    vec3f cube_linear_velocity;
-    vec3f cube_angular_velocity;
+    SendRateData client_send_rate_data[MaxClients];
+
+    PriorityData client_priority_data[MaxClients];
+
+    SnapshotData snapshot;
+
+    uint64_t client_snapshot_ack[MaxClients];
+    ConnectionData client_connection[MaxClients];
+
+    SnapshotHistory * snapshot_history = nullptr;
+
+    SnapshotEncodeCache snapshot_encode_cache;
+
+    SnapshotSendData * client_snapshot_send_data = nullptr;
+
+    ClientWorldBlock * client_world_block = nullptr;
+
+    JobSystem * jobs = nullptr;
+
+    PacketBufferPool packet_buffer_pool;
+
+    PacketFactory packet_factory;
+
+#if PROFILE_PACKETS
+    PacketProfile packet_profile;
+#endif // #if PROFILE_PACKETS
+
+#if TELEMETRY
+    Telemetry telemetry;
+    double telemetry_export_time;
+#endif // #if TELEMETRY
 };
 
+bool server_process_connection_request( const Address & from, Packet & base_packet, void * context );
+bool server_process_connection_response( const Address & from, Packet & base_packet, void * context );
+bool server_process_input( const Address & from, Packet & base_packet, void * context );
+
 void server_init( Server & server )
 {
     server.socket = new Socket( ServerPort );
 
+    std::random_device random;
+    server.server_guid = ( uint64_t( random() ) << 32 ) | random();
+    for ( int i = 0; i < ChallengeKeyBytes; ++i )
+        server.challenge_key[i] = uint8_t( random() );
+
     for ( int i = 0; i < MaxClients; ++i )
     {
         server.client_guid[i] = 0;
         server.client_connect_sequence[i] = 0;
         server.client_state[i] = CLIENT_DISCONNECTED;
         server.client_time_last_packet_received[i] = 0.0;
+        server.client_snapshot_ack[i] = 0;
+        connection_reset( server.client_connection[i] );
     }
 
     server.current_real_time = 0.0;
 
-    printf( "server listening on port %d\n", server.socket->GetPort() );
+    memset( server.snapshot.exists, 0, sizeof( server.snapshot.exists ) );
+
+    server.snapshot_history = new SnapshotHistory();
+    snapshot_history_reset( *server.snapshot_history );
+
+    server.client_snapshot_send_data = new SnapshotSendData[MaxClients];
+
+    server.client_world_block = new ClientWorldBlock[MaxClients];
+    for ( int i = 0; i < MaxClients; ++i )
+        block_sender_reset( server.client_world_block[i].sender );
+
+    server.jobs = new JobSystem();
+    job_system_init( *server.jobs, ServerJobThreads );
 
-    // hack
-    server.cube_position = vec3f(0,0,0);
-    server.cube_orientation = quat4f::identity();
-    server.cube_linear_velocity = vec3f(0,0,0);
-    server.cube_angular_velocity = vec3f(0,0,0);
+    packet_buffer_pool_init( server.packet_buffer_pool );
+
+    packet_factory_init( server.packet_factory );
+    packet_factory_register( server.packet_factory, PACKET_TYPE_CONNECTION_REQUEST, server_process_connection_request );
+    packet_factory_register( server.packet_factory, PACKET_TYPE_CONNECTION_RESPONSE, server_process_connection_response );
+    packet_factory_register( server.packet_factory, PACKET_TYPE_INPUT, server_process_input );
+
+#if PROFILE_PACKETS
+    packet_profile_reset( server.packet_profile );
+#endif // #if PROFILE_PACKETS
+
+#if TELEMETRY
+    telemetry_reset( server.telemetry, 0.0 );
+    server.telemetry_export_time = TelemetryExportTime;
+#endif // #if TELEMETRY
+
+    printf( "server listening on port %d\n", server.socket->GetPort() );
 }
 
 void server_update( Server & server, uint64_t tick, double current_real_time )
@@ -136,6 +267,14 @@ void server_update( Server & server, uint64_t tick, double current_real_time )
                 server.client_bracket_data[i] = BracketData();
                 server.client_adjustment_data[i] = AdjustmentData();
                 server.client_input_data[i] = InputData();
+                server.client_send_rate_data[i] = SendRateData();
+                server.client_priority_data[i] = PriorityData();
+                server.client_snapshot_ack[i] = 0;
+                connection_reset( server.client_connection[i] );
+                block_sender_reset( server.client_world_block[i].sender );
+#if TELEMETRY
+                telemetry_reset_client( server.telemetry, i );
+#endif // #if TELEMETRY
             }
         }
     }
@@ -143,14 +282,292 @@ void server_update( Server & server, uint64_t tick, double current_real_time )
 
 void server_take_snapshot( Server & server, World & world )
 {
-    // hack: stash the cube state in the server structure for sending to clients
-    PhysicsObjectState object_state;
-    world.physics_manager->GetObjectState( 0, object_state );
-//    printf( "cube position = (%f,%f,%f)\n", object_state.position.x(), object_state.position.y(), object_state.position.z() );
-    server.cube_position = object_state.position;
-    server.cube_orientation = object_state.orientation;
-    server.cube_linear_velocity = object_state.linear_velocity;
-    server.cube_angular_velocity = object_state.angular_velocity;
+    SnapshotData & snapshot = server.snapshot;
+
+    memset( snapshot.exists, 0, sizeof( snapshot.exists ) );
+
+    snapshot.batch.num_cubes = 0;
+
+    const CubeManager & cube_manager = *world.cube_manager;
+
+    for ( int i = 0; i < MaxCubes; ++i )
+    {
+        if ( !cube_manager.allocated[i] )
+            continue;
+
+        const CubeEntity & cube = cube_manager.cubes[i];
+
+        const int entity_index = cube.entity_index;
+
+        snapshot.exists[entity_index] = true;
+        snapshot.authority[entity_index] = world.entity_manager->GetAuthority( entity_index );
+        snapshot.scale[entity_index] = cube.scale;
+
+        CubeState & cube_state = snapshot.cubes[entity_index];
+        cube_state.position = cube.position;
+        cube_state.orientation = cube.orientation;
+        cube_state.linear_velocity = cube.linear_velocity;
+        cube_state.angular_velocity = cube.angular_velocity;
+
+        snapshot.batch_entity_index[snapshot.batch.num_cubes] = entity_index;
+
+        cube_state_batch_add( snapshot.batch, cube_state, snapshot.authority[entity_index] != 0 );
+    }
+
+    quantize_cube_batch( snapshot.batch, snapshot.batch_quantized );
+
+    for ( int i = 0; i < snapshot.batch.num_cubes; ++i )
+        snapshot.quantized_cubes[snapshot.batch_entity_index[i]] = snapshot.batch_quantized[i];
+
+    // tick 0 means "no baseline" in snapshot acks, so it is never kept
+
+    if ( server.tick > 0 )
+    {
+        QuantizedSnapshot & quantized_snapshot = snapshot_history_insert( *server.snapshot_history, server.tick );
+
+        memset( &quantized_snapshot, 0, sizeof( QuantizedSnapshot ) );
+
+        for ( int i = 0; i < snapshot.batch.num_cubes; ++i )
+            quantized_snapshot.SetCube( snapshot.batch_entity_index[i], snapshot.batch_quantized[i] );
+    }
+
+    server.snapshot_encode_cache.tick = server.tick;
+    server.snapshot_encode_cache.num_entries = 0;
+}
+
+const QuantizedSnapshot * server_find_baseline( Server & server, int client_slot, uint64_t tick )
+{
+    if ( tick == 0 || tick >= server.tick )
+        return nullptr;
+
+    const QuantizedSnapshot * snapshot = snapshot_history_find( *server.snapshot_history, tick );
+    if ( snapshot )
+        return snapshot;
+
+    // the world block is sent in parallel with synchronization, so by the time the first delta goes out it is usually
+    // older than anything in the history. it stays usable anyway: it is the only baseline the client has until it acks
+    // a delta, and the client never builds a baseline from priority snapshots. cubes that have moved a long way since
+    // the block are sent with absolute positions, and once the client acks that first delta its baselines are recent.
+
+    const ClientWorldBlock & world_block = server.client_world_block[client_slot];
+    if ( world_block.sender.complete && world_block.block.tick == tick )
+        return &world_block.block.snapshot;
+
+    return nullptr;
+}
+
+int server_add_snapshot_encode( Server & server, uint64_t baseline_tick, const QuantizedSnapshot * baseline )
+{
+    SnapshotEncodeCache & cache = server.snapshot_encode_cache;
+
+    assert( cache.tick == server.tick );
+
+    for ( int i = 0; i < cache.num_entries; ++i )
+    {
+        if ( cache.entries[i].baseline_tick == baseline_tick )
+            return i;
+    }
+
+    assert( cache.num_entries < MaxClients );
+
+    SnapshotEncodeEntry & entry = cache.entries[cache.num_entries];
+    entry.baseline_tick = baseline_tick;
+    entry.baseline = baseline;
+    entry.bytes = 0;
+
+    return cache.num_entries++;
+}
+
+void server_encode_snapshot_delta( Server & server, SnapshotEncodeEntry & entry )
+{
+    // called from worker threads. the snapshot history is read-only until all encodes are done
+
+    QuantizedSnapshot * current_snapshot = snapshot_history_find( *server.snapshot_history, server.tick );
+    const QuantizedSnapshot * baseline_snapshot = entry.baseline;
+
+    assert( current_snapshot );
+    assert( baseline_snapshot );
+
+    entry.bytes = 0;
+
+    // no position prediction across the delta. the compression state is per (baseline, current) pair
+    // and would need to be shared with the client, which is not worth it for gravity and drag alone
+
+    static const CompressionState compression_state = {};
+
+    MeasureStream measure_stream( MaxSnapshotBytes * 2 );
+    serialize_snapshot_relative_to_baseline( measure_stream, compression_state, *current_snapshot, *baseline_snapshot );
+
+    if ( measure_stream.GetBitsProcessed() > MaxSnapshotBytes * 8 )
+        return;
+
+    WriteStream write_stream( entry.data, MaxSnapshotBytes );
+    serialize_snapshot_relative_to_baseline( write_stream, compression_state, *current_snapshot, *baseline_snapshot );
+    write_stream.Flush();
+
+    assert( !write_stream.IsOverflow() );
+
+    // the client reads the delta with a bit reader, which works in whole words
+
+    entry.bytes = ( write_stream.GetBytesProcessed() + 3 ) & ~3;
+}
+
+void server_update_priority( Server & server, int client_slot, double real_time )
+{
+    assert( client_slot >= 0 );
+    assert( client_slot < MaxClients );
+
+    PriorityData & priority_data = server.client_priority_data[client_slot];
+
+    const float dt = (float) clamp( real_time - priority_data.time, 0.0, 1.0 );
+
+    priority_data.time = real_time;
+
+    const SnapshotData & snapshot = server.snapshot;
+
+    const int player_entity_index = ENTITY_PLAYER_BEGIN + client_slot;
+    const int player_authority = player_entity_index;
+
+    const vec3f origin = snapshot.exists[player_entity_index] ? snapshot.cubes[player_entity_index].position : vec3f(0,0,0);
+
+    for ( int i = 0; i < MaxEntities; ++i )
+    {
+        if ( !snapshot.exists[i] )
+        {
+            priority_data.priority[i] = 0.0f;
+            continue;
+        }
+
+        if ( i == player_entity_index )
+        {
+            priority_data.priority[i] += PriorityPlayer;
+            continue;
+        }
+
+        // cubes near the player are more relevant than cubes far away
+
+        const float distance = length( snapshot.cubes[i].position - origin );
+
+        const float relevancy = ( distance > PriorityRelevancyDistance ) ? max( PriorityMinimumRelevancy, PriorityRelevancyDistance / distance ) : 1.0f;
+
+        // cubes being interacted with are moving and need to be sent more often than cubes at rest
+
+        const int authority = snapshot.authority[i];
+
+        float scale = 1.0f;
+        if ( authority == player_authority )
+            scale = PriorityAuthorityScale;
+        else if ( authority != 0 )
+            scale = PriorityInteractingScale;
+
+        priority_data.priority[i] += dt * relevancy * scale;
+    }
+}
+
+struct PriorityEntry
+{
+    int entity_index;
+    float priority;
+};
+
+static int compare_priority_entries( const void * a, const void * b )
+{
+    const float priority_a = ( (const PriorityEntry*) a )->priority;
+    const float priority_b = ( (const PriorityEntry*) b )->priority;
+    if ( priority_a > priority_b )
+        return -1;
+    else if ( priority_a < priority_b )
+        return +1;
+    else
+        return 0;
+}
+
+void server_add_snapshot_cubes( Server & server, int client_slot, SnapshotPacket & packet, int budget_bytes )
+{
+    assert( client_slot >= 0 );
+    assert( client_slot < MaxClients );
+
+    PriorityData & priority_data = server.client_priority_data[client_slot];
+
+    const SnapshotData & snapshot = server.snapshot;
+
+    int num_entries = 0;
+    PriorityEntry entries[MaxEntities];
+    for ( int i = 0; i < MaxEntities; ++i )
+    {
+        if ( !snapshot.exists[i] || priority_data.priority[i] <= 0.0f )
+            continue;
+        entries[num_entries].entity_index = i;
+        entries[num_entries].priority = priority_data.priority[i];
+        num_entries++;
+    }
+
+    qsort( entries, num_entries, sizeof( PriorityEntry ), compare_priority_entries );
+
+    // fill the packet highest priority first until it hits the byte budget. cubes that don't fit
+    // keep their accumulated priority and will be sent in a later packet.
+
+    packet.num_cubes = 0;
+
+    MeasureStream header_stream( MaxPacketSize );
+
+    int bits = measure_packet( header_stream, packet );
+
+    const int budget_bits = budget_bytes * 8;
+
+    for ( int i = 0; i < num_entries && packet.num_cubes < MaxCubesPerSnapshot; ++i )
+    {
+        const int entity_index = entries[i].entity_index;
+
+        SnapshotCube & cube = packet.cubes[packet.num_cubes];
+        cube.entity_index = entity_index;
+        cube.state = snapshot.quantized_cubes[entity_index];
+        cube.linear_velocity = snapshot.cubes[entity_index].linear_velocity;
+        cube.angular_velocity = snapshot.cubes[entity_index].angular_velocity;
+        cube.at_rest = length_squared( cube.linear_velocity ) == 0.0f && length_squared( cube.angular_velocity ) == 0.0f;
+
+        MeasureStream cube_stream( MaxPacketSize );
+        serialize_object( cube_stream, cube );
+
+        const int cube_bits = cube_stream.GetBitsProcessed();
+
+        if ( bits + cube_bits > budget_bits )
+            break;
+
+        bits += cube_bits;
+
+        priority_data.priority[entity_index] = 0.0f;
+
+        packet.num_cubes++;
+    }
+}
+
+void server_reset_send_rate( Server & server, int client_slot )
+{
+    assert( client_slot >= 0 );
+    assert( client_slot < MaxClients );
+
+    // stagger sends across server frames so egress does not burst for all clients at once
+
+    SendRateData & send_rate_data = server.client_send_rate_data[client_slot];
+    send_rate_data = SendRateData();
+    send_rate_data.next_send_time = server.current_real_time + ( 1.0 / SnapshotsPerSecond ) * client_slot / MaxClients;
+    send_rate_data.bandwidth_time = server.current_real_time;
+    send_rate_data.adjust_time = server.current_real_time;
+}
+
+void server_adjust_send_rate( Server & server, int client_slot, double real_time )
+{
+    SendRateData & send_rate_data = server.client_send_rate_data[client_slot];
+
+    const ConnectionData & connection = server.client_connection[client_slot];
+
+    if ( send_rate_adjust( send_rate_data, connection, real_time ) )
+    {
+        printf( "client %d send rate %.1f snapshots per-second (%.1f%% packet loss, rtt %.1fms [%.1fms], jitter %.1fms [%.1fms])\n", 
+            client_slot, send_rate_data.snapshots_per_second, send_rate_data.packet_loss * 100.0f, 
+            connection.rtt * 1000.0, send_rate_data.rtt_baseline * 1000.0, connection.jitter * 1000.0, send_rate_data.jitter_baseline * 1000.0 );
+    }
 }
 
 int server_find_client_slot( const Server & server, const Address & from, uint64_t client_guid )
@@ -183,36 +600,150 @@ int server_find_free_slot( const Server & server )
     return -1;
 }
 
-void server_send_packet( Server & server, const Address & address, Packet & packet )
+#if PROFILE_PACKETS || TELEMETRY
+
+void server_record_sent_packet( Server & server, const Address & address, Packet & packet, int packet_bytes )
+{
+    (void) address;
+
+#if PROFILE_PACKETS
+    packet_profile_add( server.packet_profile, packet, packet_bytes );
+#endif // #if PROFILE_PACKETS
+
+#if TELEMETRY
+    telemetry_packet_sent( server.telemetry, server_find_client_slot( server, address ), packet.type, packet_bytes );
+#endif // #if TELEMETRY
+
+    /*
+    char buffer[256];
+    printf( "sent %s packet to client %s\n", packet_type_string( packet.type ), address.ToString( buffer, sizeof( buffer ) ) );
+    */
+}
+
+#endif // #if PROFILE_PACKETS || TELEMETRY
+
+int server_send_packet( Server & server, const Address & address, Packet & packet )
 {
-    uint8_t buffer[MaxPacketSize];
+    uint8_t * buffer = packet_buffer_alloc( server.packet_buffer_pool );
+    if ( !buffer )
+        return 0;
+
+    int result = 0;
     int packet_bytes = 0;
     WriteStream stream( buffer, MaxPacketSize );
     if ( write_packet( stream, packet, packet_bytes ) )
     {
         if ( server.socket->SendPacket( address, buffer, packet_bytes ) && packet.type )
         {
-            /*
-            char buffer[256];
-            printf( "sent %s packet to client %s\n", packet_type_string( packet.type ), address.ToString( buffer, sizeof( buffer ) ) );
-            */
+#if PROFILE_PACKETS || TELEMETRY
+            server_record_sent_packet( server, address, packet, packet_bytes );
+#endif // #if PROFILE_PACKETS || TELEMETRY
+            result = packet_bytes;
         }
     }
+
+    packet_buffer_free( server.packet_buffer_pool, buffer );
+
+    return result;
 }
 
-void server_send_packets( Server & server, double real_time )
+void server_encode_snapshot_job( void * context, int index )
+{
+    Server & server = *(Server*)context;
+    server_encode_snapshot_delta( server, server.snapshot_encode_cache.entries[index] );
+}
+
+void server_write_snapshot_job( void * context, int index )
 {
-    static double last_send_time = 0.0;
-    if ( last_send_time + ( 1.0 / SnapshotsPerSecond ) > real_time )
+    Server & server = *(Server*)context;
+
+    SnapshotSendData & send_data = server.client_snapshot_send_data[index];
+
+    if ( !send_data.sending )
         return;
-    last_send_time = real_time;
+
+    SnapshotPacket & packet = send_data.packet;
+
+    if ( !packet.synchronizing )
+    {
+        server_update_priority( server, index, send_data.real_time );
+
+        packet.delta = false;
+
+        if ( send_data.encode_entry != -1 && server.snapshot_encode_cache.entries[send_data.encode_entry].bytes > 0 )
+        {
+            const SnapshotEncodeEntry & entry = server.snapshot_encode_cache.entries[send_data.encode_entry];
+
+            packet.delta = true;
+            packet.baseline_tick = entry.baseline_tick;
+            packet.delta_bytes = entry.bytes;
+            memcpy( packet.delta_data, entry.data, entry.bytes );
+
+            MeasureStream measure_stream( MaxPacketSize );
+            if ( measure_packet( measure_stream, packet ) > send_data.budget_bytes * 8 )
+                packet.delta = false;
+        }
+
+        // the full snapshot covers every cube, so nothing carries priority over. otherwise fall back
+        // to sending as many cubes as fit by priority
+
+        if ( packet.delta )
+            memset( server.client_priority_data[index].priority, 0, sizeof( server.client_priority_data[index].priority ) );
+        else
+            server_add_snapshot_cubes( server, index, packet, send_data.budget_bytes );
+    }
+
+    WriteStream stream( send_data.buffer, MaxPacketSize );
+    if ( !write_packet( stream, packet, send_data.packet_bytes ) )
+        send_data.packet_bytes = 0;
+}
+
+void server_send_packets( Server & server, double real_time )
+{
+    // decide which clients get a snapshot this frame and which baselines they need
 
     for ( int i = 0; i < MaxClients; ++i )
     {
+        SnapshotSendData & send_data = server.client_snapshot_send_data[i];
+
+        send_data.sending = false;
+
         if ( server.client_state[i] == CLIENT_CONNECTED )
         {
-            SnapshotPacket packet;
+            SendRateData & send_rate_data = server.client_send_rate_data[i];
+
+            send_rate_data.bandwidth_tokens = min( send_rate_data.bandwidth_tokens + ( real_time - send_rate_data.bandwidth_time ) * BandwidthBytesPerSecond, double( BandwidthBucketSize ) );
+            send_rate_data.bandwidth_time = real_time;
+
+            if ( !server.client_sync_data[i].synchronizing )
+                server_adjust_send_rate( server, i, real_time );
+
+            if ( real_time < send_rate_data.next_send_time )
+                continue;
+
+            // if the client is over its bandwidth budget, hold the snapshot until the bucket refills
+
+            if ( send_rate_data.bandwidth_tokens <= 0.0 )
+                continue;
+
+            send_data.buffer = packet_buffer_alloc( server.packet_buffer_pool );
+            if ( !send_data.buffer )
+                continue;
+
+            // keep the send phase for this client so staggering across clients is preserved
+
+            const double send_interval = 1.0 / send_rate_data.snapshots_per_second;
+            while ( send_rate_data.next_send_time <= real_time )
+                send_rate_data.next_send_time += send_interval;
+
+            send_data.sending = true;
+            send_data.real_time = real_time;
+            send_data.budget_bytes = min( MaxSnapshotBytes, (int) send_rate_data.bandwidth_tokens );
+            send_data.packet_bytes = 0;
+
+            SnapshotPacket & packet = send_data.packet;
             packet.type = PACKET_TYPE_SNAPSHOT;
+            connection_write_header( server.client_connection[i], packet.header, real_time );
             packet.tick = server.tick;
             packet.synchronizing = server.client_sync_data[i].synchronizing;
             if ( packet.synchronizing )
@@ -227,203 +758,382 @@ void server_send_packets( Server & server, double real_time )
                 packet.adjustment_sequence = server.client_adjustment_data[i].sequence;
                 packet.adjustment_offset = server.client_adjustment_data[i].offset;
                 packet.input_ack = server.client_input_data[i].most_recent_input;
-                packet.cube_position = server.cube_position;
-                packet.cube_orientation = server.cube_orientation;
-                packet.cube_linear_velocity = server.cube_linear_velocity;
-                packet.cube_angular_velocity = server.cube_angular_velocity;
+
+                // send the full snapshot relative to the most recent baseline the client has acked. until the client
+                // has the world block, or if its baseline has been lost, it gets cubes by priority instead.
+
+                const uint64_t baseline_tick = server.client_snapshot_ack[i];
+                const QuantizedSnapshot * baseline = server_find_baseline( server, i, baseline_tick );
+
+                send_data.encode_entry = baseline ? server_add_snapshot_encode( server, baseline_tick, baseline ) : -1;
             }
-            server_send_packet( server, server.client_address[i], packet );
+        }
+    }
+
+    // encode each distinct baseline once, then build and write each client's packet. both fan out
+    // across the job system and return only once all workers are done with the snapshot.
+
+    job_system_run( *server.jobs, server_encode_snapshot_job, &server, server.snapshot_encode_cache.num_entries );
+
+    job_system_run( *server.jobs, server_write_snapshot_job, &server, MaxClients );
+
+    // send all snapshots straight from the buffers they were written into, in as few system calls as possible
+
+    int num_sends = 0;
+    int send_client_slot[MaxClients];
+    PacketSend sends[MaxClients];
+
+    for ( int i = 0; i < MaxClients; ++i )
+    {
+        SnapshotSendData & send_data = server.client_snapshot_send_data[i];
+
+        if ( !send_data.sending || send_data.packet_bytes == 0 )
+            continue;
+
+        send_client_slot[num_sends] = i;
+        sends[num_sends].address = server.client_address[i];
+        sends[num_sends].data = send_data.buffer;
+        sends[num_sends].bytes = send_data.packet_bytes;
+        num_sends++;
+    }
+
+    const int num_sent = server.socket->SendPackets( sends, num_sends );
+
+    for ( int i = 0; i < num_sent; ++i )
+    {
+        const int client_slot = send_client_slot[i];
+        SnapshotSendData & send_data = server.client_snapshot_send_data[client_slot];
+#if PROFILE_PACKETS || TELEMETRY
+        server_record_sent_packet( server, sends[i].address, send_data.packet, send_data.packet_bytes );
+#endif // #if PROFILE_PACKETS || TELEMETRY
+        server.client_send_rate_data[client_slot].bandwidth_tokens -= send_data.packet_bytes;
+    }
+
+    for ( int i = 0; i < MaxClients; ++i )
+    {
+        SnapshotSendData & send_data = server.client_snapshot_send_data[i];
+        if ( send_data.buffer )
+        {
+            packet_buffer_free( server.packet_buffer_pool, send_data.buffer );
+            send_data.buffer = nullptr;
+        }
+    }
+}
+
+void server_start_world_block( Server & server, int client_slot )
+{
+    ClientWorldBlock & world_block = server.client_world_block[client_slot];
+
+    const QuantizedSnapshot * snapshot = snapshot_history_find( *server.snapshot_history, server.tick );
+    if ( !snapshot )
+        return;
+
+    WorldBlock & block = world_block.block;
+    block.tick = server.tick;
+    block.snapshot = *snapshot;
+    block.num_cubes = 0;
+    for ( int i = 0; i < MaxEntities; ++i )
+    {
+        if ( !server.snapshot.exists[i] )
+            continue;
+        block.entity_index[block.num_cubes] = i;
+        block.scale[block.num_cubes] = server.snapshot.scale[i];
+        block.num_cubes++;
+    }
+
+    WriteStream stream( world_block.data, MaxBlockSize );
+    serialize_world_block( stream, block );
+    stream.Flush();
+
+    if ( stream.IsOverflow() )
+    {
+        printf( "world block is too large\n" );
+        return;
+    }
+
+    // the client reads the block with a bit reader, which works in whole words
+
+    const int block_size = ( stream.GetBytesProcessed() + 3 ) & ~3;
+
+    block_sender_start( world_block.sender, server.client_connect_sequence[client_slot], world_block.data, block_size );
+
+    printf( "client %d sending world block: %d bytes, %d fragments\n", client_slot, block_size, world_block.sender.num_fragments );
+}
+
+void server_send_world_blocks( Server & server, double real_time )
+{
+    // the world block goes down as soon as the client connects, in parallel with synchronization,
+    // using whatever bandwidth is left over after snapshots
+
+    for ( int i = 0; i < MaxClients; ++i )
+    {
+        if ( server.client_state[i] != CLIENT_CONNECTED )
+            continue;
+
+        BlockSender & sender = server.client_world_block[i].sender;
+
+        if ( !sender.sending && !sender.complete )
+            server_start_world_block( server, i );
+
+        SendRateData & send_rate_data = server.client_send_rate_data[i];
+
+        while ( send_rate_data.bandwidth_tokens > 0.0 )
+        {
+            const int fragment_index = block_sender_next_fragment( sender, real_time );
+            if ( fragment_index == -1 )
+                break;
+
+            BlockFragmentPacket packet;
+            packet.type = PACKET_TYPE_BLOCK_FRAGMENT;
+            connection_write_header( server.client_connection[i], packet.header, real_time );
+            packet.block_id = sender.block_id;
+            packet.block_size = sender.block_size;
+            packet.fragment_index = fragment_index;
+            packet.fragment_bytes = block_sender_fragment_bytes( sender, fragment_index );
+            memcpy( packet.fragment_data, sender.data + fragment_index * BlockFragmentSize, packet.fragment_bytes );
+
+            send_rate_data.bandwidth_tokens -= server_send_packet( server, server.client_address[i], packet );
         }
     }
 }
 
-bool process_packet( const Address & from, Packet & base_packet, void * context )
+bool server_process_connection_request( const Address & from, Packet & base_packet, void * context )
 {
     Server & server = *(Server*)context;
 
-    /*
-    char buffer[256];
-    printf( "received %s packet from %s\n", packet_type_string( base_packet.type ), from.ToString( buffer, sizeof( buffer ) ) );
-    */
+    // reply with a challenge. nothing is stored and no client slot is touched until the client sends the token back
+
+    ConnectionRequestPacket & packet = (ConnectionRequestPacket&) base_packet;
 
-    switch ( base_packet.type )
+    ConnectionChallengePacket response;
+    response.type = PACKET_TYPE_CONNECTION_CHALLENGE;
+    response.client_guid = packet.client_guid;
+    response.connect_sequence = packet.connect_sequence;
+    response.server_guid = server.server_guid;
+    response.challenge_timestamp = challenge_timestamp( server.current_real_time );
+    response.challenge_token = challenge_token( server.challenge_key, from, packet.client_guid, packet.connect_sequence, response.challenge_timestamp );
+    server_send_packet( server, from, response );
+
+    return true;
+}
+
+bool server_process_connection_response( const Address & from, Packet & base_packet, void * context )
+{
+    Server & server = *(Server*)context;
+
+    // only clients that echo back a valid challenge token for their address get a slot
+
+    ConnectionResponsePacket & packet = (ConnectionResponsePacket&) base_packet;
+
+    if ( packet.server_guid != server.server_guid )
+        return false;
+
+    if ( !challenge_timestamp_valid( packet.challenge_timestamp, server.current_real_time ) )
+        return false;
+
+    if ( packet.challenge_token != challenge_token( server.challenge_key, from, packet.client_guid, packet.connect_sequence, packet.challenge_timestamp ) )
+        return false;
+
+    // is the client already connected?
+    int client_slot = server_find_client_slot( server, from, packet.client_guid );
+    if ( client_slot == -1 )
     {
-        case PACKET_TYPE_CONNECTION_REQUEST:
+        // is there a free client slot?
+        client_slot = server_find_free_slot( server );
+        if ( client_slot != -1 )
         {
-            // is the client already connected?
-            ConnectionRequestPacket & packet = (ConnectionRequestPacket&) base_packet;
-            int client_slot = server_find_client_slot( server, from, packet.client_guid );
-            if ( client_slot == -1 )
-            {
-                // is there a free client slot?
-                client_slot = server_find_free_slot( server );
-                if ( client_slot != -1 )
-                {
-                    char buffer[256];
-                    printf( "client %d connecting %s (%d)\n", client_slot, from.ToString( buffer, sizeof( buffer ) ), packet.connect_sequence );
-
-                    // connect client
-                    server.client_state[client_slot] = CLIENT_CONNECTING;
-                    server.client_guid[client_slot] = packet.client_guid;
-                    server.client_connect_sequence[client_slot] = packet.connect_sequence;
-                    server.client_address[client_slot] = from;
-                    server.client_time_last_packet_received[client_slot] = server.current_real_time;
-                    server.client_input_data[client_slot] = InputData();
-                    server.client_sync_data[client_slot] = SyncData();
-                    server.client_bracket_data[client_slot] = BracketData();
-                    server.client_adjustment_data[client_slot] = AdjustmentData();
-                    server.client_sync_data[client_slot].synchronizing = true;
-
-                    // send connection accepted resonse
-                    ConnectionAcceptedPacket response;
-                    response.type = PACKET_TYPE_CONNECTION_ACCEPTED;
-                    response.client_guid = packet.client_guid;
-                    response.connect_sequence = packet.connect_sequence;
-                    server_send_packet( server, from, response );
-                    return true;
-                }
-                else
-                {
-                    // no free client slots. send connection denied response
-                    ConnectionDeniedPacket response;
-                    response.type = PACKET_TYPE_CONNECTION_DENIED;
-                    response.client_guid = packet.client_guid;
-                    response.connect_sequence = packet.connect_sequence;
-                    server_send_packet( server, from, response );
-                    return true;
-                }
-            }
-            else
+            char buffer[256];
+            printf( "client %d connecting %s (%d)\n", client_slot, from.ToString( buffer, sizeof( buffer ) ), packet.connect_sequence );
+
+            // connect client
+            server.client_state[client_slot] = CLIENT_CONNECTING;
+            server.client_guid[client_slot] = packet.client_guid;
+            server.client_connect_sequence[client_slot] = packet.connect_sequence;
+            server.client_address[client_slot] = from;
+            server.client_time_last_packet_received[client_slot] = server.current_real_time;
+            server.client_input_data[client_slot] = InputData();
+            server.client_sync_data[client_slot] = SyncData();
+            server.client_bracket_data[client_slot] = BracketData();
+            server.client_adjustment_data[client_slot] = AdjustmentData();
+            server.client_sync_data[client_slot].synchronizing = true;
+            server_reset_send_rate( server, client_slot );
+            server.client_priority_data[client_slot] = PriorityData();
+            server.client_snapshot_ack[client_slot] = 0;
+            connection_reset( server.client_connection[client_slot] );
+            block_sender_reset( server.client_world_block[client_slot].sender );
+#if TELEMETRY
+            telemetry_reset_client( server.telemetry, client_slot );
+#endif // #if TELEMETRY
+
+            // send connection accepted resonse
+            ConnectionAcceptedPacket response;
+            response.type = PACKET_TYPE_CONNECTION_ACCEPTED;
+            response.client_guid = packet.client_guid;
+            response.connect_sequence = packet.connect_sequence;
+            response.server_guid = server.server_guid;
+            server_send_packet( server, from, response );
+            return true;
+        }
+        else
+        {
+            // no free client slots. send connection denied response
+            ConnectionDeniedPacket response;
+            response.type = PACKET_TYPE_CONNECTION_DENIED;
+            response.client_guid = packet.client_guid;
+            response.connect_sequence = packet.connect_sequence;
+            response.server_guid = server.server_guid;
+            server_send_packet( server, from, response );
+            return true;
+        }
+    }
+    else
+    {
+        if ( packet.connect_sequence == server.client_connect_sequence[client_slot] )
+        {
+            if ( server.client_state[client_slot] == CLIENT_CONNECTING )
             {
-                if ( packet.connect_sequence == server.client_connect_sequence[client_slot] )
-                {
-                    if ( server.client_state[client_slot] == CLIENT_CONNECTING )
-                    {
-                        // we must reply with connection accepted because packets are unreliable
-                        ConnectionAcceptedPacket response;
-                        response.type = PACKET_TYPE_CONNECTION_ACCEPTED;
-                        response.client_guid = packet.client_guid;
-                        response.connect_sequence = packet.connect_sequence;
-                        server.client_time_last_packet_received[client_slot] = server.current_real_time;
-                        server_send_packet( server, from, response );
-                        return true;
-                    }
-                }
-                else if ( sequence_greater_than( packet.connect_sequence, server.client_connect_sequence[client_slot] ) )
-                {
-                    char buffer[256];
-                    printf( "client %d reconnecting %s (%d)\n", client_slot, from.ToString( buffer, sizeof( buffer ) ), packet.connect_sequence );
-
-                    // todo: this should be a function -- the code is completely common with initial connect
-
-                    // eg: server_connect_client( ... )
-
-                    // client reconnect
-                    server.client_state[client_slot] = CLIENT_CONNECTING;
-                    server.client_guid[client_slot] = packet.client_guid;
-                    server.client_connect_sequence[client_slot] = packet.connect_sequence;
-                    server.client_address[client_slot] = from;
-                    server.client_time_last_packet_received[client_slot] = server.current_real_time;
-                    server.client_input_data[client_slot] = InputData();
-                    server.client_sync_data[client_slot] = SyncData();
-                    server.client_bracket_data[client_slot] = BracketData();
-                    server.client_adjustment_data[client_slot] = AdjustmentData();
-                    server.client_sync_data[client_slot].synchronizing = true;
-
-                    // send connection accepted resonse
-                    ConnectionAcceptedPacket response;
-                    response.type = PACKET_TYPE_CONNECTION_ACCEPTED;
-                    response.client_guid = packet.client_guid;
-                    response.connect_sequence = packet.connect_sequence;
-                    server_send_packet( server, from, response );
-                    return true;
-                }
+                // we must reply with connection accepted because packets are unreliable
+                ConnectionAcceptedPacket response;
+                response.type = PACKET_TYPE_CONNECTION_ACCEPTED;
+                response.client_guid = packet.client_guid;
+                response.connect_sequence = packet.connect_sequence;
+                response.server_guid = server.server_guid;
+                server.client_time_last_packet_received[client_slot] = server.current_real_time;
+                server_send_packet( server, from, response );
+                return true;
             }
         }
-        break;
+        else if ( sequence_greater_than( packet.connect_sequence, server.client_connect_sequence[client_slot] ) )
+        {
+            char buffer[256];
+            printf( "client %d reconnecting %s (%d)\n", client_slot, from.ToString( buffer, sizeof( buffer ) ), packet.connect_sequence );
+
+            // todo: this should be a function -- the code is completely common with initial connect
+
+            // eg: server_connect_client( ... )
+
+            // client reconnect
+            server.client_state[client_slot] = CLIENT_CONNECTING;
+            server.client_guid[client_slot] = packet.client_guid;
+            server.client_connect_sequence[client_slot] = packet.connect_sequence;
+            server.client_address[client_slot] = from;
+            server.client_time_last_packet_received[client_slot] = server.current_real_time;
+            server.client_input_data[client_slot] = InputData();
+            server.client_sync_data[client_slot] = SyncData();
+            server.client_bracket_data[client_slot] = BracketData();
+            server.client_adjustment_data[client_slot] = AdjustmentData();
+            server.client_sync_data[client_slot].synchronizing = true;
+            server_reset_send_rate( server, client_slot );
+            server.client_priority_data[client_slot] = PriorityData();
+            server.client_snapshot_ack[client_slot] = 0;
+            connection_reset( server.client_connection[client_slot] );
+            block_sender_reset( server.client_world_block[client_slot].sender );
+#if TELEMETRY
+            telemetry_reset_client( server.telemetry, client_slot );
+#endif // #if TELEMETRY
+
+            // send connection accepted resonse
+            ConnectionAcceptedPacket response;
+            response.type = PACKET_TYPE_CONNECTION_ACCEPTED;
+            response.client_guid = packet.client_guid;
+            response.connect_sequence = packet.connect_sequence;
+            response.server_guid = server.server_guid;
+            server_send_packet( server, from, response );
+            return true;
+        }
+    }
 
-        case PACKET_TYPE_INPUT:
+    return false;
+}
+
+bool server_process_input( const Address & from, Packet & base_packet, void * context )
+{
+    Server & server = *(Server*)context;
+
+    InputPacket & packet = (InputPacket&) base_packet;
+    int client_slot = server_find_client_slot( server, from );
+    if ( client_slot != -1 )
+    {
+        if ( server.client_state[client_slot] == CLIENT_CONNECTING )
         {
-            InputPacket & packet = (InputPacket&) base_packet;
-            int client_slot = server_find_client_slot( server, from );
-            if ( client_slot != -1 )
-            {
-                if ( server.client_state[client_slot] == CLIENT_CONNECTING )
-                {
-                    char buffer[256];
-                    printf( "client %d connected %s (%d)\n", client_slot, from.ToString( buffer, sizeof( buffer ) ), server.client_connect_sequence[client_slot] );
-                    server.client_state[client_slot] = CLIENT_CONNECTED;
-                }
+            char buffer[256];
+            printf( "client %d connected %s (%d)\n", client_slot, from.ToString( buffer, sizeof( buffer ) ), server.client_connect_sequence[client_slot] );
+            server.client_state[client_slot] = CLIENT_CONNECTED;
+        }
 
-                if ( packet.synchronizing && server.client_sync_data[client_slot].synchronizing &&
-                     packet.sync_sequence == server.client_sync_data[client_slot].sequence )
-                {
-                    uint64_t oldest_input_tick = packet.tick;
-                    
-                    if ( server.client_sync_data[client_slot].num_samples > 0 )
-                        oldest_input_tick = server.client_sync_data[client_slot].previous_tick + 1;
+        connection_process_header( server.client_connection[client_slot], packet.header, server.current_real_time );
+
+        if ( packet.synchronizing && server.client_sync_data[client_slot].synchronizing &&
+             packet.sync_sequence == server.client_sync_data[client_slot].sequence )
+        {
+            uint64_t oldest_input_tick = packet.tick;
+            
+            if ( server.client_sync_data[client_slot].num_samples > 0 )
+                oldest_input_tick = server.client_sync_data[client_slot].previous_tick + 1;
 
-                    server.client_sync_data[client_slot].previous_tick = packet.tick;
+            server.client_sync_data[client_slot].previous_tick = packet.tick;
 
-                    const int offset = max( 0, (int) ( server.tick + TicksPerServerFrame + TicksPerClientFrame + InputSafety - oldest_input_tick ) );
+            const int offset = max( 0, (int) ( server.tick + TicksPerServerFrame + TicksPerClientFrame + InputSafety - oldest_input_tick ) );
 
 //                    printf( "%d - %d (%d) = %d\n", (int) server.tick, (int) oldest_input_tick, (int) packet.tick, offset );
-                    
-                    server.client_sync_data[client_slot].num_samples++;
-                    server.client_sync_data[client_slot].offset = max( offset, server.client_sync_data[client_slot].offset );
-                    
-                    if ( server.client_sync_data[client_slot].num_samples > MaxSyncSamples && 
-                         server.client_sync_data[client_slot].offset == packet.sync_offset )
-                    {
-                        printf( "client %d synchronized [+%d]\n", client_slot, server.client_sync_data[client_slot].offset );
-                        server.client_sync_data[client_slot].synchronizing = false;
-                        server.client_sync_data[client_slot].sequence++;
-                        server.client_bracket_data[client_slot].bracketing = true;
-                    }
+            
+            server.client_sync_data[client_slot].num_samples++;
+            server.client_sync_data[client_slot].offset = max( offset, server.client_sync_data[client_slot].offset );
+            
+            if ( server.client_sync_data[client_slot].num_samples > MaxSyncSamples && 
+                 server.client_sync_data[client_slot].offset == packet.sync_offset )
+            {
+                printf( "client %d synchronized [+%d]\n", client_slot, server.client_sync_data[client_slot].offset );
+                server.client_sync_data[client_slot].synchronizing = false;
+                server.client_sync_data[client_slot].sequence++;
+                server.client_bracket_data[client_slot].bracketing = true;
+            }
+        }
+
+        // any baseline the client acks is one it can decode against, even if input packets arrive out of order
+
+        if ( !packet.synchronizing )
+            server.client_snapshot_ack[client_slot] = packet.snapshot_ack;
+
+        if ( packet.block_ack )
+            block_sender_process_ack( server.client_world_block[client_slot].sender, packet.block_id, packet.block_acks );
+
+        if ( !packet.synchronizing && !server.client_sync_data[client_slot].synchronizing &&
+             ( ( !packet.bracketed && server.client_bracket_data[client_slot].bracketing ) ||
+               (  packet.bracketed && server.client_bracket_data[client_slot].bracketed ) ) )
+        {
+            if ( packet.num_inputs > 0 && packet.tick > server.client_input_data[client_slot].most_recent_input )
+            {
+                const uint64_t oldest_input_in_packet = packet.tick - ( packet.num_inputs - 1 );
+
+                if ( server.client_input_data[client_slot].first_input == 0 )
+                {
+                    server.client_input_data[client_slot].first_input = oldest_input_in_packet;
                 }
 
-                if ( !packet.synchronizing && !server.client_sync_data[client_slot].synchronizing &&
-                     ( ( !packet.bracketed && server.client_bracket_data[client_slot].bracketing ) ||
-                       (  packet.bracketed && server.client_bracket_data[client_slot].bracketed ) ) )
+                if ( server.client_adjustment_data[client_slot].first_input == 0 && 
+                     server.client_adjustment_data[client_slot].sequence == packet.adjustment_sequence )
                 {
-                    if ( packet.num_inputs > 0 && packet.tick > server.client_input_data[client_slot].most_recent_input )
-                    {
-                        const uint64_t oldest_input_in_packet = packet.tick - ( packet.num_inputs - 1 );
-
-                        if ( server.client_input_data[client_slot].first_input == 0 )
-                        {
-                            server.client_input_data[client_slot].first_input = oldest_input_in_packet;
-                        }
-
-                        if ( server.client_adjustment_data[client_slot].first_input == 0 && 
-                             server.client_adjustment_data[client_slot].sequence == packet.adjustment_sequence )
-                        {
-                            server.client_adjustment_data[client_slot].first_input = oldest_input_in_packet;
-                            server.client_adjustment_data[client_slot].num_samples = 0;
-                            server.client_adjustment_data[client_slot].min_ticks_ahead = 0;
-                        }
-
-                        server.client_input_data[client_slot].most_recent_input = packet.tick;
-
-                        for ( int i = 0; i < packet.num_inputs; ++i )
-                        {
-                            uint64_t input_tick = packet.tick - i;
-                            const int index = input_tick % InputSlidingWindowSize;
-                            server.client_input_data[client_slot].inputs[index].tick = input_tick;
-                            server.client_input_data[client_slot].inputs[index].input = packet.input[i];
-                        }
-                    }
+                    server.client_adjustment_data[client_slot].first_input = oldest_input_in_packet;
+                    server.client_adjustment_data[client_slot].num_samples = 0;
+                    server.client_adjustment_data[client_slot].min_ticks_ahead = 0;
                 }
 
-                server.client_time_last_packet_received[client_slot] = server.current_real_time;
+                server.client_input_data[client_slot].most_recent_input = packet.tick;
 
-                return true;
+                for ( int i = 0; i < packet.num_inputs; ++i )
+                {
+                    uint64_t input_tick = packet.tick - i;
+                    const int index = input_tick % InputSlidingWindowSize;
+                    server.client_input_data[client_slot].inputs[index].tick = input_tick;
+                    server.client_input_data[client_slot].inputs[index].input = packet.input[i];
+                }
             }
         }
-        break;
 
-        default:
-            break;
+        server.client_time_last_packet_received[client_slot] = server.current_real_time;
+
+        return true;
     }
 
     return false;
@@ -431,19 +1141,67 @@ bool process_packet( const Address & from, Packet & base_packet, void * context
 
 void server_receive_packets( Server & server )
 {
-    uint8_t buffer[MaxPacketSize];
+    uint8_t * buffer = packet_buffer_alloc( server.packet_buffer_pool );
+    if ( !buffer )
+        return;
+
     while ( true )
     {
         Address from;
-        int bytes_read = server.socket->ReceivePacket( from, buffer, sizeof( buffer ) );
+        int bytes_read = server.socket->ReceivePacket( from, buffer, MaxPacketSize );
         if ( bytes_read == 0 )
             break;
 //        char address_buffer[256];
 //        printf( "received packet from %s\n", from.ToString( address_buffer, sizeof( address_buffer ) ) );
-        read_packet( from, buffer, bytes_read, &server );
+
+#if TELEMETRY
+        const int packet_type = peek_packet_type( buffer, bytes_read );
+        if ( packet_type != -1 )
+            telemetry_packet_received( server.telemetry, server_find_client_slot( server, from ), packet_type, bytes_read );
+#endif // #if TELEMETRY
+
+        // the challenge reply is sent to an address we can't trust yet. never reply with more bytes than the request
+        // sent us, or the server becomes an amplifier for reflection attacks. drop short requests before doing any work
+
+        if ( bytes_read < ConnectionRequestMinBytes && peek_packet_type( buffer, bytes_read ) == PACKET_TYPE_CONNECTION_REQUEST )
+            continue;
+
+        read_packet( server.packet_factory, from, buffer, bytes_read, &server );
     }
+
+    packet_buffer_free( server.packet_buffer_pool, buffer );
+}
+
+#if TELEMETRY
+
+void server_update_telemetry( Server & server, double real_time )
+{
+    telemetry_update( server.telemetry, real_time );
+
+    if ( real_time < server.telemetry_export_time )
+        return;
+
+    server.telemetry_export_time = real_time + TelemetryExportTime;
+
+    // write to a temporary file and rename over the old one, so readers never see a partially written file
+
+    FILE * file = fopen( TELEMETRY_FILE ".tmp", "w" );
+    if ( !file )
+        return;
+
+    bool connected[MaxClients];
+    for ( int i = 0; i < MaxClients; ++i )
+        connected[i] = server.client_state[i] == CLIENT_CONNECTED;
+
+    telemetry_write_json( file, server.telemetry, connected, real_time );
+
+    fclose( file );
+
+    rename( TELEMETRY_FILE ".tmp", TELEMETRY_FILE );
 }
 
+#endif // #if TELEMETRY
+
 void server_get_client_input( Server & server, int client_slot, uint64_t tick, Input * inputs, int num_inputs, double real_time )
 {
     assert( client_slot >= 0 );
@@ -576,20 +1334,32 @@ void server_get_client_input( Server & server, int client_slot, uint64_t tick, I
 void server_free( Server & server )
 {
     printf( "shutting down\n" );
+#if PROFILE_PACKETS
+    packet_profile_print( server.packet_profile, stdout );
+#endif // #if PROFILE_PACKETS
+    job_system_free( *server.jobs );
+    delete server.jobs;
+    delete [] server.client_snapshot_send_data;
+    delete [] server.client_world_block;
+    delete server.snapshot_history;
+    packet_buffer_pool_free( server.packet_buffer_pool );
+    packet_factory_free( server.packet_factory );
     delete server.socket;
     server = Server();
 }
 
-void server_tick( World & world, const Input & input )
+void server_tick( World & world, const Input * inputs )
 {
 //    printf( "%d-%d: %f [%+.4f]\n", (int) world.frame, (int) world.tick, world.time, TickDeltaTime );
 
-    game_process_player_input( world, input, 0 );
+    // one input per client slot. client slot i controls player i
+
+    game_process_player_inputs( world, inputs, MaxClients );
 
     world_tick( world );
 }
 
-void server_frame( World & world, double real_time, double frame_time, double jitter, const Input * inputs )
+void server_frame( World & world, double real_time, double frame_time, double jitter, const Input (*inputs)[MaxClients] )
 {
     //printf( "%d: %f [%+.2fms]\n", (int) frame, real_time, jitter * 1000 );
     
@@ -606,6 +1376,17 @@ void interrupt_handler( int dummy )
     quit = 1;
 }
 
+#if PROFILE_PACKETS
+
+static volatile int print_packet_profile = 0;
+
+void print_packet_profile_handler( int dummy )
+{
+    print_packet_profile = 1;
+}
+
+#endif // #if PROFILE_PACKETS
+
 int server_main( int argc, char ** argv )
 {
     printf( "starting server\n" );
@@ -627,6 +1408,10 @@ int server_main( int argc, char ** argv )
 
     signal( SIGINT, interrupt_handler );
 
+#if PROFILE_PACKETS
+    signal( SIGUSR1, print_packet_profile_handler );
+#endif // #if PROFILE_PACKETS
+
     while ( !quit )
     {
         const double time_to_sleep = max( 0.0, next_frame_time - platform_time() - AverageSleepJitter );
@@ -649,8 +1434,28 @@ int server_main( int argc, char ** argv )
 
         server_send_packets( server, start_of_frame_time );
 
-        Input inputs[TicksPerServerFrame];
-        server_get_client_input( server, 0, world.tick, inputs, TicksPerServerFrame, start_of_frame_time );
+        server_send_world_blocks( server, start_of_frame_time );
+
+#if TELEMETRY
+        server_update_telemetry( server, start_of_frame_time );
+#endif // #if TELEMETRY
+
+#if PROFILE_PACKETS
+        if ( print_packet_profile )
+        {
+            packet_profile_print( server.packet_profile, stdout );
+            print_packet_profile = 0;
+        }
+#endif // #if PROFILE_PACKETS
+
+        Input inputs[TicksPerServerFrame][MaxClients];
+        for ( int i = 0; i < MaxClients; ++i )
+        {
+            Input client_inputs[TicksPerServerFrame];
+            server_get_client_input( server, i, world.tick, client_inputs, TicksPerServerFrame, start_of_frame_time );
+            for ( int j = 0; j < TicksPerServerFrame; ++j )
+                inputs[j][i] = client_inputs[j];
+        }
 
         server_frame( world, real_time, frame_time, jitter, inputs );
 
@@ -4,8 +4,13 @@ in vec3 Position;
 in vec3 Normal;
 in vec4 Color;
 
-uniform vec3 EyePosition;
-uniform vec3 LightPosition;
+layout( std140 ) uniform FrameUniforms
+{
+    mat4 ViewProjection;
+    vec4 EyePosition;
+    vec4 LightPosition;
+};
+
 uniform vec3 LightIntensity = vec3( 1, 1, 1 );
 uniform vec3 Ks = vec3( 0.15, 0.15, 0.15 );
 uniform vec3 Kd = vec3( 0.6, 0.6, 0.6 );
@@ -18,11 +23,11 @@ void main()
 {
     vec3 n = normalize( Normal );
 
-    vec3 e = Position - EyePosition;
+    vec3 e = Position - EyePosition.xyz;
 
     vec3 t = reflect( e, n );
 
-    vec3 s = normalize( LightPosition - Position );
+    vec3 s = normalize( LightPosition.xyz - Position );
 
     vec3 v = normalize( e );
 
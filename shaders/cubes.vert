@@ -1,20 +1,32 @@
 #version 410
 
-in mat4 Model;
-in mat4 ModelView;
-in mat4 ModelViewProjection;
+in vec3 InstancePosition;
+in vec4 InstanceOrientation;
+in float InstanceScale;
 in vec3 VertexPosition;
 in vec3 VertexNormal;
 in vec4 VertexColor;
 
+layout( std140 ) uniform FrameUniforms
+{
+    mat4 ViewProjection;
+    vec4 EyePosition;
+    vec4 LightPosition;
+};
+
 out vec3 Position;
 out vec3 Normal;
 out vec4 Color;
 
+vec3 quat_rotate( vec4 q, vec3 v )
+{
+    return v + 2.0 * cross( q.xyz, cross( q.xyz, v ) + q.w * v );
+}
+
 void main()
 {
-    Normal = mat3( Model ) * VertexNormal;
-    Position = vec3( Model * vec4( VertexPosition, 1.0 ) );
+    Normal = quat_rotate( InstanceOrientation, VertexNormal );
+    Position = InstancePosition + quat_rotate( InstanceOrientation, VertexPosition * InstanceScale );
     Color = VertexColor;
-    gl_Position = ModelViewProjection * vec4( VertexPosition, 1.0 );
+    gl_Position = ViewProjection * vec4( Position, 1.0 );
 }
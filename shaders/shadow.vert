@@ -2,9 +2,14 @@
 
 layout (location = 0) in vec3 VertexPosition;
 
-uniform mat4 ModelViewProjection;
+layout( std140 ) uniform FrameUniforms
+{
+    mat4 ViewProjection;
+    vec4 EyePosition;
+    vec4 LightPosition;
+};
 
 void main()
 {
-    gl_Position = ModelViewProjection * vec4( VertexPosition, 1.0 );
+    gl_Position = ViewProjection * vec4( VertexPosition, 1.0 );
 }
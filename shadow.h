@@ -0,0 +1,293 @@
+// Copyright © 2015, The Network Protocol Company, Inc. All Rights Reserved.
+
+#ifndef SHADOW_H
+#define SHADOW_H
+
+#include "const.h"
+#include "render.h"
+#include "vectorial/simd4f.h"
+#include <assert.h>
+
+// stencil shadow volumes for cubes. each silhouette edge, seen from the light, is extruded down to the ground
+// plane z=0 as a quad of two triangles. a cube has at most six silhouette edges, so 36 vertices at most.
+
+// cube corners and edges. each edge lists the two faces either side of it (+x,-x,+y,-y,+z,-z).
+
+static const float shadow_corners[8][3] =
+{
+    { -1, +1, -1 },
+    { +1, +1, -1 },
+    { +1, +1, +1 },
+    { -1, +1, +1 },
+    { -1, -1, -1 },
+    { +1, -1, -1 },
+    { +1, -1, +1 },
+    { -1, -1, +1 },
+};
+
+struct ShadowEdge
+{
+    int a, b;
+    int left_face, right_face;
+    float nx, ny, nz;                                       // cross( a, b ). the sign of its dot with the local light gives the winding
+};
+
+static const ShadowEdge shadow_edges[12] =
+{
+    { 0, 1, 5, 2,  0, -2, -2 },
+    { 1, 2, 0, 2, +2, -2,  0 },
+    { 2, 3, 4, 2,  0, -2, +2 },
+    { 3, 0, 1, 2, -2, -2,  0 },
+    { 4, 5, 3, 5,  0, -2, +2 },
+    { 5, 6, 3, 0, -2, -2,  0 },
+    { 6, 7, 3, 4,  0, -2, -2 },
+    { 7, 4, 3, 1, +2, -2,  0 },
+    { 0, 4, 1, 5, -2,  0, +2 },
+    { 1, 5, 5, 0, -2,  0, -2 },
+    { 2, 6, 0, 4, +2,  0, -2 },
+    { 3, 7, 4, 1, +2,  0, +2 },
+};
+
+inline void shadow_cube_transform( const RenderCube & cube, mat4f & transform, mat4f & inverse_transform )
+{
+    const mat4f rotation = mat4f::rotation( cube.orientation );
+    transform = mat4f::translation( cube.position ) * rotation * mat4f::scale( cube.scale );
+    inverse_transform = mat4f::scale( 1.0f / cube.scale ) * transpose( rotation ) * mat4f::translation( -cube.position );
+}
+
+inline int generate_shadow_vertices_scalar( const RenderCube * cubes, const int * cube_index, int num_cubes, const vec3f & light_position, vec3f * vertices, int max_vertices )
+{
+    // one cube and one edge at a time. kept as the reference the batched version is checked against.
+
+    int num_vertices = 0;
+
+    for ( int i = 0; i < num_cubes; ++i )
+    {
+        const RenderCube & cube = cubes[cube_index[i]];
+
+        if ( cube.a < ShadowAlphaThreshold )
+            continue;
+
+        if ( num_vertices + MaxShadowVerticesPerCube > max_vertices )
+            break;
+
+        mat4f transform, inverse_transform;
+        shadow_cube_transform( cube, transform, inverse_transform );
+
+        const vec3f local_light = transformPoint( inverse_transform, light_position );
+
+        bool face[6];
+        face[0] = local_light.x() > 0;
+        face[1] = local_light.x() < 0;
+        face[2] = local_light.y() > 0;
+        face[3] = local_light.y() < 0;
+        face[4] = local_light.z() > 0;
+        face[5] = local_light.z() < 0;
+
+        for ( int j = 0; j < 12; ++j )
+        {
+            const ShadowEdge & edge = shadow_edges[j];
+
+            if ( face[edge.left_face] == face[edge.right_face] )
+                continue;
+
+            vec3f a( shadow_corners[edge.a][0], shadow_corners[edge.a][1], shadow_corners[edge.a][2] );
+            vec3f b( shadow_corners[edge.b][0], shadow_corners[edge.b][1], shadow_corners[edge.b][2] );
+
+            if ( dot( cross( b - a, local_light ), a ) < 0 )
+            {
+                vec3f tmp = a;
+                a = b;
+                b = tmp;
+            }
+
+            const vec3f world_a = transformPoint( transform, a );
+            const vec3f world_b = transformPoint( transform, b );
+
+            const vec3f difference_a = world_a - light_position;
+            const vec3f difference_b = world_b - light_position;
+
+            const vec3f extruded_a = light_position - difference_a * ( light_position.z() / difference_a.z() );
+            const vec3f extruded_b = light_position - difference_b * ( light_position.z() / difference_b.z() );
+
+            vertices[num_vertices]   = world_b;
+            vertices[num_vertices+1] = world_a;
+            vertices[num_vertices+2] = extruded_a;
+            vertices[num_vertices+3] = world_b;
+            vertices[num_vertices+4] = extruded_a;
+            vertices[num_vertices+5] = extruded_b;
+
+            num_vertices += 6;
+        }
+    }
+
+    return num_vertices;
+}
+
+inline int generate_shadow_vertices( const RenderCube * cubes, const int * cube_index, int num_cubes, const vec3f & light_position, vec3f * vertices, int max_vertices )
+{
+    // four cubes per iteration, structure of arrays. face and winding tests become 4 bit lane masks, so silhouette
+    // edges for all four cubes are found with a few integer ops, and only those edges are written out.
+
+    assert( num_cubes <= MaxCubes );
+
+    int caster[MaxCubes];
+    int num_casters = 0;
+
+    for ( int i = 0; i < num_cubes; ++i )
+    {
+        if ( cubes[cube_index[i]].a >= ShadowAlphaThreshold )
+            caster[num_casters++] = cube_index[i];
+    }
+
+    const simd4f light_x = simd4f_splat( light_position.x() );
+    const simd4f light_y = simd4f_splat( light_position.y() );
+    const simd4f light_z = simd4f_splat( light_position.z() );
+
+    const simd4f zero = simd4f_zero();
+    const simd4f one = simd4f_splat( 1.0f );
+    const simd4f two = simd4f_splat( 2.0f );
+
+    int num_vertices = 0;
+
+    for ( int i = 0; i < num_casters; i += 4 )
+    {
+        if ( num_vertices + 4 * MaxShadowVerticesPerCube > max_vertices )
+            break;
+
+        // gather up to four cubes. missing lanes repeat the last cube and are masked out of the output
+
+        const int num_lanes = min( 4, num_casters - i );
+
+        const RenderCube * cube[4];
+        for ( int j = 0; j < 4; ++j )
+            cube[j] = &cubes[caster[i + min( j, num_lanes - 1 )]];
+
+        const int lane_mask = ( 1 << num_lanes ) - 1;
+
+        const simd4f px = simd4f_create( cube[0]->position.x(), cube[1]->position.x(), cube[2]->position.x(), cube[3]->position.x() );
+        const simd4f py = simd4f_create( cube[0]->position.y(), cube[1]->position.y(), cube[2]->position.y(), cube[3]->position.y() );
+        const simd4f pz = simd4f_create( cube[0]->position.z(), cube[1]->position.z(), cube[2]->position.z(), cube[3]->position.z() );
+
+        const simd4f qx = simd4f_create( cube[0]->orientation.x(), cube[1]->orientation.x(), cube[2]->orientation.x(), cube[3]->orientation.x() );
+        const simd4f qy = simd4f_create( cube[0]->orientation.y(), cube[1]->orientation.y(), cube[2]->orientation.y(), cube[3]->orientation.y() );
+        const simd4f qz = simd4f_create( cube[0]->orientation.z(), cube[1]->orientation.z(), cube[2]->orientation.z(), cube[3]->orientation.z() );
+        const simd4f qw = simd4f_create( cube[0]->orientation.w(), cube[1]->orientation.w(), cube[2]->orientation.w(), cube[3]->orientation.w() );
+
+        const simd4f scale = simd4f_create( cube[0]->scale, cube[1]->scale, cube[2]->scale, cube[3]->scale );
+
+        // rotation matrix columns, same as mat4f::rotation
+
+        const simd4f xx = simd4f_mul( qx, qx ), yy = simd4f_mul( qy, qy ), zz = simd4f_mul( qz, qz );
+        const simd4f xy = simd4f_mul( qx, qy ), xz = simd4f_mul( qx, qz ), yz = simd4f_mul( qy, qz );
+        const simd4f wx = simd4f_mul( qw, qx ), wy = simd4f_mul( qw, qy ), wz = simd4f_mul( qw, qz );
+
+        const simd4f r0x = simd4f_sub( one, simd4f_mul( two, simd4f_add( yy, zz ) ) );
+        const simd4f r0y = simd4f_mul( two, simd4f_add( xy, wz ) );
+        const simd4f r0z = simd4f_mul( two, simd4f_sub( xz, wy ) );
+
+        const simd4f r1x = simd4f_mul( two, simd4f_sub( xy, wz ) );
+        const simd4f r1y = simd4f_sub( one, simd4f_mul( two, simd4f_add( xx, zz ) ) );
+        const simd4f r1z = simd4f_mul( two, simd4f_add( yz, wx ) );
+
+        const simd4f r2x = simd4f_mul( two, simd4f_add( xz, wy ) );
+        const simd4f r2y = simd4f_mul( two, simd4f_sub( yz, wx ) );
+        const simd4f r2z = simd4f_sub( one, simd4f_mul( two, simd4f_add( xx, yy ) ) );
+
+        // light in cube local space. scale is uniform and positive, so it can be left out of the sign tests below
+
+        const simd4f dx = simd4f_sub( light_x, px );
+        const simd4f dy = simd4f_sub( light_y, py );
+        const simd4f dz = simd4f_sub( light_z, pz );
+
+        const simd4f lx = simd4f_add( simd4f_add( simd4f_mul( r0x, dx ), simd4f_mul( r0y, dy ) ), simd4f_mul( r0z, dz ) );
+        const simd4f ly = simd4f_add( simd4f_add( simd4f_mul( r1x, dx ), simd4f_mul( r1y, dy ) ), simd4f_mul( r1z, dz ) );
+        const simd4f lz = simd4f_add( simd4f_add( simd4f_mul( r2x, dx ), simd4f_mul( r2y, dy ) ), simd4f_mul( r2z, dz ) );
+
+        int face[6];
+        face[0] = simd4f_movemask( simd4f_cmpgt( lx, zero ) );
+        face[1] = simd4f_movemask( simd4f_cmplt( lx, zero ) );
+        face[2] = simd4f_movemask( simd4f_cmpgt( ly, zero ) );
+        face[3] = simd4f_movemask( simd4f_cmplt( ly, zero ) );
+        face[4] = simd4f_movemask( simd4f_cmpgt( lz, zero ) );
+        face[5] = simd4f_movemask( simd4f_cmplt( lz, zero ) );
+
+        // world space corners and their extrusions to the ground plane
+
+        const simd4f ux = simd4f_mul( r0x, scale ), uy = simd4f_mul( r0y, scale ), uz = simd4f_mul( r0z, scale );
+        const simd4f vx = simd4f_mul( r1x, scale ), vy = simd4f_mul( r1y, scale ), vz = simd4f_mul( r1z, scale );
+        const simd4f tx = simd4f_mul( r2x, scale ), ty = simd4f_mul( r2y, scale ), tz = simd4f_mul( r2z, scale );
+
+        float world[8][3][4];
+        float extruded[8][3][4];
+
+        for ( int j = 0; j < 8; ++j )
+        {
+            const simd4f cx = simd4f_splat( shadow_corners[j][0] );
+            const simd4f cy = simd4f_splat( shadow_corners[j][1] );
+            const simd4f cz = simd4f_splat( shadow_corners[j][2] );
+
+            const simd4f world_x = simd4f_add( px, simd4f_add( simd4f_add( simd4f_mul( cx, ux ), simd4f_mul( cy, vx ) ), simd4f_mul( cz, tx ) ) );
+            const simd4f world_y = simd4f_add( py, simd4f_add( simd4f_add( simd4f_mul( cx, uy ), simd4f_mul( cy, vy ) ), simd4f_mul( cz, ty ) ) );
+            const simd4f world_z = simd4f_add( pz, simd4f_add( simd4f_add( simd4f_mul( cx, uz ), simd4f_mul( cy, vz ) ), simd4f_mul( cz, tz ) ) );
+
+            const simd4f ex = simd4f_sub( world_x, light_x );
+            const simd4f ey = simd4f_sub( world_y, light_y );
+            const simd4f ez = simd4f_sub( world_z, light_z );
+
+            const simd4f t = simd4f_div( light_z, ez );
+
+            simd4f_ustore4( world_x, world[j][0] );
+            simd4f_ustore4( world_y, world[j][1] );
+            simd4f_ustore4( world_z, world[j][2] );
+
+            simd4f_ustore4( simd4f_sub( light_x, simd4f_mul( ex, t ) ), extruded[j][0] );
+            simd4f_ustore4( simd4f_sub( light_y, simd4f_mul( ey, t ) ), extruded[j][1] );
+            simd4f_ustore4( simd4f_sub( light_z, simd4f_mul( ez, t ) ), extruded[j][2] );
+        }
+
+        // write out quads for silhouette edges only
+
+        for ( int j = 0; j < 12; ++j )
+        {
+            const ShadowEdge & edge = shadow_edges[j];
+
+            int silhouette = ( face[edge.left_face] ^ face[edge.right_face] ) & lane_mask;
+            if ( !silhouette )
+                continue;
+
+            const simd4f winding = simd4f_add( simd4f_add( simd4f_mul( simd4f_splat( edge.nx ), lx ), simd4f_mul( simd4f_splat( edge.ny ), ly ) ), simd4f_mul( simd4f_splat( edge.nz ), lz ) );
+
+            const int swap = simd4f_movemask( simd4f_cmplt( winding, zero ) );
+
+            while ( silhouette )
+            {
+                const int lane = __builtin_ctz( silhouette );
+                silhouette &= silhouette - 1;
+
+                const int a = ( swap & ( 1 << lane ) ) ? edge.b : edge.a;
+                const int b = ( swap & ( 1 << lane ) ) ? edge.a : edge.b;
+
+                const vec3f world_a( world[a][0][lane], world[a][1][lane], world[a][2][lane] );
+                const vec3f world_b( world[b][0][lane], world[b][1][lane], world[b][2][lane] );
+                const vec3f extruded_a( extruded[a][0][lane], extruded[a][1][lane], extruded[a][2][lane] );
+                const vec3f extruded_b( extruded[b][0][lane], extruded[b][1][lane], extruded[b][2][lane] );
+
+                vertices[num_vertices]   = world_b;
+                vertices[num_vertices+1] = world_a;
+                vertices[num_vertices+2] = extruded_a;
+                vertices[num_vertices+3] = world_b;
+                vertices[num_vertices+4] = extruded_a;
+                vertices[num_vertices+5] = extruded_b;
+
+                num_vertices += 6;
+            }
+        }
+    }
+
+    assert( num_vertices <= max_vertices );
+
+    return num_vertices;
+}
+
+#endif // #ifndef SHADOW_H
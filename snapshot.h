@@ -4,6 +4,20 @@
 #define SNAPSHOT_H
 
 #include "protocol.h"
+#include "vectorial/vec3f.h"
+#include "vectorial/quat4f.h"
+#include "vectorial/simd4f.h"
+#include "vectorial/simd4i.h"
+
+using namespace vectorial;
+
+struct CubeState
+{
+    vec3f position;
+    quat4f orientation;
+    vec3f linear_velocity;
+    vec3f angular_velocity;
+};
 
 template <typename Stream> void serialize_unsigned_range( Stream & stream, uint32_t & value, int num_ranges, const int * range_bits )
 {
@@ -45,6 +59,7 @@ template <typename Stream> void serialize_relative_position( Stream & stream,
 {
     bool all_small;
     bool too_large;
+    bool absolute;
     uint32_t dx,dy,dz;
 
     const int range_bits[] = { 5, 6, 7 };
@@ -62,6 +77,7 @@ template <typename Stream> void serialize_relative_position( Stream & stream,
         dz = signed_to_unsigned( position_z - base_position_z );
         all_small = dx <= small_limit && dy <= small_limit && dz <= small_limit;
         too_large = dx >= large_limit || dy >= large_limit || dz >= large_limit;
+        absolute = dx > max_delta || dy > max_delta || dz > max_delta;
     }
 
     serialize_bool( stream, all_small );
@@ -84,6 +100,18 @@ template <typename Stream> void serialize_relative_position( Stream & stream,
         }
         else
         {
+            // deltas against an old baseline can be larger than max delta. send the absolute position instead
+
+            serialize_bool( stream, absolute );
+
+            if ( absolute )
+            {
+                serialize_int( stream, position_x, -QuantizedPositionBoundXY, QuantizedPositionBoundXY );
+                serialize_int( stream, position_y, -QuantizedPositionBoundXY, QuantizedPositionBoundXY );
+                serialize_int( stream, position_z, 0, QuantizedPositionBoundZ );
+                return;
+            }
+
             serialize_int( stream, dx, 0, max_delta );
             serialize_int( stream, dy, 0, max_delta );            
             serialize_int( stream, dz, 0, max_delta );            
@@ -293,6 +321,19 @@ template <int bits> struct compressed_quaternion
         }
     }
 
+    uint32_t GetPacked() const
+    {
+        return largest | ( integer_a << 2 ) | ( integer_b << ( 2 + bits ) ) | ( integer_c << ( 2 + bits * 2 ) );
+    }
+
+    void SetPacked( uint32_t packed )
+    {
+        largest = packed & 3;
+        integer_a = ( packed >> 2 ) & max_value;
+        integer_b = ( packed >> ( 2 + bits ) ) & max_value;
+        integer_c = ( packed >> ( 2 + bits * 2 ) ) & max_value;
+    }
+
     SERIALIZE_OBJECT( stream )
     {
         serialize_bits( stream, largest, 2 );
@@ -360,19 +401,207 @@ struct QuantizedCubeState
     }
 };
 
-struct QuantizedSnapshot
+inline void quantize_cube_state( const CubeState & cube, bool interacting, QuantizedCubeState & quantized )
 {
-    QuantizedCubeState cubes[NumCubes];
+    quantized.interacting = interacting;
 
-    bool operator == ( const QuantizedSnapshot & other ) const
+    quantized.position_x = clamp( (int) floor( cube.position.x() * UnitsPerMeter + 0.5f ), -QuantizedPositionBoundXY, QuantizedPositionBoundXY );
+    quantized.position_y = clamp( (int) floor( cube.position.y() * UnitsPerMeter + 0.5f ), -QuantizedPositionBoundXY, QuantizedPositionBoundXY );
+    quantized.position_z = clamp( (int) floor( cube.position.z() * UnitsPerMeter + 0.5f ), 0, QuantizedPositionBoundZ );
+
+    quantized.orientation.Load( cube.orientation.x(), cube.orientation.y(), cube.orientation.z(), cube.orientation.w() );
+}
+
+struct CubeStateBatch
+{
+    // structure of arrays so cube state can be quantized four cubes at a time
+
+    int num_cubes;
+    bool interacting[MaxCubes];
+    float position_x[MaxCubes];
+    float position_y[MaxCubes];
+    float position_z[MaxCubes];
+    float orientation_x[MaxCubes];
+    float orientation_y[MaxCubes];
+    float orientation_z[MaxCubes];
+    float orientation_w[MaxCubes];
+};
+
+inline void cube_state_batch_add( CubeStateBatch & batch, const CubeState & cube, bool interacting )
+{
+    assert( batch.num_cubes < MaxCubes );
+    const int i = batch.num_cubes++;
+    batch.interacting[i] = interacting;
+    batch.position_x[i] = cube.position.x();
+    batch.position_y[i] = cube.position.y();
+    batch.position_z[i] = cube.position.z();
+    batch.orientation_x[i] = cube.orientation.x();
+    batch.orientation_y[i] = cube.orientation.y();
+    batch.orientation_z[i] = cube.orientation.z();
+    batch.orientation_w[i] = cube.orientation.w();
+}
+
+inline void quantize_cube_batch( const CubeStateBatch & batch, QuantizedCubeState * quantized )
+{
+    // same results as quantize_cube_state, but four cubes per-iteration with the largest
+    // quaternion component selected with compares and masks instead of branches
+
+    const float minimum = - 1.0f / 1.414214f;
+    const float maximum = + 1.0f / 1.414214f;
+    const float scale = float( ( 1 << OrientationBits ) - 1 );
+
+    const simd4f units_per_meter = simd4f_splat( UnitsPerMeter );
+    const simd4f half = simd4f_splat( 0.5f );
+    const simd4f zero = simd4f_zero();
+    const simd4f bound_xy = simd4f_splat( QuantizedPositionBoundXY );
+    const simd4f bound_z = simd4f_splat( QuantizedPositionBoundZ );
+    const simd4f orientation_minimum = simd4f_splat( minimum );
+    const simd4f orientation_range = simd4f_splat( maximum - minimum );
+    const simd4f orientation_scale = simd4f_splat( scale );
+    const simd4f one = simd4f_splat( 1.0f );
+    const simd4f two = simd4f_splat( 2.0f );
+    const simd4f three = simd4f_splat( 3.0f );
+
+    const int num_batched = batch.num_cubes & ~3;
+
+    for ( int i = 0; i < num_batched; i += 4 )
     {
-        for ( int i = 0; i < NumCubes; ++i )
+        // position
+
+        simd4f position_x = simd4f_floor( simd4f_add( simd4f_mul( simd4f_uload4( batch.position_x + i ), units_per_meter ), half ) );
+        simd4f position_y = simd4f_floor( simd4f_add( simd4f_mul( simd4f_uload4( batch.position_y + i ), units_per_meter ), half ) );
+        simd4f position_z = simd4f_floor( simd4f_add( simd4f_mul( simd4f_uload4( batch.position_z + i ), units_per_meter ), half ) );
+
+        position_x = simd4f_min( simd4f_max( position_x, simd4f_sub( zero, bound_xy ) ), bound_xy );
+        position_y = simd4f_min( simd4f_max( position_y, simd4f_sub( zero, bound_xy ) ), bound_xy );
+        position_z = simd4f_min( simd4f_max( position_z, zero ), bound_z );
+
+        // orientation: find the largest component. ties go to the earlier component, like the scalar version
+
+        const simd4f x = simd4f_uload4( batch.orientation_x + i );
+        const simd4f y = simd4f_uload4( batch.orientation_y + i );
+        const simd4f z = simd4f_uload4( batch.orientation_z + i );
+        const simd4f w = simd4f_uload4( batch.orientation_w + i );
+
+        simd4f largest = zero;
+        simd4f largest_value = simd4f_abs( x );
+        simd4f largest_signed = x;
+
+        simd4f mask = simd4f_cmpgt( simd4f_abs( y ), largest_value );
+        largest = simd4f_select( mask, one, largest );
+        largest_value = simd4f_max( largest_value, simd4f_abs( y ) );
+        largest_signed = simd4f_select( mask, y, largest_signed );
+
+        mask = simd4f_cmpgt( simd4f_abs( z ), largest_value );
+        largest = simd4f_select( mask, two, largest );
+        largest_value = simd4f_max( largest_value, simd4f_abs( z ) );
+        largest_signed = simd4f_select( mask, z, largest_signed );
+
+        mask = simd4f_cmpgt( simd4f_abs( w ), largest_value );
+        largest = simd4f_select( mask, three, largest );
+        largest_signed = simd4f_select( mask, w, largest_signed );
+
+        // the three smallest components in order, skipping the largest
+
+        simd4f a = simd4f_select( simd4f_cmplt( largest, one ), y, x );
+        simd4f b = simd4f_select( simd4f_cmplt( largest, two ), z, y );
+        simd4f c = simd4f_select( simd4f_cmplt( largest, three ), w, z );
+
+        // negate so the largest component is positive and can be reconstructed from the other three
+
+        const simd4f negate = simd4f_cmplt( largest_signed, zero );
+        a = simd4f_select( negate, simd4f_sub( zero, a ), a );
+        b = simd4f_select( negate, simd4f_sub( zero, b ), b );
+        c = simd4f_select( negate, simd4f_sub( zero, c ), c );
+
+        a = simd4f_floor( simd4f_add( simd4f_mul( simd4f_div( simd4f_sub( a, orientation_minimum ), orientation_range ), orientation_scale ), half ) );
+        b = simd4f_floor( simd4f_add( simd4f_mul( simd4f_div( simd4f_sub( b, orientation_minimum ), orientation_range ), orientation_scale ), half ) );
+        c = simd4f_floor( simd4f_add( simd4f_mul( simd4f_div( simd4f_sub( c, orientation_minimum ), orientation_range ), orientation_scale ), half ) );
+
+        a = simd4f_min( simd4f_max( a, zero ), orientation_scale );
+        b = simd4f_min( simd4f_max( b, zero ), orientation_scale );
+        c = simd4f_min( simd4f_max( c, zero ), orientation_scale );
+
+        float values[7][4];
+        simd4f_ustore4( position_x, values[0] );
+        simd4f_ustore4( position_y, values[1] );
+        simd4f_ustore4( position_z, values[2] );
+        simd4f_ustore4( largest, values[3] );
+        simd4f_ustore4( a, values[4] );
+        simd4f_ustore4( b, values[5] );
+        simd4f_ustore4( c, values[6] );
+
+        for ( int j = 0; j < 4; ++j )
         {
-            if ( cubes[i] != other.cubes[i] )
-                return false;
+            QuantizedCubeState & cube = quantized[i+j];
+            cube.interacting = batch.interacting[i+j];
+            cube.position_x = (int) values[0][j];
+            cube.position_y = (int) values[1][j];
+            cube.position_z = (int) values[2][j];
+            cube.orientation.largest = (uint32_t) values[3][j];
+            cube.orientation.integer_a = (uint32_t) values[4][j];
+            cube.orientation.integer_b = (uint32_t) values[5][j];
+            cube.orientation.integer_c = (uint32_t) values[6][j];
         }
+    }
 
-        return true;
+    // leftover cubes that don't fill a group of four
+
+    for ( int i = num_batched; i < batch.num_cubes; ++i )
+    {
+        CubeState cube;
+        cube.position = vec3f( batch.position_x[i], batch.position_y[i], batch.position_z[i] );
+        cube.orientation = quat4f( batch.orientation_x[i], batch.orientation_y[i], batch.orientation_z[i], batch.orientation_w[i] );
+        quantize_cube_state( cube, batch.interacting[i], quantized[i] );
+    }
+}
+
+inline void dequantize_cube_state( const QuantizedCubeState & quantized, CubeState & cube )
+{
+    const float inverse_units_per_meter = 1.0f / UnitsPerMeter;
+
+    cube.position = vec3f( quantized.position_x, quantized.position_y, quantized.position_z ) * inverse_units_per_meter;
+
+    float x,y,z,w;
+    quantized.orientation.Save( x, y, z, w );
+    cube.orientation = normalize( quat4f( x, y, z, w ) );
+}
+
+struct QuantizedSnapshot
+{
+    // structure of arrays so changed cubes and position predictions can be calculated four cubes at a time
+
+    int interacting[MaxCubes];
+    int position_x[MaxCubes];
+    int position_y[MaxCubes];
+    int position_z[MaxCubes];
+    uint32_t orientation[MaxCubes];                     // compressed_quaternion<OrientationBits>::GetPacked
+
+    void GetCube( int index, QuantizedCubeState & cube ) const
+    {
+        assert( index >= 0 );
+        assert( index < MaxCubes );
+        cube.interacting = interacting[index] != 0;
+        cube.position_x = position_x[index];
+        cube.position_y = position_y[index];
+        cube.position_z = position_z[index];
+        cube.orientation.SetPacked( orientation[index] );
+    }
+
+    void SetCube( int index, const QuantizedCubeState & cube )
+    {
+        assert( index >= 0 );
+        assert( index < MaxCubes );
+        interacting[index] = cube.interacting ? 1 : 0;
+        position_x[index] = cube.position_x;
+        position_y[index] = cube.position_y;
+        position_z[index] = cube.position_z;
+        orientation[index] = cube.orientation.GetPacked();
+    }
+
+    bool operator == ( const QuantizedSnapshot & other ) const
+    {
+        return memcmp( this, &other, sizeof( QuantizedSnapshot ) ) == 0;
     }
 
     bool operator != ( const QuantizedSnapshot & other ) const
@@ -381,6 +610,43 @@ struct QuantizedSnapshot
     }
 };
 
+static_assert( MaxCubes % 32 == 0, "changed mask is processed 32 cubes per-word" );
+
+struct SnapshotHistory
+{
+    int next_entry;
+    bool valid[SnapshotHistorySize];
+    uint64_t tick[SnapshotHistorySize];
+    QuantizedSnapshot snapshots[SnapshotHistorySize];
+};
+
+inline void snapshot_history_reset( SnapshotHistory & history )
+{
+    history.next_entry = 0;
+    memset( history.valid, 0, sizeof( history.valid ) );
+}
+
+inline QuantizedSnapshot & snapshot_history_insert( SnapshotHistory & history, uint64_t tick )
+{
+    assert( tick > 0 );
+    const int index = history.next_entry;
+    history.next_entry = ( history.next_entry + 1 ) % SnapshotHistorySize;
+    history.valid[index] = true;
+    history.tick[index] = tick;
+    return history.snapshots[index];
+}
+
+inline QuantizedSnapshot * snapshot_history_find( SnapshotHistory & history, uint64_t tick )
+{
+    for ( int i = 0; i < SnapshotHistorySize; ++i )
+    {
+        if ( history.valid[i] && history.tick[i] == tick )
+            return &history.snapshots[i];
+    }
+
+    return nullptr;
+}
+
 template <typename Stream> void serialize_relative_orientation( Stream & stream, 
                                                                 compressed_quaternion<OrientationBits> & orientation, 
                                                                 const compressed_quaternion<OrientationBits> & base_orientation )
@@ -443,69 +709,169 @@ template <typename Stream> void serialize_relative_orientation( Stream & stream,
     }
 }
 
-template <typename Stream> void serialize_cube_relative_to_base( Stream & stream, QuantizedCubeState & cube, const QuantizedCubeState & base, int base_dx, int base_dy, int base_dz )
+struct CompressionState
 {
-    serialize_bool( stream, cube.interacting );
-
-    bool position_changed;
+    int delta_x[MaxCubes];
+    int delta_y[MaxCubes];
+    int delta_z[MaxCubes];
+};
 
-    if ( Stream::IsWriting )
-        position_changed = cube.position_x != base.position_x || cube.position_y != base.position_y || cube.position_z != base.position_z;
+struct SnapshotPrediction
+{
+    int position_x[MaxCubes];
+    int position_y[MaxCubes];
+    int position_z[MaxCubes];
+};
 
-    serialize_bool( stream, position_changed );
+struct SnapshotChanges
+{
+    int num_changed;
+    uint32_t changed[MaxCubes/32];                      // bit per-cube, set if the cube differs from the baseline
+};
 
-    if ( position_changed )
+inline void calculate_compression_state( CompressionState & compression_state, const QuantizedSnapshot & current_snapshot, const QuantizedSnapshot & baseline_snapshot )
+{
+    for ( int i = 0; i < MaxCubes; i += 4 )
     {
-        const int gravity = 3;
-        const int ground_limit = 105;
+        simd4i_ustore4( simd4i_sub( simd4i_uload4( current_snapshot.position_x + i ), simd4i_uload4( baseline_snapshot.position_x + i ) ), compression_state.delta_x + i );
+        simd4i_ustore4( simd4i_sub( simd4i_uload4( current_snapshot.position_y + i ), simd4i_uload4( baseline_snapshot.position_y + i ) ), compression_state.delta_y + i );
+        simd4i_ustore4( simd4i_sub( simd4i_uload4( current_snapshot.position_z + i ), simd4i_uload4( baseline_snapshot.position_z + i ) ), compression_state.delta_z + i );
+    }
+}
 
-        const int drag_x = - ceil( base_dx * 0.062f );
-        const int drag_y = - ceil( base_dy * 0.062f );
-        const int drag_z = - ceil( base_dz * 0.062f );
+inline void predict_positions( const QuantizedSnapshot & baseline_snapshot, const CompressionState & compression_state, SnapshotPrediction & prediction, int i )
+{
+    // estimate where the cube is now from where it was in the baseline, the delta it moved last time, drag and gravity.
+    // drag is -ceil( delta * 0.062 ), which is floor( delta * -0.062 ).
 
-        const int position_estimate_x = base.position_x + base_dx + drag_x;
-        const int position_estimate_y = base.position_y + base_dy + drag_y;
-        const int position_estimate_z = max( base.position_z + base_dz - gravity + drag_z, ground_limit );
+    const simd4i gravity = simd4i_splat( 3 );
+    const simd4i ground_limit = simd4i_splat( 105 );
+    const simd4f drag = simd4f_splat( -0.062f );
 
-        serialize_relative_position( stream, cube.position_x, cube.position_y, cube.position_z, position_estimate_x, position_estimate_y, position_estimate_z );
-    }
-    else if ( Stream::IsReading )
+    const simd4i delta_x = simd4i_uload4( compression_state.delta_x + i );
+    const simd4i delta_y = simd4i_uload4( compression_state.delta_y + i );
+    const simd4i delta_z = simd4i_uload4( compression_state.delta_z + i );
+
+    const simd4i drag_x = simd4f_to_simd4i( simd4f_floor( simd4f_mul( simd4i_to_simd4f( delta_x ), drag ) ) );
+    const simd4i drag_y = simd4f_to_simd4i( simd4f_floor( simd4f_mul( simd4i_to_simd4f( delta_y ), drag ) ) );
+    const simd4i drag_z = simd4f_to_simd4i( simd4f_floor( simd4f_mul( simd4i_to_simd4f( delta_z ), drag ) ) );
+
+    const simd4i estimate_x = simd4i_add( simd4i_add( simd4i_uload4( baseline_snapshot.position_x + i ), delta_x ), drag_x );
+    const simd4i estimate_y = simd4i_add( simd4i_add( simd4i_uload4( baseline_snapshot.position_y + i ), delta_y ), drag_y );
+    const simd4i estimate_z = simd4i_add( simd4i_sub( simd4i_add( simd4i_uload4( baseline_snapshot.position_z + i ), delta_z ), gravity ), drag_z );
+
+    simd4i_ustore4( estimate_x, prediction.position_x + i );
+    simd4i_ustore4( estimate_y, prediction.position_y + i );
+    simd4i_ustore4( simd4i_max( estimate_z, ground_limit ), prediction.position_z + i );
+}
+
+inline void predict_snapshot( const QuantizedSnapshot & baseline_snapshot, const CompressionState & compression_state, SnapshotPrediction & prediction )
+{
+    for ( int i = 0; i < MaxCubes; i += 4 )
+        predict_positions( baseline_snapshot, compression_state, prediction, i );
+}
+
+inline void calculate_snapshot_changes( const QuantizedSnapshot & current_snapshot, 
+                                        const QuantizedSnapshot & baseline_snapshot, 
+                                        const CompressionState & compression_state, 
+                                        SnapshotChanges & changes, 
+                                        SnapshotPrediction & prediction )
+{
+    // one pass over the snapshot: compare four cubes at a time against the baseline to build the changed bitmask,
+    // and predict positions for the same four cubes while they are in cache.
+
+    changes.num_changed = 0;
+
+    for ( int i = 0; i < MaxCubes; i += 32 )
     {
-        cube.position_x = base.position_x;
-        cube.position_y = base.position_y;
-        cube.position_z = base.position_z;
-    }
+        uint32_t changed = 0;
+
+        for ( int j = 0; j < 32; j += 4 )
+        {
+            const int index = i + j;
+
+            simd4i same = simd4i_cmpeq( simd4i_uload4( current_snapshot.interacting + index ), simd4i_uload4( baseline_snapshot.interacting + index ) );
+            same = simd4i_and( same, simd4i_cmpeq( simd4i_uload4( current_snapshot.position_x + index ), simd4i_uload4( baseline_snapshot.position_x + index ) ) );
+            same = simd4i_and( same, simd4i_cmpeq( simd4i_uload4( current_snapshot.position_y + index ), simd4i_uload4( baseline_snapshot.position_y + index ) ) );
+            same = simd4i_and( same, simd4i_cmpeq( simd4i_uload4( current_snapshot.position_z + index ), simd4i_uload4( baseline_snapshot.position_z + index ) ) );
+            same = simd4i_and( same, simd4i_cmpeq( simd4i_uload4( (const int32_t*) current_snapshot.orientation + index ), simd4i_uload4( (const int32_t*) baseline_snapshot.orientation + index ) ) );
+
+            changed |= uint32_t( ~simd4i_movemask( same ) & 0xF ) << j;
+
+            predict_positions( baseline_snapshot, compression_state, prediction, index );
+        }
 
-    serialize_relative_orientation( stream, cube.orientation, base.orientation );
+        changes.changed[i/32] = changed;
+        changes.num_changed += popcount( changed );
+    }
 }
 
-struct CompressionState
+inline bool snapshot_cube_changed( const SnapshotChanges & changes, int index )
 {
-    float delta_x[NumCubes];
-    float delta_y[NumCubes];
-    float delta_z[NumCubes];
-};
+    return ( changes.changed[index/32] >> ( index % 32 ) ) & 1;
+}
 
-void calculate_compression_state( CompressionState & compression_state, QuantizedSnapshot & current_snapshot, QuantizedSnapshot & baseline_snapshot )
+template <typename Stream> void serialize_cube_relative_to_base( Stream & stream, 
+                                                                 QuantizedSnapshot & current_snapshot, 
+                                                                 const QuantizedSnapshot & baseline_snapshot, 
+                                                                 const SnapshotPrediction & prediction, 
+                                                                 int index )
 {
-    for ( int i = 0; i < NumCubes; ++i )
+    // categories reset the entropy coder context per-field group. they cost nothing for other streams
+
+    serialize_category( stream, PACKET_CATEGORY_POSITION );
+
+    serialize_bool( stream, current_snapshot.interacting[index] );
+
+    bool position_changed;
+
+    if ( Stream::IsWriting )
+        position_changed = current_snapshot.position_x[index] != baseline_snapshot.position_x[index] || 
+                           current_snapshot.position_y[index] != baseline_snapshot.position_y[index] || 
+                           current_snapshot.position_z[index] != baseline_snapshot.position_z[index];
+
+    serialize_bool( stream, position_changed );
+
+    if ( position_changed )
+    {
+        serialize_relative_position( stream, 
+                                     current_snapshot.position_x[index], 
+                                     current_snapshot.position_y[index], 
+                                     current_snapshot.position_z[index], 
+                                     prediction.position_x[index], 
+                                     prediction.position_y[index], 
+                                     prediction.position_z[index] );
+    }
+    else if ( Stream::IsReading )
     {
-        compression_state.delta_x[i] = current_snapshot.cubes[i].position_x - baseline_snapshot.cubes[i].position_x;
-        compression_state.delta_y[i] = current_snapshot.cubes[i].position_y - baseline_snapshot.cubes[i].position_y;
-        compression_state.delta_z[i] = current_snapshot.cubes[i].position_z - baseline_snapshot.cubes[i].position_z;
+        current_snapshot.position_x[index] = baseline_snapshot.position_x[index];
+        current_snapshot.position_y[index] = baseline_snapshot.position_y[index];
+        current_snapshot.position_z[index] = baseline_snapshot.position_z[index];
     }
+
+    compressed_quaternion<OrientationBits> orientation;
+    compressed_quaternion<OrientationBits> base_orientation;
+    orientation.SetPacked( current_snapshot.orientation[index] );
+    base_orientation.SetPacked( baseline_snapshot.orientation[index] );
+
+    serialize_category( stream, PACKET_CATEGORY_ORIENTATION );
+
+    serialize_relative_orientation( stream, orientation, base_orientation );
+
+    if ( Stream::IsReading )
+        current_snapshot.orientation[index] = orientation.GetPacked();
 }
 
-inline int count_relative_index_bits( bool * changed )
+inline int count_relative_index_bits( const SnapshotChanges & changes )
 {
     int bits = 8;           // 0..255 num changed
     bool first = true;
     int previous_index = 0;
 
-    for ( int i = 0; i < NumCubes; ++i )
+    for ( int word = 0; word < MaxCubes / 32; ++word )
+    for ( uint32_t changed = changes.changed[word]; changed; changed &= changed - 1 )
     {
-        if ( !changed[i] )
-            continue;
+        const int i = word * 32 + __builtin_ctz( changed );
 
         if ( first )
         {
@@ -645,60 +1011,73 @@ template <typename Stream> void serialize_relative_index( Stream & stream, int p
         return;
     }
 
-    // [127,NumCubes]
+    // [127,MaxCubes]
 
-    serialize_int( stream, difference, 127, NumCubes - 1 );
+    serialize_int( stream, difference, 127, MaxCubes - 1 );
     if ( Stream::IsReading )
         current = previous + difference;
 }
 
-template <typename Stream> void serialize_snapshot_relative_to_baseline( Stream & stream, CompressionState & compression_state, QuantizedSnapshot & current_snapshot, QuantizedSnapshot & baseline_snapshot )
+template <typename Stream> void serialize_snapshot_relative_to_baseline( Stream & stream, 
+                                                                         const CompressionState & compression_state, 
+                                                                         QuantizedSnapshot & current_snapshot, 
+                                                                         const QuantizedSnapshot & baseline_snapshot )
 {
-    QuantizedCubeState * quantized_cubes = &current_snapshot.cubes[0];
-    QuantizedCubeState * quantized_base_cubes = &baseline_snapshot.cubes[0];
-
     const int MaxChanged = 256;
 
-    int num_changed = 0;
+    SnapshotChanges changes;
+    SnapshotPrediction prediction;
+
     bool use_indices = false;
-    bool changed[NumCubes];
+
     if ( Stream::IsWriting )
     {
-        for ( int i = 0; i < NumCubes; ++i )
-        {
-            changed[i] = quantized_cubes[i] != quantized_base_cubes[i];
-            if ( changed[i] )
-                num_changed++;
-        }
+        calculate_snapshot_changes( current_snapshot, baseline_snapshot, compression_state, changes, prediction );
 
-        if ( num_changed > 0 )
+        if ( changes.num_changed > 0 )
         {
-            int relative_index_bits = count_relative_index_bits( changed );
-            if ( num_changed <= MaxChanged && relative_index_bits <= NumCubes )
+            int relative_index_bits = count_relative_index_bits( changes );
+            if ( changes.num_changed <= MaxChanged && relative_index_bits <= MaxCubes )
                 use_indices = true;
         }
     }
+    else
+    {
+        // cubes that are not sent are the same as the baseline
+
+        predict_snapshot( baseline_snapshot, compression_state, prediction );
+
+        current_snapshot = baseline_snapshot;
+    }
+
+    serialize_category( stream, PACKET_CATEGORY_INDEX );
 
     serialize_bool( stream, use_indices );
 
     if ( use_indices )
     {
-        serialize_int( stream, num_changed, 1, MaxChanged );
+        serialize_int( stream, changes.num_changed, 1, MaxChanged );
 
         if ( Stream::IsWriting )
         {
+            // only walk the bits set in the changed mask
+
             int num_written = 0;
 
             bool first = true;
             int previous_index = 0;
 
-            for ( int i = 0; i < NumCubes; ++i )
+            for ( int word = 0; word < MaxCubes / 32; ++word )
             {
-                if ( changed[i] )
+                for ( uint32_t changed = changes.changed[word]; changed; changed &= changed - 1 )
                 {
+                    int i = word * 32 + __builtin_ctz( changed );
+
+                    serialize_category( stream, PACKET_CATEGORY_INDEX );
+
                     if ( first )
                     {
-                        serialize_int( stream, i, 0, NumCubes - 1 );
+                        serialize_int( stream, i, 0, MaxCubes - 1 );
                         first = false;
                     }
                     else
@@ -706,7 +1085,7 @@ template <typename Stream> void serialize_snapshot_relative_to_baseline( Stream
                         serialize_relative_index( stream, previous_index, i );
                     }
 
-                    serialize_cube_relative_to_base( stream, quantized_cubes[i], quantized_base_cubes[i], compression_state.delta_x[i], compression_state.delta_y[i], compression_state.delta_z[i] );
+                    serialize_cube_relative_to_base( stream, current_snapshot, baseline_snapshot, prediction, i );
 
                     num_written++;
 
@@ -714,54 +1093,86 @@ template <typename Stream> void serialize_snapshot_relative_to_baseline( Stream
                 }
             }
 
-            assert( num_written == num_changed );
+            assert( num_written == changes.num_changed );
         }
         else
         {
-            memset( changed, 0, sizeof( changed ) );
-
             int previous_index = 0;
 
-            for ( int j = 0; j < num_changed; ++j )
+            for ( int j = 0; j < changes.num_changed; ++j )
             {
+                serialize_category( stream, PACKET_CATEGORY_INDEX );
+
                 int i;
                 if ( j == 0 )
-                    serialize_int( stream, i, 0, NumCubes - 1 );
+                    serialize_int( stream, i, 0, MaxCubes - 1 );
                 else                                
                     serialize_relative_index( stream, previous_index, i );
 
-                serialize_cube_relative_to_base( stream, quantized_cubes[i], quantized_base_cubes[i], compression_state.delta_x[i], compression_state.delta_y[i], compression_state.delta_z[i] );
-
-                changed[i] = true;
+                serialize_cube_relative_to_base( stream, current_snapshot, baseline_snapshot, prediction, i );
 
                 previous_index = i;
             }
-
-            for ( int i = 0; i < NumCubes; ++i )
-            {
-                if ( !changed[i] )
-                    memcpy( &quantized_cubes[i], &quantized_base_cubes[i], sizeof( QuantizedCubeState ) );
-            }
         }
     }
     else
     {
-        for ( int i = 0; i < NumCubes; ++i )
+        for ( int i = 0; i < MaxCubes; ++i )
         {
-            serialize_bool( stream, changed[i] );
+            serialize_category( stream, PACKET_CATEGORY_INDEX );
 
-            if ( changed[i] )
-            {
-                serialize_cube_relative_to_base( stream, quantized_cubes[i], quantized_base_cubes[i], compression_state.delta_x[i], compression_state.delta_y[i], compression_state.delta_z[i] );
-            }
-            else if ( Stream::IsReading )
-            {
-                memcpy( &quantized_cubes[i], &quantized_base_cubes[i], sizeof( QuantizedCubeState ) );
-            }
+            bool changed;
+            if ( Stream::IsWriting )
+                changed = snapshot_cube_changed( changes, i );
+
+            serialize_bool( stream, changed );
+
+            if ( changed )
+                serialize_cube_relative_to_base( stream, current_snapshot, baseline_snapshot, prediction, i );
         }
     }
 }
 
+struct WorldBlock
+{
+    // everything a client needs to know about the world when it joins. sent down as a block
+    // in parallel with time synchronization. the snapshot is the client's first delta baseline.
+
+    uint64_t tick;
+    int num_cubes;
+    int entity_index[MaxCubes];
+    float scale[MaxCubes];
+    QuantizedSnapshot snapshot;
+};
+
+template <typename Stream> void serialize_world_block( Stream & stream, WorldBlock & block )
+{
+    serialize_uint64( stream, block.tick );
+    serialize_int( stream, block.num_cubes, 0, MaxCubes );
+
+    if ( Stream::IsReading )
+        memset( &block.snapshot, 0, sizeof( QuantizedSnapshot ) );
+
+    for ( int i = 0; i < block.num_cubes; ++i )
+    {
+        serialize_int( stream, block.entity_index[i], 0, MaxCubes - 1 );
+        serialize_float( stream, block.scale[i] );
+
+        QuantizedCubeState cube;
+        if ( Stream::IsWriting )
+            block.snapshot.GetCube( block.entity_index[i], cube );
+
+        serialize_bool( stream, cube.interacting );
+        serialize_int( stream, cube.position_x, -QuantizedPositionBoundXY, QuantizedPositionBoundXY );
+        serialize_int( stream, cube.position_y, -QuantizedPositionBoundXY, QuantizedPositionBoundXY );
+        serialize_int( stream, cube.position_z, 0, QuantizedPositionBoundZ );
+        serialize_object( stream, cube.orientation );
+
+        if ( Stream::IsReading )
+            block.snapshot.SetCube( block.entity_index[i], cube );
+    }
+}
+
 struct FrameCubeData
 {
     int orientation_largest;
@@ -776,24 +1187,16 @@ struct FrameCubeData
 
 struct Frame
 {
-    FrameCubeData cubes[NumCubes];
+    FrameCubeData cubes[MaxCubes];
 };
 
-struct Packet
+inline void convert_frame_to_snapshot( const Frame & frame, QuantizedSnapshot & snapshot )
 {
-    int size;
-    uint8_t data[MaxPacketSize];
-};
-
-void convert_frame_to_snapshot( const Frame & frame, QuantizedSnapshot & snapshot )
-{
-    for ( int j = 0; j < NumCubes; ++j )
+    for ( int j = 0; j < MaxCubes; ++j )
     {
         assert( frame.cubes[j].orientation_largest >= 0 );
         assert( frame.cubes[j].orientation_largest <= 3 );
 
-        snapshot.cubes[j].orientation.largest = frame.cubes[j].orientation_largest;
-
         assert( frame.cubes[j].orientation_a >= 0 );
         assert( frame.cubes[j].orientation_b >= 0 );
         assert( frame.cubes[j].orientation_c >= 0 );
@@ -802,9 +1205,12 @@ void convert_frame_to_snapshot( const Frame & frame, QuantizedSnapshot & snapsho
         assert( frame.cubes[j].orientation_b <= ( 1 << OrientationBits ) - 1 );
         assert( frame.cubes[j].orientation_c <= ( 1 << OrientationBits ) - 1 );
 
-        snapshot.cubes[j].orientation.integer_a = frame.cubes[j].orientation_a;
-        snapshot.cubes[j].orientation.integer_b = frame.cubes[j].orientation_b;
-        snapshot.cubes[j].orientation.integer_c = frame.cubes[j].orientation_c;
+        compressed_quaternion<OrientationBits> orientation;
+        orientation.largest = frame.cubes[j].orientation_largest;
+        orientation.integer_a = frame.cubes[j].orientation_a;
+        orientation.integer_b = frame.cubes[j].orientation_b;
+        orientation.integer_c = frame.cubes[j].orientation_c;
+        snapshot.orientation[j] = orientation.GetPacked();
 
         assert( frame.cubes[j].position_x >= -QuantizedPositionBoundXY );
         assert( frame.cubes[j].position_y >= -QuantizedPositionBoundXY );
@@ -814,13 +1220,13 @@ void convert_frame_to_snapshot( const Frame & frame, QuantizedSnapshot & snapsho
         assert( frame.cubes[j].position_y <= QuantizedPositionBoundXY );
         assert( frame.cubes[j].position_z <= QuantizedPositionBoundZ );
 
-        snapshot.cubes[j].position_x = frame.cubes[j].position_x;
-        snapshot.cubes[j].position_y = frame.cubes[j].position_y;
-        snapshot.cubes[j].position_z = frame.cubes[j].position_z;
+        snapshot.position_x[j] = frame.cubes[j].position_x;
+        snapshot.position_y[j] = frame.cubes[j].position_y;
+        snapshot.position_z[j] = frame.cubes[j].position_z;
 
         assert( frame.cubes[j].interacting == 0 || frame.cubes[j].interacting == 1 );
 
-        snapshot.cubes[j].interacting = frame.cubes[j].interacting;
+        snapshot.interacting[j] = frame.cubes[j].interacting;
     }
 }
 
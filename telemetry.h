@@ -0,0 +1,249 @@
+// Copyright © 2015, The Network Protocol Company, Inc. All Rights Reserved.
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include "const.h"
+#include "core.h"
+#include "packets.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+
+struct TelemetryCounters
+{
+    uint64_t packets_sent[NUM_PACKET_TYPES];
+    uint64_t bytes_sent[NUM_PACKET_TYPES];
+    uint64_t packets_received[NUM_PACKET_TYPES];
+    uint64_t bytes_received[NUM_PACKET_TYPES];
+    uint64_t sent_size_histogram[NUM_PACKET_TYPES][TelemetryHistogramBuckets];
+    uint64_t received_size_histogram[NUM_PACKET_TYPES][TelemetryHistogramBuckets];
+};
+
+struct TelemetrySample
+{
+    uint32_t packets_sent;
+    uint32_t bytes_sent;
+    uint32_t packets_received;
+    uint32_t bytes_received;
+};
+
+struct TelemetryHistory
+{
+    int num_samples;
+    int next_sample;
+    TelemetrySample current;                                // accumulating for the sample in progress
+    TelemetrySample samples[TelemetryHistorySize];
+};
+
+struct Telemetry
+{
+    double start_time;
+    double sample_time;                                     // time the sample in progress started
+    TelemetryCounters total;                                // all traffic, including packets from addresses not in a client slot
+    TelemetryHistory total_history;
+    TelemetryCounters client[MaxClients];
+    TelemetryHistory client_history[MaxClients];
+};
+
+inline void telemetry_reset_client( Telemetry & telemetry, int client_slot )
+{
+    assert( client_slot >= 0 );
+    assert( client_slot < MaxClients );
+    memset( &telemetry.client[client_slot], 0, sizeof( TelemetryCounters ) );
+    memset( &telemetry.client_history[client_slot], 0, sizeof( TelemetryHistory ) );
+}
+
+inline void telemetry_reset( Telemetry & telemetry, double real_time )
+{
+    memset( &telemetry, 0, sizeof( Telemetry ) );
+    telemetry.start_time = real_time;
+    telemetry.sample_time = real_time;
+}
+
+inline int telemetry_histogram_bucket( int packet_bytes )
+{
+    return min( packet_bytes / TelemetryHistogramBucketBytes, TelemetryHistogramBuckets - 1 );
+}
+
+inline void telemetry_add_sent( TelemetryCounters & counters, TelemetryHistory & history, int packet_type, int packet_bytes )
+{
+    counters.packets_sent[packet_type]++;
+    counters.bytes_sent[packet_type] += packet_bytes;
+    counters.sent_size_histogram[packet_type][telemetry_histogram_bucket( packet_bytes )]++;
+    history.current.packets_sent++;
+    history.current.bytes_sent += packet_bytes;
+}
+
+inline void telemetry_add_received( TelemetryCounters & counters, TelemetryHistory & history, int packet_type, int packet_bytes )
+{
+    counters.packets_received[packet_type]++;
+    counters.bytes_received[packet_type] += packet_bytes;
+    counters.received_size_histogram[packet_type][telemetry_histogram_bucket( packet_bytes )]++;
+    history.current.packets_received++;
+    history.current.bytes_received += packet_bytes;
+}
+
+inline void telemetry_packet_sent( Telemetry & telemetry, int client_slot, int packet_type, int packet_bytes )
+{
+    assert( packet_type >= 0 );
+    assert( packet_type < NUM_PACKET_TYPES );
+
+    telemetry_add_sent( telemetry.total, telemetry.total_history, packet_type, packet_bytes );
+
+    if ( client_slot != -1 )
+    {
+        assert( client_slot < MaxClients );
+        telemetry_add_sent( telemetry.client[client_slot], telemetry.client_history[client_slot], packet_type, packet_bytes );
+    }
+}
+
+inline void telemetry_packet_received( Telemetry & telemetry, int client_slot, int packet_type, int packet_bytes )
+{
+    assert( packet_type >= 0 );
+    assert( packet_type < NUM_PACKET_TYPES );
+
+    telemetry_add_received( telemetry.total, telemetry.total_history, packet_type, packet_bytes );
+
+    if ( client_slot != -1 )
+    {
+        assert( client_slot < MaxClients );
+        telemetry_add_received( telemetry.client[client_slot], telemetry.client_history[client_slot], packet_type, packet_bytes );
+    }
+}
+
+inline void telemetry_history_push( TelemetryHistory & history )
+{
+    history.samples[history.next_sample] = history.current;
+    history.next_sample = ( history.next_sample + 1 ) % TelemetryHistorySize;
+    history.num_samples = min( history.num_samples + 1, TelemetryHistorySize );
+    memset( &history.current, 0, sizeof( TelemetrySample ) );
+}
+
+inline void telemetry_update( Telemetry & telemetry, double real_time )
+{
+    // roll the per-second history forward. if the server stalled, push empty samples for the time we missed.
+
+    while ( real_time >= telemetry.sample_time + TelemetrySampleTime )
+    {
+        telemetry_history_push( telemetry.total_history );
+        for ( int i = 0; i < MaxClients; ++i )
+            telemetry_history_push( telemetry.client_history[i] );
+        telemetry.sample_time += TelemetrySampleTime;
+    }
+}
+
+inline void telemetry_write_histogram( FILE * file, const uint64_t * histogram )
+{
+    fprintf( file, "[" );
+    for ( int i = 0; i < TelemetryHistogramBuckets; ++i )
+        fprintf( file, "%s%" PRIu64, i > 0 ? "," : "", histogram[i] );
+    fprintf( file, "]" );
+}
+
+inline void telemetry_write_counters( FILE * file, const TelemetryCounters & counters, const char * indent )
+{
+    uint64_t packets_sent = 0;
+    uint64_t bytes_sent = 0;
+    uint64_t packets_received = 0;
+    uint64_t bytes_received = 0;
+
+    for ( int i = 0; i < NUM_PACKET_TYPES; ++i )
+    {
+        packets_sent += counters.packets_sent[i];
+        bytes_sent += counters.bytes_sent[i];
+        packets_received += counters.packets_received[i];
+        bytes_received += counters.bytes_received[i];
+    }
+
+    fprintf( file, "%s\"packets_sent\": %" PRIu64 ",\n", indent, packets_sent );
+    fprintf( file, "%s\"bytes_sent\": %" PRIu64 ",\n", indent, bytes_sent );
+    fprintf( file, "%s\"packets_received\": %" PRIu64 ",\n", indent, packets_received );
+    fprintf( file, "%s\"bytes_received\": %" PRIu64 ",\n", indent, bytes_received );
+    fprintf( file, "%s\"packet_types\": {\n", indent );
+
+    bool first = true;
+
+    for ( int i = 0; i < NUM_PACKET_TYPES; ++i )
+    {
+        if ( counters.packets_sent[i] == 0 && counters.packets_received[i] == 0 )
+            continue;
+
+        fprintf( file, "%s%s  \"%s\": { ", first ? "" : ",\n", indent, packet_type_string( i ) );
+        fprintf( file, "\"packets_sent\": %" PRIu64 ", \"bytes_sent\": %" PRIu64 ", ", counters.packets_sent[i], counters.bytes_sent[i] );
+        fprintf( file, "\"packets_received\": %" PRIu64 ", \"bytes_received\": %" PRIu64 ", ", counters.packets_received[i], counters.bytes_received[i] );
+        fprintf( file, "\"sent_size_histogram\": " );
+        telemetry_write_histogram( file, counters.sent_size_histogram[i] );
+        fprintf( file, ", \"received_size_histogram\": " );
+        telemetry_write_histogram( file, counters.received_size_histogram[i] );
+        fprintf( file, " }" );
+
+        first = false;
+    }
+
+    fprintf( file, "\n%s}", indent );
+}
+
+inline void telemetry_write_history( FILE * file, const TelemetryHistory & history, const char * indent )
+{
+    // oldest sample first, so the arrays can be graphed directly
+
+    uint32_t values[4][TelemetryHistorySize];
+
+    for ( int i = 0; i < history.num_samples; ++i )
+    {
+        const int index = ( history.next_sample - history.num_samples + i + TelemetryHistorySize ) % TelemetryHistorySize;
+        const TelemetrySample & sample = history.samples[index];
+        values[0][i] = sample.packets_sent;
+        values[1][i] = sample.bytes_sent;
+        values[2][i] = sample.packets_received;
+        values[3][i] = sample.bytes_received;
+    }
+
+    const char * names[] = { "packets_sent_per_second", "bytes_sent_per_second", "packets_received_per_second", "bytes_received_per_second" };
+
+    for ( int i = 0; i < 4; ++i )
+    {
+        fprintf( file, "%s\"%s\": [", indent, names[i] );
+        for ( int j = 0; j < history.num_samples; ++j )
+            fprintf( file, "%s%u", j > 0 ? "," : "", values[i][j] );
+        fprintf( file, "]%s\n", i < 3 ? "," : "" );
+    }
+}
+
+inline void telemetry_write_json( FILE * file, const Telemetry & telemetry, const bool * connected, double real_time )
+{
+    fprintf( file, "{\n" );
+    fprintf( file, "  \"uptime\": %.3f,\n", real_time - telemetry.start_time );
+    fprintf( file, "  \"sample_time\": %.3f,\n", TelemetrySampleTime );
+    fprintf( file, "  \"histogram_bucket_bytes\": %d,\n", TelemetryHistogramBucketBytes );
+    fprintf( file, "  \"total\": {\n" );
+    telemetry_write_counters( file, telemetry.total, "    " );
+    fprintf( file, ",\n" );
+    telemetry_write_history( file, telemetry.total_history, "    " );
+    fprintf( file, "  },\n" );
+    fprintf( file, "  \"clients\": [" );
+
+    bool first = true;
+
+    for ( int i = 0; i < MaxClients; ++i )
+    {
+        if ( !connected[i] )
+            continue;
+
+        fprintf( file, "%s\n    {\n", first ? "" : "," );
+        fprintf( file, "      \"slot\": %d,\n", i );
+        telemetry_write_counters( file, telemetry.client[i], "      " );
+        fprintf( file, ",\n" );
+        telemetry_write_history( file, telemetry.client_history[i], "      " );
+        fprintf( file, "    }" );
+
+        first = false;
+    }
+
+    fprintf( file, "%s]\n", first ? "" : "\n  " );
+    fprintf( file, "}\n" );
+}
+
+#endif // #ifndef TELEMETRY_H
@@ -0,0 +1,570 @@
+// Copyright © 2015, The Network Protocol Company, Inc. All Rights Reserved.
+
+#include "snapshot.h"
+#include "connection.h"
+#include "challenge.h"
+#include "send_rate.h"
+#include "packets.h"
+#include "game.h"
+#include "world.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// checks stay on in release builds, where assert compiles out
+
+#define check( condition )                                                                              \
+do                                                                                                      \
+{                                                                                                       \
+    if ( !( condition ) )                                                                               \
+    {                                                                                                   \
+        printf( "check failed: ( %s ), function %s, file %s, line %d\n", #condition, __FUNCTION__, __FILE__, __LINE__ );  \
+        exit( 1 );                                                                                      \
+    }                                                                                                   \
+} while ( 0 )
+
+void test_snapshot_delta_old_baseline()
+{
+    printf( "test_snapshot_delta_old_baseline\n" );
+
+    // the server has no position prediction across deltas, so a cube that moved a long way since an old baseline
+    // is sent relative to where it was in that baseline. it must come back exactly, however far it moved.
+
+    static QuantizedSnapshot baseline_snapshot;
+    static QuantizedSnapshot current_snapshot;
+    static QuantizedSnapshot read_snapshot;
+    static const CompressionState compression_state = {};
+
+    memset( &baseline_snapshot, 0, sizeof( QuantizedSnapshot ) );
+
+    for ( int i = 0; i < MaxCubes; ++i )
+    {
+        CubeState cube;
+        cube.position = vec3f( ( i % 32 ) - 16.0f, ( i / 32 ) - 16.0f, 0.2f );
+        cube.orientation = quat4f( 0, 0, 0, 1 );
+
+        QuantizedCubeState quantized;
+        quantize_cube_state( cube, false, quantized );
+        baseline_snapshot.SetCube( i, quantized );
+    }
+
+    current_snapshot = baseline_snapshot;
+
+    struct Move { int index; float x, y, z; };
+
+    const Move moves[] =
+    {
+        { 1,    10.0f,   0.0f,  0.0f },                    // the player cube pushed across the world
+        { 2,    -6.0f,   4.0f,  3.0f },
+        { 100,   0.0f,  -8.5f, 12.0f },                    // well above the ground
+        { 200,   1.9f,   1.9f,  0.0f },                    // just inside the relative delta range
+        { 300,   0.01f,  0.0f,  0.0f },                    // a small delta, for contrast
+        { 1023, 250.0f, 250.0f, 0.0f },                    // clamped at the position bound
+    };
+
+    for ( int i = 0; i < int( sizeof( moves ) / sizeof( Move ) ); ++i )
+    {
+        QuantizedCubeState quantized;
+        current_snapshot.GetCube( moves[i].index, quantized );
+
+        CubeState cube;
+        dequantize_cube_state( quantized, cube );
+        cube.position += vec3f( moves[i].x, moves[i].y, moves[i].z );
+
+        quantize_cube_state( cube, true, quantized );
+        current_snapshot.SetCube( moves[i].index, quantized );
+    }
+
+    static uint8_t buffer[MaxSnapshotBytes];
+
+    WriteStream write_stream( buffer, MaxSnapshotBytes );
+    serialize_snapshot_relative_to_baseline( write_stream, compression_state, current_snapshot, baseline_snapshot );
+    write_stream.Flush();
+
+    check( !write_stream.IsOverflow() );
+
+    const int bytes = ( write_stream.GetBytesProcessed() + 3 ) & ~3;
+
+    ReadStream read_stream( buffer, bytes );
+    serialize_snapshot_relative_to_baseline( read_stream, compression_state, read_snapshot, baseline_snapshot );
+
+    check( read_snapshot == current_snapshot );
+}
+
+void test_world_block_baseline()
+{
+    printf( "test_world_block_baseline\n" );
+
+    // the client's first delta is against the world block, which is usually seconds old by then. the block has to
+    // come down exactly as the server keeps it, and a delta against it has to read back even after everything moved
+
+    static WorldBlock block;
+    static WorldBlock read_block;
+    static QuantizedSnapshot current_snapshot;
+    static QuantizedSnapshot read_snapshot;
+    static const CompressionState compression_state = {};
+
+    memset( &block, 0, sizeof( WorldBlock ) );
+
+    block.tick = 100;
+    block.num_cubes = 0;
+
+    for ( int i = 1; i < MaxCubes; i += 3 )
+    {
+        CubeState cube;
+        cube.position = vec3f( ( i % 32 ) - 16.0f, ( i / 32 ) - 16.0f, 0.2f );
+        cube.orientation = quat4f( 0, 0, 0, 1 );
+
+        QuantizedCubeState quantized;
+        quantize_cube_state( cube, false, quantized );
+        block.snapshot.SetCube( i, quantized );
+
+        block.entity_index[block.num_cubes] = i;
+        block.scale[block.num_cubes] = 0.4f;
+        block.num_cubes++;
+
+        // seconds later, a quarter of the cubes have been scattered across the world
+
+        if ( ( block.num_cubes % 4 ) == 0 )
+        {
+            cube.position += vec3f( ( i % 7 ) * 3.0f - 9.0f, ( i % 5 ) * 4.0f - 8.0f, ( i % 3 ) * 2.0f );
+            quantize_cube_state( cube, true, quantized );
+        }
+
+        current_snapshot.SetCube( i, quantized );
+    }
+
+    static uint8_t buffer[MaxBlockSize];
+
+    WriteStream block_write_stream( buffer, MaxBlockSize );
+    serialize_world_block( block_write_stream, block );
+    block_write_stream.Flush();
+
+    check( !block_write_stream.IsOverflow() );
+
+    ReadStream block_read_stream( buffer, ( block_write_stream.GetBytesProcessed() + 3 ) & ~3 );
+    serialize_world_block( block_read_stream, read_block );
+
+    check( read_block.tick == block.tick );
+    check( read_block.num_cubes == block.num_cubes );
+    check( read_block.snapshot == block.snapshot );
+
+    WriteStream write_stream( buffer, MaxSnapshotBytes );
+    serialize_snapshot_relative_to_baseline( write_stream, compression_state, current_snapshot, block.snapshot );
+    write_stream.Flush();
+
+    check( !write_stream.IsOverflow() );
+
+    ReadStream read_stream( buffer, ( write_stream.GetBytesProcessed() + 3 ) & ~3 );
+    serialize_snapshot_relative_to_baseline( read_stream, compression_state, read_snapshot, read_block.snapshot );
+
+    check( read_snapshot == current_snapshot );
+}
+
+void test_connection_rtt()
+{
+    printf( "test_connection_rtt\n" );
+
+    // the server sends a packet every frame and the client acks each one it receives straight back. round trips
+    // alternate between 50 and 60ms and every tenth packet is dropped. the server measures all three from the acks
+
+    static ConnectionData server;
+    static ConnectionData client;
+    connection_reset( server );
+    connection_reset( client );
+
+    const int num_packets = 1000;
+
+    int num_dropped = 0;
+
+    for ( int i = 0; i < num_packets; ++i )
+    {
+        const double time = i * ( 1.0 / 60.0 );
+
+        ConnectionHeader header;
+        connection_write_header( server, header, time );
+
+        if ( ( i % 10 ) == 9 )
+        {
+            num_dropped++;
+            continue;
+        }
+
+        connection_process_header( client, header, time );
+
+        ConnectionHeader reply;
+        connection_write_header( client, reply, time );
+
+        const double rtt = ( i % 2 ) ? 0.06 : 0.05;
+
+        connection_process_header( server, reply, time + rtt );
+    }
+
+    check( fabs( server.rtt - 0.055 ) < 0.006 );
+    check( fabs( server.jitter - 0.005 ) < 0.002 );
+
+    // packets are only counted lost once they are too old to be acked, so the last few drops aren't counted yet
+
+    check( server.num_packets_acked == uint64_t( num_packets - num_dropped ) );
+    check( server.num_packets_lost <= uint64_t( num_dropped ) );
+    check( server.num_packets_lost >= uint64_t( num_dropped - 4 ) );
+    check( fabs( server.packet_loss - 0.1f ) < 0.05f );
+}
+
+void send_rate_test_period( SendRateData & send_rate_data, ConnectionData & connection, double & time, double rtt, double jitter, int num_lost )
+{
+    // one adjust period of traffic: 30 packets acked at the given rtt and jitter, plus some lost
+
+    connection.num_packets_acked += 30;
+    connection.num_packets_lost += num_lost;
+    connection.num_rtt_samples += 30;
+    connection.rtt = rtt;
+    connection.jitter = jitter;
+
+    time += SendRateAdjustTime;
+
+    send_rate_adjust( send_rate_data, connection, time );
+}
+
+void test_send_rate_rtt()
+{
+    printf( "test_send_rate_rtt\n" );
+
+    SendRateData send_rate_data;
+    ConnectionData connection;
+    connection_reset( connection );
+
+    double time = 0.0;
+
+    // a good connection stays at the maximum rate
+
+    for ( int i = 0; i < 5; ++i )
+        send_rate_test_period( send_rate_data, connection, time, 0.05, 0.002, 0 );
+
+    check( send_rate_data.snapshots_per_second == SnapshotsPerSecond );
+    check( send_rate_data.has_baseline );
+    check( fabs( send_rate_data.rtt_baseline - 0.05 ) < 0.001 );
+
+    // rtt climbs with no packet loss as a queue builds up. back off
+
+    send_rate_test_period( send_rate_data, connection, time, 0.05 + SendRateRTTThreshold * 2, 0.002, 0 );
+
+    check( send_rate_data.packet_loss == 0.0f );
+    check( send_rate_data.snapshots_per_second == SnapshotsPerSecond * SendRateBackOff );
+
+    // rtt comes back down. recover a step at a time
+
+    send_rate_test_period( send_rate_data, connection, time, 0.05, 0.002, 0 );
+
+    check( send_rate_data.snapshots_per_second == SnapshotsPerSecond * SendRateBackOff + SendRateRecovery );
+
+    // jitter rising on its own is also congestion
+
+    const double backed_off = send_rate_data.snapshots_per_second * SendRateBackOff;
+
+    send_rate_test_period( send_rate_data, connection, time, 0.05, 0.002 + SendRateJitterThreshold * 2, 0 );
+
+    check( send_rate_data.snapshots_per_second == backed_off );
+
+    // rtt slightly up but within the threshold is fine
+
+    send_rate_test_period( send_rate_data, connection, time, 0.05 + SendRateRTTThreshold * 0.5, 0.002, 0 );
+
+    check( send_rate_data.snapshots_per_second == backed_off + SendRateRecovery );
+
+    // a route that is slower for good becomes the new baseline, and the rate recovers all the way
+
+    for ( int i = 0; i < 200; ++i )
+        send_rate_test_period( send_rate_data, connection, time, 0.05 + SendRateRTTThreshold * 1.5, 0.002, 0 );
+
+    check( send_rate_data.rtt_baseline > 0.05 + SendRateRTTThreshold * 0.5 );
+    check( send_rate_data.snapshots_per_second == SnapshotsPerSecond );
+
+    // packet loss still backs off by itself
+
+    send_rate_test_period( send_rate_data, connection, time, 0.05 + SendRateRTTThreshold * 1.5, 0.002, 10 );
+
+    check( send_rate_data.snapshots_per_second == SnapshotsPerSecond * SendRateBackOff );
+}
+
+void test_connection_challenge()
+{
+    printf( "test_connection_challenge\n" );
+
+    // siphash-2-4 reference vector: key 00..0f, message 00..0e
+
+    uint8_t key[ChallengeKeyBytes];
+    uint8_t message[15];
+    for ( int i = 0; i < ChallengeKeyBytes; ++i )
+        key[i] = uint8_t( i );
+    for ( int i = 0; i < 15; ++i )
+        message[i] = uint8_t( i );
+
+    check( siphash24( key, message, 15 ) == 0xa129ca6149be45e5ULL );
+
+    // the token the client echoes back only matches for the address, guid, connect sequence and timestamp it was issued for
+
+    const Address address( 127, 0, 0, 1, 50000 );
+    const uint64_t client_guid = 0x1234567890ABCDEFULL;
+    const uint16_t connect_sequence = 1000;
+    const uint64_t timestamp = challenge_timestamp( 100.0 );
+
+    const uint64_t token = challenge_token( key, address, client_guid, connect_sequence, timestamp );
+
+    check( token == challenge_token( key, address, client_guid, connect_sequence, timestamp ) );
+    check( token != challenge_token( key, Address( 127, 0, 0, 2, 50000 ), client_guid, connect_sequence, timestamp ) );
+    check( token != challenge_token( key, Address( 127, 0, 0, 1, 50001 ), client_guid, connect_sequence, timestamp ) );
+    check( token != challenge_token( key, address, client_guid + 1, connect_sequence, timestamp ) );
+    check( token != challenge_token( key, address, client_guid, connect_sequence + 1, timestamp ) );
+    check( token != challenge_token( key, address, client_guid, connect_sequence, timestamp + 1 ) );
+
+    key[0] ^= 1;
+    check( token != challenge_token( key, address, client_guid, connect_sequence, timestamp ) );
+
+    // and only for a short time after it was issued
+
+    check( challenge_timestamp_valid( timestamp, 100.0 ) );
+    check( challenge_timestamp_valid( timestamp, 100.0 + ChallengeTimeout * 0.5 ) );
+    check( !challenge_timestamp_valid( timestamp, 100.0 + ChallengeTimeout * 1.5 ) );
+    check( !challenge_timestamp_valid( timestamp, 99.0 ) );
+}
+
+void test_connection_request_padding()
+{
+    printf( "test_connection_request_padding\n" );
+
+    // the server answers a connection request from an address it can't verify yet. the challenge it sends back
+    // must be no larger than the request, and the server must be able to tell a short request apart by its size
+
+    static uint8_t buffer[MaxPacketSize];
+
+    ConnectionRequestPacket request;
+    request.type = PACKET_TYPE_CONNECTION_REQUEST;
+    request.client_guid = 0x1234567890ABCDEFULL;
+    request.connect_sequence = 1000;
+
+    int request_bytes = 0;
+    WriteStream request_stream( buffer, MaxPacketSize );
+    check( write_packet( request_stream, request, request_bytes ) );
+
+    ConnectionChallengePacket challenge;
+    challenge.type = PACKET_TYPE_CONNECTION_CHALLENGE;
+    challenge.client_guid = ~0ULL;
+    challenge.connect_sequence = 0xFFFF;
+    challenge.server_guid = ~0ULL;
+    challenge.challenge_timestamp = ~0ULL;
+    challenge.challenge_token = ~0ULL;
+
+    int challenge_bytes = 0;
+    WriteStream challenge_stream( buffer + request_bytes, MaxPacketSize - request_bytes );
+    check( write_packet( challenge_stream, challenge, challenge_bytes ) );
+
+    check( challenge_bytes <= ConnectionRequestMinBytes );
+    check( request_bytes >= ConnectionRequestMinBytes );
+
+    check( peek_packet_type( buffer, request_bytes ) == PACKET_TYPE_CONNECTION_REQUEST );
+
+    ConnectionRequestPacket read_request;
+    read_request.type = PACKET_TYPE_CONNECTION_REQUEST;
+    ReadStream read_stream( buffer, request_bytes );
+    int packet_type = -1;
+    typedef ReadStream Stream;
+    serialize_int( read_stream, packet_type, 0, NUM_PACKET_TYPES - 1 );
+    serialize_packet_body( read_stream, read_request );
+
+    check( !read_stream.IsOverflow() );
+    check( packet_type == PACKET_TYPE_CONNECTION_REQUEST );
+    check( read_request.client_guid == request.client_guid );
+    check( read_request.connect_sequence == request.connect_sequence );
+}
+
+// the test links game.cpp without a physics engine. this physics manager just records the forces applied to each object
+
+struct TestPhysics
+{
+    int num_objects = 0;
+    int num_forces[MaxPhysicsObjects];
+    vec3f force[MaxPhysicsObjects];
+};
+
+static TestPhysics test_physics;
+
+PhysicsManager::PhysicsManager() { internal = nullptr; }
+
+PhysicsManager::~PhysicsManager() {}
+
+int PhysicsManager::AddObject( int entity_index, const PhysicsObjectState & object_state, PhysicsShape shape, float scale )
+{
+    assert( test_physics.num_objects < MaxPhysicsObjects );
+    return test_physics.num_objects++;
+}
+
+void PhysicsManager::ApplyForce( int index, const vec3f & force )
+{
+    test_physics.num_forces[index]++;
+    test_physics.force[index] += force;
+}
+
+void PhysicsManager::ApplyTorque( int index, const vec3f & torque ) {}
+
+static void test_physics_clear_forces()
+{
+    for ( int i = 0; i < MaxPhysicsObjects; ++i )
+    {
+        test_physics.num_forces[i] = 0;
+        test_physics.force[i] = vec3f(0,0,0);
+    }
+}
+
+void test_player_push()
+{
+    printf( "test_player_push\n" );
+
+    // a player pushing in the middle of a grid of cubes. the spatial grid must find every cube inside the push radius,
+    // so each one is pushed exactly once, and nothing outside it is pushed at all
+
+    World world;
+    world.entity_manager = new EntityManager();
+    world.physics_manager = new PhysicsManager();
+    world.cube_manager = new CubeManager( world.entity_manager, world.physics_manager );
+    world.spatial_grid = new SpatialGrid();
+
+    const vec3f player_position( 0.3f, -0.2f, 0.75f );
+
+    world_add_cube( world, player_position, 1.5f, true, ENTITY_PLAYER_BEGIN );
+
+    const vec3f push_origin( player_position.x(), player_position.y(), -0.1f );
+
+    const float push_radius = 2.0f;
+
+    int num_inside = 0;
+
+    for ( int y = -8; y <= 8; ++y )
+    {
+        for ( int x = -8; x <= 8; ++x )
+        {
+            if ( x == 0 && y == 0 )
+                continue;
+            CubeEntity * cube = world.cube_manager->CreateCube( vec3f( x * 0.5f, y * 0.5f, 0.2f ), 0.4f, true );
+            check( cube );
+            if ( length_squared( cube->position - push_origin ) < push_radius * push_radius )
+                num_inside++;
+        }
+    }
+
+    check( num_inside > 0 );
+
+    Input input;
+    input.push = true;
+
+    test_physics_clear_forces();
+
+    game_process_player_inputs( world, &input, 1 );
+
+    int num_pushed = 0;
+
+    for ( int i = 0; i < MaxCubes; ++i )
+    {
+        if ( !world.cube_manager->allocated[i] )
+            continue;
+
+        const CubeEntity & cube = world.cube_manager->cubes[i];
+
+        if ( cube.entity_index == ENTITY_PLAYER_BEGIN )
+            continue;
+
+        const bool inside = length_squared( cube.position - push_origin ) < push_radius * push_radius;
+
+        check( test_physics.num_forces[cube.physics_index] == ( inside ? 1 : 0 ) );
+
+        if ( inside )
+        {
+            check( world.entity_manager->GetAuthority( cube.entity_index ) == ENTITY_PLAYER_BEGIN );
+            num_pushed++;
+        }
+    }
+
+    check( num_pushed == num_inside );
+
+    world_free( world );
+}
+
+void test_overlapping_push()
+{
+    printf( "test_overlapping_push\n" );
+
+    // two players pushing side by side, with a cube between them that is inside both push areas. the cube must
+    // be pushed exactly once per-tick, by whichever player has authority over it. players without cubes are skipped
+
+    static_assert( MaxPlayers >= 2, "needs two players" );
+
+    World world;
+    world.entity_manager = new EntityManager();
+    world.physics_manager = new PhysicsManager();
+    world.cube_manager = new CubeManager( world.entity_manager, world.physics_manager );
+    world.spatial_grid = new SpatialGrid();
+
+    const int player_a = ENTITY_PLAYER_BEGIN;
+    const int player_b = ENTITY_PLAYER_BEGIN + 1;
+
+    world_add_cube( world, vec3f( -1.5f, 0, 0.75f ), 1.5f, true, player_a );
+    world_add_cube( world, vec3f( +1.5f, 0, 0.75f ), 1.5f, true, player_b );
+
+    CubeEntity * shared_cube = world.cube_manager->CreateCube( vec3f( 0, 0, 0.2f ), 0.4f, true );
+    CubeEntity * far_cube = world.cube_manager->CreateCube( vec3f( 10, 10, 0.2f ), 0.4f, true );
+
+    check( shared_cube );
+    check( far_cube );
+
+    Input inputs[MaxPlayers];
+    for ( int i = 0; i < MaxPlayers; ++i )
+        inputs[i].push = true;
+
+    // nobody has authority over the shared cube. the first player to push it takes authority
+
+    test_physics_clear_forces();
+
+    game_process_player_inputs( world, inputs, MaxPlayers );
+
+    check( test_physics.num_forces[shared_cube->physics_index] == 1 );
+    check( test_physics.force[shared_cube->physics_index].x() > 0.0f );
+    check( world.entity_manager->GetAuthority( shared_cube->entity_index ) == player_a );
+    check( test_physics.num_forces[far_cube->physics_index] == 0 );
+
+    // the other player has authority over the shared cube. only they push it
+
+    world.entity_manager->SetAuthority( shared_cube->entity_index, player_b );
+
+    test_physics_clear_forces();
+
+    game_process_player_inputs( world, inputs, MaxPlayers );
+
+    check( test_physics.num_forces[shared_cube->physics_index] == 1 );
+    check( test_physics.force[shared_cube->physics_index].x() < 0.0f );
+    check( world.entity_manager->GetAuthority( shared_cube->entity_index ) == player_b );
+    check( test_physics.num_forces[far_cube->physics_index] == 0 );
+
+    world_free( world );
+}
+
+int main( int argc, char ** argv )
+{
+    test_snapshot_delta_old_baseline();
+
+    test_world_block_baseline();
+
+    test_connection_rtt();
+
+    test_send_rate_rtt();
+
+    test_connection_challenge();
+
+    test_connection_request_padding();
+
+    test_player_push();
+
+    test_overlapping_push();
+
+    printf( "all tests passed\n" );
+
+    return 0;
+}
@@ -0,0 +1,59 @@
+// Copyright © 2015, The Network Protocol Company, Inc. All Rights Reserved.
+
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <atomic>
+
+// lock-free handoff of the latest value from one producer thread to one consumer thread. the caller owns three
+// slots. the producer writes one, the consumer reads another, and the third holds the most recently published slot.
+// neither side ever waits on the other. the consumer skips values if the producer publishes faster than it reads.
+
+static const int TripleBufferFresh = 4;                     // set on the middle slot when it has been published but not yet acquired
+
+struct TripleBuffer
+{
+    int write_index = 0;                                    // producer only
+    int read_index = 1;                                     // consumer only
+    std::atomic<int> middle_index;
+
+    TripleBuffer() : middle_index( 2 ) {}
+};
+
+inline int triple_buffer_write_index( const TripleBuffer & buffer )
+{
+    return buffer.write_index;
+}
+
+inline void triple_buffer_publish( TripleBuffer & buffer )
+{
+    // swap the slot just written with the middle slot, marking it fresh
+
+    buffer.write_index = buffer.middle_index.exchange( buffer.write_index | TripleBufferFresh, std::memory_order_acq_rel ) & ~TripleBufferFresh;
+}
+
+inline bool triple_buffer_fresh( const TripleBuffer & buffer )
+{
+    // true if a slot has been published since the last acquire. only the consumer clears this, so it stays true until acquire
+
+    return ( buffer.middle_index.load( std::memory_order_relaxed ) & TripleBufferFresh ) != 0;
+}
+
+inline bool triple_buffer_acquire( TripleBuffer & buffer )
+{
+    // returns true and moves the read index to the newest published slot if there is one we haven't read
+
+    if ( !triple_buffer_fresh( buffer ) )
+        return false;
+
+    buffer.read_index = buffer.middle_index.exchange( buffer.read_index, std::memory_order_acq_rel ) & ~TripleBufferFresh;
+
+    return true;
+}
+
+inline int triple_buffer_read_index( const TripleBuffer & buffer )
+{
+    return buffer.read_index;
+}
+
+#endif // #ifndef TRIPLE_BUFFER_H
@@ -7,6 +7,7 @@
 #define VECTORIAL_SIMD4F_GNU_H
 
 #include <math.h>
+#include <stdint.h>
 #include <string.h>  // memcpy
 
 
@@ -140,6 +141,48 @@ vectorial_inline simd4f simd4f_cross3(simd4f l, simd4f r) {
 
 
 
+
+// comparison and selection. comparisons return a lane mask of all ones or all zeros
+
+typedef int32_t _simd4i __attribute__ ((vector_size (16)));
+
+vectorial_inline simd4f simd4f_cmplt(simd4f lhs, simd4f rhs) {
+    return (simd4f) (lhs < rhs);
+}
+
+vectorial_inline simd4f simd4f_cmpgt(simd4f lhs, simd4f rhs) {
+    return (simd4f) (lhs > rhs);
+}
+
+vectorial_inline simd4f simd4f_select(simd4f mask, simd4f a, simd4f b) {
+    const _simd4i m = (_simd4i) mask;
+    return (simd4f) ( ( m & (_simd4i) a ) | ( ~m & (_simd4i) b ) );
+}
+
+vectorial_inline int simd4f_movemask(simd4f mask) {
+    const _simd4i m = (_simd4i) mask;
+    return ( ( m[0] >> 31 ) & 1 ) | ( ( ( m[1] >> 31 ) & 1 ) << 1 ) | ( ( ( m[2] >> 31 ) & 1 ) << 2 ) | ( ( ( m[3] >> 31 ) & 1 ) << 3 );
+}
+
+vectorial_inline simd4f simd4f_min(simd4f lhs, simd4f rhs) {
+    return simd4f_select(simd4f_cmplt(lhs, rhs), lhs, rhs);
+}
+
+vectorial_inline simd4f simd4f_max(simd4f lhs, simd4f rhs) {
+    return simd4f_select(simd4f_cmpgt(lhs, rhs), lhs, rhs);
+}
+
+vectorial_inline simd4f simd4f_abs(simd4f v) {
+    const _simd4i mask = { 0x7FFFFFFF, 0x7FFFFFFF, 0x7FFFFFFF, 0x7FFFFFFF };
+    return (simd4f) ( (_simd4i) v & mask );
+}
+
+vectorial_inline simd4f simd4f_floor(simd4f v) {
+    simd4f ret = { floorf(simd4f_get_x(v)), floorf(simd4f_get_y(v)), floorf(simd4f_get_z(v)), floorf(simd4f_get_w(v)) };
+    return ret;
+}
+
+
 #ifdef __cplusplus
 }
 #endif
@@ -169,6 +169,51 @@ vectorial_inline simd4f simd4f_cross3(simd4f lhs, simd4f rhs) {
 
 
 
+
+// comparison and selection. comparisons return a lane mask of all ones or all zeros
+
+vectorial_inline simd4f simd4f_min(simd4f lhs, simd4f rhs) {
+    simd4f ret = vminq_f32(lhs, rhs);
+    return ret;
+}
+
+vectorial_inline simd4f simd4f_max(simd4f lhs, simd4f rhs) {
+    simd4f ret = vmaxq_f32(lhs, rhs);
+    return ret;
+}
+
+vectorial_inline simd4f simd4f_abs(simd4f v) {
+    simd4f ret = vabsq_f32(v);
+    return ret;
+}
+
+vectorial_inline simd4f simd4f_cmplt(simd4f lhs, simd4f rhs) {
+    simd4f ret = vreinterpretq_f32_u32(vcltq_f32(lhs, rhs));
+    return ret;
+}
+
+vectorial_inline simd4f simd4f_cmpgt(simd4f lhs, simd4f rhs) {
+    simd4f ret = vreinterpretq_f32_u32(vcgtq_f32(lhs, rhs));
+    return ret;
+}
+
+vectorial_inline simd4f simd4f_select(simd4f mask, simd4f a, simd4f b) {
+    simd4f ret = vbslq_f32(vreinterpretq_u32_f32(mask), a, b);
+    return ret;
+}
+
+vectorial_inline int simd4f_movemask(simd4f mask) {
+    const uint32x4_t m = vreinterpretq_u32_f32(mask);
+    return ( vgetq_lane_u32(m, 0) >> 31 ) | ( ( vgetq_lane_u32(m, 1) >> 31 ) << 1 ) | ( ( vgetq_lane_u32(m, 2) >> 31 ) << 2 ) | ( ( vgetq_lane_u32(m, 3) >> 31 ) << 3 );
+}
+
+vectorial_inline simd4f simd4f_floor(simd4f v) {
+    const simd4f t = vcvtq_f32_s32(vcvtq_s32_f32(v));
+    const uint32x4_t one = vreinterpretq_u32_f32(vdupq_n_f32(1.0f));
+    return vsubq_f32(t, vreinterpretq_f32_u32(vandq_u32(vcgtq_f32(t, v), one)));
+}
+
+
 #ifdef __cplusplus
 }
 #endif
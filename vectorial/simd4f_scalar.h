@@ -7,6 +7,7 @@
 #define VECTORIAL_SIMD4F_SCALAR_H
 
 #include <math.h>
+#include <stdint.h>
 #include <string.h>  // memcpy
 
 #ifdef __cplusplus
@@ -138,6 +139,73 @@ vectorial_inline float simd4f_get_z(simd4f s) { return s.z; }
 vectorial_inline float simd4f_get_w(simd4f s) { return s.w; }
 
 
+
+// comparison and selection. comparisons return a lane mask of all ones or all zeros
+
+vectorial_inline float _simd4f_mask(int condition) {
+    const uint32_t bits = condition ? 0xFFFFFFFFu : 0;
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+vectorial_inline float _simd4f_select(float mask, float a, float b) {
+    uint32_t m, ia, ib;
+    memcpy(&m, &mask, sizeof(m));
+    memcpy(&ia, &a, sizeof(ia));
+    memcpy(&ib, &b, sizeof(ib));
+    const uint32_t bits = (ia & m) | (ib & ~m);
+    float f;
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+vectorial_inline simd4f simd4f_min(simd4f lhs, simd4f rhs) {
+    simd4f ret = { lhs.x < rhs.x ? lhs.x : rhs.x, lhs.y < rhs.y ? lhs.y : rhs.y, lhs.z < rhs.z ? lhs.z : rhs.z, lhs.w < rhs.w ? lhs.w : rhs.w };
+    return ret;
+}
+
+vectorial_inline simd4f simd4f_max(simd4f lhs, simd4f rhs) {
+    simd4f ret = { lhs.x > rhs.x ? lhs.x : rhs.x, lhs.y > rhs.y ? lhs.y : rhs.y, lhs.z > rhs.z ? lhs.z : rhs.z, lhs.w > rhs.w ? lhs.w : rhs.w };
+    return ret;
+}
+
+vectorial_inline simd4f simd4f_abs(simd4f v) {
+    simd4f ret = { fabsf(v.x), fabsf(v.y), fabsf(v.z), fabsf(v.w) };
+    return ret;
+}
+
+vectorial_inline simd4f simd4f_cmplt(simd4f lhs, simd4f rhs) {
+    simd4f ret = { _simd4f_mask(lhs.x < rhs.x), _simd4f_mask(lhs.y < rhs.y), _simd4f_mask(lhs.z < rhs.z), _simd4f_mask(lhs.w < rhs.w) };
+    return ret;
+}
+
+vectorial_inline simd4f simd4f_cmpgt(simd4f lhs, simd4f rhs) {
+    simd4f ret = { _simd4f_mask(lhs.x > rhs.x), _simd4f_mask(lhs.y > rhs.y), _simd4f_mask(lhs.z > rhs.z), _simd4f_mask(lhs.w > rhs.w) };
+    return ret;
+}
+
+vectorial_inline simd4f simd4f_select(simd4f mask, simd4f a, simd4f b) {
+    simd4f ret = { _simd4f_select(mask.x, a.x, b.x), _simd4f_select(mask.y, a.y, b.y), _simd4f_select(mask.z, a.z, b.z), _simd4f_select(mask.w, a.w, b.w) };
+    return ret;
+}
+
+vectorial_inline int _simd4f_sign_bit(float mask) {
+    uint32_t m;
+    memcpy(&m, &mask, sizeof(m));
+    return m >> 31;
+}
+
+vectorial_inline int simd4f_movemask(simd4f mask) {
+    return _simd4f_sign_bit(mask.x) | ( _simd4f_sign_bit(mask.y) << 1 ) | ( _simd4f_sign_bit(mask.z) << 2 ) | ( _simd4f_sign_bit(mask.w) << 3 );
+}
+
+vectorial_inline simd4f simd4f_floor(simd4f v) {
+    simd4f ret = { floorf(v.x), floorf(v.y), floorf(v.z), floorf(v.w) };
+    return ret;
+}
+
+
 #ifdef __cplusplus
 }
 #endif
@@ -7,6 +7,10 @@
 #define VECTORIAL_SIMD4F_SSE_H
 
 #include <xmmintrin.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include <math.h>
 #include <string.h>  // memcpy
 
 #ifdef __cplusplus
@@ -145,6 +149,54 @@ vectorial_inline float simd4f_get_z(simd4f s) { _simd4f_union u={s}; return u.f[
 vectorial_inline float simd4f_get_w(simd4f s) { _simd4f_union u={s}; return u.f[3]; }
 
 
+
+// comparison and selection. comparisons return a lane mask of all ones or all zeros
+
+vectorial_inline simd4f simd4f_min(simd4f lhs, simd4f rhs) {
+    simd4f ret = _mm_min_ps(lhs, rhs);
+    return ret;
+}
+
+vectorial_inline simd4f simd4f_max(simd4f lhs, simd4f rhs) {
+    simd4f ret = _mm_max_ps(lhs, rhs);
+    return ret;
+}
+
+vectorial_inline simd4f simd4f_abs(simd4f v) {
+    simd4f ret = _mm_andnot_ps(_mm_set1_ps(-0.0f), v);
+    return ret;
+}
+
+vectorial_inline simd4f simd4f_cmplt(simd4f lhs, simd4f rhs) {
+    simd4f ret = _mm_cmplt_ps(lhs, rhs);
+    return ret;
+}
+
+vectorial_inline simd4f simd4f_cmpgt(simd4f lhs, simd4f rhs) {
+    simd4f ret = _mm_cmpgt_ps(lhs, rhs);
+    return ret;
+}
+
+vectorial_inline simd4f simd4f_select(simd4f mask, simd4f a, simd4f b) {
+    simd4f ret = _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+    return ret;
+}
+
+vectorial_inline int simd4f_movemask(simd4f mask) {
+    return _mm_movemask_ps(mask);
+}
+
+vectorial_inline simd4f simd4f_floor(simd4f v) {
+#ifdef __SSE2__
+    const simd4f t = _mm_cvtepi32_ps(_mm_cvttps_epi32(v));
+    return _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, v), _mm_set1_ps(1.0f)));
+#else
+    _simd4f_union u = {v};
+    return simd4f_create(floorf(u.f[0]), floorf(u.f[1]), floorf(u.f[2]), floorf(u.f[3]));
+#endif
+}
+
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,151 @@
+/*
+  Vectorial
+  Copyright (c) 2010 Mikko Lehtonen
+  Licensed under the terms of the two-clause BSD License (see LICENSE)
+*/
+#ifndef VECTORIAL_SIMD4I_H
+#define VECTORIAL_SIMD4I_H
+
+#include "simd4f.h"
+#include <stdint.h>
+
+// four 32 bit signed integers. comparisons return a lane mask of all ones or all zeros
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+
+#if defined(VECTORIAL_SSE) && defined(__SSE2__)
+
+#include <emmintrin.h>
+
+typedef __m128i simd4i;
+
+vectorial_inline simd4i simd4i_splat(int32_t v) { return _mm_set1_epi32(v); }
+
+vectorial_inline simd4i simd4i_uload4(const int32_t *ary) { return _mm_loadu_si128((const __m128i*)ary); }
+
+vectorial_inline void simd4i_ustore4(const simd4i val, int32_t *ary) { _mm_storeu_si128((__m128i*)ary, val); }
+
+vectorial_inline simd4i simd4i_add(simd4i lhs, simd4i rhs) { return _mm_add_epi32(lhs, rhs); }
+
+vectorial_inline simd4i simd4i_sub(simd4i lhs, simd4i rhs) { return _mm_sub_epi32(lhs, rhs); }
+
+vectorial_inline simd4i simd4i_and(simd4i lhs, simd4i rhs) { return _mm_and_si128(lhs, rhs); }
+
+vectorial_inline simd4i simd4i_or(simd4i lhs, simd4i rhs) { return _mm_or_si128(lhs, rhs); }
+
+vectorial_inline simd4i simd4i_cmpeq(simd4i lhs, simd4i rhs) { return _mm_cmpeq_epi32(lhs, rhs); }
+
+vectorial_inline simd4i simd4i_cmpgt(simd4i lhs, simd4i rhs) { return _mm_cmpgt_epi32(lhs, rhs); }
+
+vectorial_inline simd4i simd4i_select(simd4i mask, simd4i a, simd4i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+vectorial_inline int simd4i_movemask(simd4i mask) { return _mm_movemask_ps(_mm_castsi128_ps(mask)); }
+
+vectorial_inline simd4f simd4i_to_simd4f(simd4i v) { return _mm_cvtepi32_ps(v); }
+
+vectorial_inline simd4i simd4f_to_simd4i(simd4f v) { return _mm_cvttps_epi32(v); }
+
+
+#elif defined(VECTORIAL_NEON)
+
+typedef int32x4_t simd4i;
+
+vectorial_inline simd4i simd4i_splat(int32_t v) { return vdupq_n_s32(v); }
+
+vectorial_inline simd4i simd4i_uload4(const int32_t *ary) { return vld1q_s32(ary); }
+
+vectorial_inline void simd4i_ustore4(const simd4i val, int32_t *ary) { vst1q_s32(ary, val); }
+
+vectorial_inline simd4i simd4i_add(simd4i lhs, simd4i rhs) { return vaddq_s32(lhs, rhs); }
+
+vectorial_inline simd4i simd4i_sub(simd4i lhs, simd4i rhs) { return vsubq_s32(lhs, rhs); }
+
+vectorial_inline simd4i simd4i_and(simd4i lhs, simd4i rhs) { return vandq_s32(lhs, rhs); }
+
+vectorial_inline simd4i simd4i_or(simd4i lhs, simd4i rhs) { return vorrq_s32(lhs, rhs); }
+
+vectorial_inline simd4i simd4i_cmpeq(simd4i lhs, simd4i rhs) { return vreinterpretq_s32_u32(vceqq_s32(lhs, rhs)); }
+
+vectorial_inline simd4i simd4i_cmpgt(simd4i lhs, simd4i rhs) { return vreinterpretq_s32_u32(vcgtq_s32(lhs, rhs)); }
+
+vectorial_inline simd4i simd4i_select(simd4i mask, simd4i a, simd4i b) { return vbslq_s32(vreinterpretq_u32_s32(mask), a, b); }
+
+vectorial_inline int simd4i_movemask(simd4i mask) {
+    return ( vgetq_lane_s32(mask, 0) & 1 ) | ( vgetq_lane_s32(mask, 1) & 2 ) | ( vgetq_lane_s32(mask, 2) & 4 ) | ( vgetq_lane_s32(mask, 3) & 8 );
+}
+
+vectorial_inline simd4f simd4i_to_simd4f(simd4i v) { return vcvtq_f32_s32(v); }
+
+vectorial_inline simd4i simd4f_to_simd4i(simd4f v) { return vcvtq_s32_f32(v); }
+
+
+#else
+
+typedef struct {
+    int32_t x;
+    int32_t y;
+    int32_t z;
+    int32_t w;
+} simd4i;
+
+vectorial_inline simd4i simd4i_create(int32_t x, int32_t y, int32_t z, int32_t w) {
+    simd4i s = { x, y, z, w };
+    return s;
+}
+
+vectorial_inline simd4i simd4i_splat(int32_t v) { return simd4i_create(v, v, v, v); }
+
+vectorial_inline simd4i simd4i_uload4(const int32_t *ary) { return simd4i_create(ary[0], ary[1], ary[2], ary[3]); }
+
+vectorial_inline void simd4i_ustore4(const simd4i val, int32_t *ary) {
+    ary[0] = val.x;
+    ary[1] = val.y;
+    ary[2] = val.z;
+    ary[3] = val.w;
+}
+
+vectorial_inline simd4i simd4i_add(simd4i lhs, simd4i rhs) { return simd4i_create(lhs.x + rhs.x, lhs.y + rhs.y, lhs.z + rhs.z, lhs.w + rhs.w); }
+
+vectorial_inline simd4i simd4i_sub(simd4i lhs, simd4i rhs) { return simd4i_create(lhs.x - rhs.x, lhs.y - rhs.y, lhs.z - rhs.z, lhs.w - rhs.w); }
+
+vectorial_inline simd4i simd4i_and(simd4i lhs, simd4i rhs) { return simd4i_create(lhs.x & rhs.x, lhs.y & rhs.y, lhs.z & rhs.z, lhs.w & rhs.w); }
+
+vectorial_inline simd4i simd4i_or(simd4i lhs, simd4i rhs) { return simd4i_create(lhs.x | rhs.x, lhs.y | rhs.y, lhs.z | rhs.z, lhs.w | rhs.w); }
+
+vectorial_inline simd4i simd4i_cmpeq(simd4i lhs, simd4i rhs) {
+    return simd4i_create(-(lhs.x == rhs.x), -(lhs.y == rhs.y), -(lhs.z == rhs.z), -(lhs.w == rhs.w));
+}
+
+vectorial_inline simd4i simd4i_cmpgt(simd4i lhs, simd4i rhs) {
+    return simd4i_create(-(lhs.x > rhs.x), -(lhs.y > rhs.y), -(lhs.z > rhs.z), -(lhs.w > rhs.w));
+}
+
+vectorial_inline simd4i simd4i_select(simd4i mask, simd4i a, simd4i b) {
+    return simd4i_or(simd4i_and(mask, a), simd4i_create(~mask.x & b.x, ~mask.y & b.y, ~mask.z & b.z, ~mask.w & b.w));
+}
+
+vectorial_inline int simd4i_movemask(simd4i mask) { return ( mask.x & 1 ) | ( mask.y & 2 ) | ( mask.z & 4 ) | ( mask.w & 8 ); }
+
+vectorial_inline simd4f simd4i_to_simd4f(simd4i v) { return simd4f_create((float)v.x, (float)v.y, (float)v.z, (float)v.w); }
+
+vectorial_inline simd4i simd4f_to_simd4i(simd4f v) {
+    return simd4i_create((int32_t)simd4f_get_x(v), (int32_t)simd4f_get_y(v), (int32_t)simd4f_get_z(v), (int32_t)simd4f_get_w(v));
+}
+
+#endif
+
+
+vectorial_inline simd4i simd4i_max(simd4i lhs, simd4i rhs) { return simd4i_select(simd4i_cmpgt(lhs, rhs), lhs, rhs); }
+
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
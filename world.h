@@ -4,6 +4,7 @@
 #include "platform.h"
 #include "entity.h"
 #include "cubes.h"
+#include "grid.h"
 #include <stdio.h>
 
 struct World
@@ -15,6 +16,7 @@ struct World
     EntityManager * entity_manager = nullptr;           // indexes entities in this world
     PhysicsManager * physics_manager = nullptr;         // the physics simulation
     CubeManager * cube_manager = nullptr;               // manager for cube entities
+    SpatialGrid * spatial_grid = nullptr;               // cube positions for player push/pull queries, rebuilt each tick
 };
 
 inline void world_init( World & world )
@@ -22,6 +24,7 @@ inline void world_init( World & world )
     world.entity_manager = new EntityManager();
     world.physics_manager = new PhysicsManager();
     world.cube_manager = new CubeManager( world.entity_manager, world.physics_manager );
+    world.spatial_grid = new SpatialGrid();
     world.physics_manager->Initialize();
 }
 
@@ -86,6 +89,7 @@ inline void world_free( World & world )
     delete world.entity_manager;
     delete world.physics_manager;
     delete world.cube_manager;
+    delete world.spatial_grid;
     world = World();
 }
 